@@ -0,0 +1,139 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <string>
+#include <utility>
+
+namespace MyServer {
+
+struct Cancellation;
+
+// Coroutine type for asynchronous handlers, e.g.
+//   server.registerHandler("/slow", Request::Method::GET, [](Request&) -> Async<Response> {
+//     co_await sleepFor(std::chrono::seconds{1});
+//     co_return Response { ... };
+//   });
+// Async handlers are started on the dispatch thread that read the request, and are always resumed there, so they
+// hold up nobody while they wait - but like inline handlers, anything they do between waits should be cheap.
+// Lazy: nothing runs until it is co_awaited.
+template <typename T>
+class Async {
+public:
+  struct promise_type {
+    std::optional<T> value {};
+    std::exception_ptr exception {};
+    std::coroutine_handle<> continuation {std::noop_coroutine()};
+
+    Async get_return_object() {
+      return Async { std::coroutine_handle<promise_type>::from_promise(*this) };
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    //hand straight back to whoever was awaiting us, rather than growing the stack
+    struct FinalAwaiter {
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> self) noexcept {
+        return self.promise().continuation;
+      }
+      void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    template <typename U>
+    void return_value(U&& result) { value.emplace(std::forward<U>(result)); }
+    void unhandled_exception() { exception = std::current_exception(); }
+  };
+
+  Async(Async&& other) noexcept: handle{std::exchange(other.handle, {})} {}
+  Async& operator=(Async&& other) noexcept {
+    if (this != &other) {
+      if (handle) handle.destroy();
+      handle = std::exchange(other.handle, {});
+    }
+    return *this;
+  }
+  Async(const Async&) = delete;
+  Async& operator=(const Async&) = delete;
+  ~Async() { if (handle) handle.destroy(); }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    handle.promise().continuation = awaiting;
+    return handle;
+  }
+  T await_resume() {
+    promise_type& promise = handle.promise();
+    if (promise.exception) std::rethrow_exception(promise.exception);
+    return std::move(*promise.value);
+  }
+
+private:
+  std::coroutine_handle<promise_type> handle;
+  explicit Async(std::coroutine_handle<promise_type> handle): handle{handle} {}
+};
+
+// Fire and forget: runs as soon as it's called, and frees itself when it finishes.
+// Used by the dispatch threads to drive an Async handler through to its response.
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    //whatever we run has to catch its own exceptions
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+/* things to co_await, driven by the event loop of the dispatch thread the coroutine is running on */
+// Each of these returns false (or nothing) if the server shut down while we were waiting, or the request was
+// cancelled (see Request::cancellation), in which case the handler should wrap up quickly. Sleeps and waits for an fd
+// end early for a cancelled request; reading a file runs to the end regardless, and still gives what it read.
+
+struct SleepFor {
+  std::chrono::steady_clock::duration duration;
+  bool cutShort {false};
+  //the request whose handler is waiting, picked up from the dispatch thread as we suspend
+  const Cancellation* cancellation {nullptr};
+
+  bool await_ready() const noexcept { return duration <= std::chrono::steady_clock::duration::zero(); }
+  void await_suspend(std::coroutine_handle<>);
+  bool await_resume() noexcept;
+};
+
+//waits for the socket to become readable/writable; only one coroutine may wait on a given fd at a time
+struct FdReady {
+  int fd;
+  unsigned events;
+  bool cutShort {false};
+  const Cancellation* cancellation {nullptr};
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<>);
+  bool await_resume() noexcept;
+};
+
+//reads the whole file on a worker thread, or gives nullopt if we couldn't
+struct ReadFile {
+  std::string path;
+  std::optional<std::string> contents {};
+  const Cancellation* cancellation {nullptr};
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<>);
+  std::optional<std::string> await_resume() noexcept;
+};
+
+inline SleepFor sleepFor(std::chrono::steady_clock::duration duration) { return { duration }; }
+SleepFor sleepUntil(std::chrono::steady_clock::time_point deadline);
+FdReady readable(int fd);
+FdReady writable(int fd);
+inline ReadFile readFile(std::string path) { return { std::move(path) }; }
+
+}
+
+#endif
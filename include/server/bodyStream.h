@@ -0,0 +1,113 @@
+#ifndef BODYSTREAM_H
+#define BODYSTREAM_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string_view>
+
+#include "utils/receiveBuffer.h"
+
+namespace MyServer {
+
+// A piece of a streamed body, straight out of the block it was read into (which it keeps around) - or for a piece too
+// small to be worth keeping a whole block for, out of a copy
+struct BodyChunk {
+  Utils::SharedBlock pinned;
+  std::string_view data;
+};
+
+// The body of a request to a streaming route, handed over a chunk at a time as it comes off the socket. The dispatch
+// thread pushes, and the handler (on a worker, as next() blocks) takes. Once more than `window` bytes are waiting
+// the dispatch thread stops reading from the client, and the handler wakes it back up by reading below the window.
+class BodyStream {
+private:
+  std::mutex lock;
+  std::condition_variable changed;
+  std::deque<BodyChunk> chunks {};
+  size_t buffered {0};
+  size_t window;
+  bool finished {false};
+  bool abandoned {false};
+  bool discarded {false};
+  std::function<void()> drained {};
+
+public:
+  explicit BodyStream(size_t window): window{window} {}
+
+  // blocks until there's more of the body - nothing means we've had all of it, or the client went away (see complete)
+  std::optional<BodyChunk> next() {
+    std::function<void()> wake;
+    std::optional<BodyChunk> chunk;
+    {
+      std::unique_lock held {lock};
+      changed.wait(held, [this]() { return !chunks.empty() || finished || abandoned; });
+      if (chunks.empty()) return {};
+      chunk = std::move(chunks.front());
+      chunks.pop_front();
+      bool wasFull = buffered >= window;
+      buffered -= chunk->data.size();
+      if (wasFull && buffered < window) wake = drained;
+    }
+    if (wake) wake();
+    return chunk;
+  }
+
+  // for once the handler is done with the request: whatever it didn't read is dropped, along with the rest as it comes
+  void discard() {
+    std::lock_guard held {lock};
+    discarded = true;
+    chunks.clear();
+    buffered = 0;
+  }
+
+  // whether we got the whole body, once next() has run out
+  bool complete() {
+    std::lock_guard held {lock};
+    return finished && !abandoned;
+  }
+
+  // these are for the dispatch thread
+  void push(BodyChunk chunk) {
+    if (chunk.data.empty()) return;
+    {
+      std::lock_guard held {lock};
+      if (discarded) return;
+      buffered += chunk.data.size();
+      chunks.push_back(std::move(chunk));
+    }
+    changed.notify_one();
+  }
+
+  void finish() {
+    { std::lock_guard held {lock}; finished = true; }
+    changed.notify_all();
+  }
+
+  void abandon() {
+    { std::lock_guard held {lock}; abandoned = true; }
+    changed.notify_all();
+  }
+
+  // whether anyone is still going to read what's pushed
+  bool wanted() {
+    std::lock_guard held {lock};
+    return !discarded;
+  }
+
+  size_t backlog() {
+    std::lock_guard held {lock};
+    return buffered;
+  }
+
+  void onDrained(std::function<void()> wake) {
+    std::lock_guard held {lock};
+    drained = std::move(wake);
+  }
+};
+
+}
+
+#endif
@@ -1,10 +1,18 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include <array>
 #include <atomic>
-#include <map>
-#include <mutex>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stop_token>
 #include <string>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <vector>
 
 #include "utils/logger.h"
 #include "server/parseHTTP.h"
@@ -13,39 +21,138 @@ namespace MyServer {
 
 class Client 
 {
+public:
+  enum class IOState { CONTINUE, ERROR, WOULDBLOCK, DONE };
+
+  // the most buffers (a head and a body for each response) we hand to the kernel in one go
+  static constexpr size_t maxGather = 64;
+  // the biggest string the ring keeps around to write a head into
+  static constexpr size_t spareCapacity = 512;
+
+  // what's handed to the kernel to send: a string of ours, or our share of a canned response
+  struct Outgoing {
+    std::string owned {};
+    CannedResponse canned {};
+    std::string_view bytes() const { return canned ? canned.rest() : std::string_view{owned}; }
+  };
+
+  // state for the io_uring backend, only touched by the owning dispatch thread
+  struct RingState {
+    //responses handed to the kernel, kept alive until their sends complete
+    std::deque<Outgoing> sending {};
+    //small strings (mostly heads) whose sends completed, to write the next heads into without allocating
+    std::vector<std::string> spares {};
+    size_t sentOffset {0}; //into the front of sending
+    //the sendmsg in flight points into sending through these
+    std::array<iovec, maxGather> iovecs {};
+    msghdr message {};
+    unsigned sendsInFlight {0};
+    bool receiving {false}; //whether our multishot recv is armed
+    bool cancelling {false};
+  };
+
 private:
-  HTTP::RequestParser httpParser {};
-  //we use the map as a queue
-  std::mutex queueMutex {};
-  std::map<unsigned long, std::string> outgoing;
-  int written {0};
+  HTTP::RequestParser httpParser;
+  // Responses wait in a ring indexed by their sequence number, which is big enough for every request we let the
+  // client have in flight (plus a 400). Whoever makes a response fills its slot and then sets `ready`, and the
+  // dispatch thread writes out the run of ready slots from writeSequence on, so nobody takes a lock.
+  // The head is formatted straight into the slot, whose string keeps its capacity from one response to the next, and
+  // the body is moved in from the handler and goes out after it as it is. A streamed response stays in its slot until
+  // its producer runs dry, head and body holding the chunk going out now. A canned response only puts its status
+  // line and Date in the head, and the rest goes out straight from the shared bytes in place of the body.
+  struct Slot {
+    std::atomic<bool> ready {false};
+    std::string head {};
+    std::string body {};
+    CannedResponse canned {};
+    BodyProducer more {};
+    bool chunkOpen {false}; //the body is a chunk whose \r\n is still to come
+    std::string_view bodyBytes() const { return canned ? canned.rest() : std::string_view{body}; }
+    size_t size() const { return head.size() + bodyBytes().size(); }
+  };
+  std::unique_ptr<Slot[]> slots;
+  size_t slotMask;
+  size_t written {0}; //bytes of the response at writeSequence we have already written, if a writev stopped partway
+  //whether we're between pieces of the streamed response at writeSequence, which is partway out even with written at 0
+  bool midStream {false};
+  //requests handed out whose responses we don't have yet - plus closingBit once we're closing, in the same word so that
+  //a worker letting go of us learns in the same step whether the dispatch thread is waiting on it to close us
   std::atomic<int> pending {0};
-  bool closing {false};
-  bool wrhup {false}; //client is no longer reading - happens on hup, error
+  static constexpr int closingBit = 1 << 30;
+  //bytes of responses we have but haven't written yet, including what the kernel has in flight on the ring
+  std::atomic<size_t> outgoingBytes {0};
+  //we stopped reading because the client went over its limits - set by the dispatch thread, read by write-through workers
+  std::atomic<bool> readPaused {false};
+  std::atomic<bool> closing {false};
+  //whether we've queued the response to the request the parser refused
+  bool answeredRejection {false};
+  //a Connection: close request whose body is still streaming in, so we can't stop reading until it's all here
+  bool closeAfterBody {false};
+  //whoever is writing to the socket: the dispatch thread, or a worker writing its response through
+  std::atomic<bool> writing {false};
+  std::atomic<bool> wrhup {false}; //client is no longer reading - happens on hup, error
   int fd {-1};
+  RingState ring {};
+  //stopped along with wrhup, for the cancellation tokens of our requests
+  std::stop_source hangup {};
 
-  unsigned long sequence = 0;
-  void resetSequence();
+  unsigned long sequence = 0; //given to the next request we parse
+  std::atomic<unsigned long> writeSequence {0}; //the next response to go out, only moved on by whoever holds `writing`
   void close();
+  //queues a 400 if the parser choked on what we just gave it, or stops reading if we've had all we want
+  void checkParse();
+
+  Slot& slotFor(unsigned long sequence);
+  void publish(unsigned long sequence, std::string&& response);
+  void publish(unsigned long sequence, Response&& response);
+  void fill(Slot& slot, Response&& response);
+  //a worker is done with us: whether we were waiting on it to close, so the dispatch thread has to hear of it
+  bool letGo();
+  //replaces what went out of a streamed response with its next piece, framed as a chunk
+  void refill(Slot& slot);
+  //done with what's at the front of the response at writeSequence, which retires it unless it's streamed
+  void advance();
+  size_t gather(std::span<iovec> iovecs);
+  //done with the response at writeSequence
+  void retire();
+  IOState writeReady();
 
   template <Logger::LogLevel level>
   void log(const std::string&);
   
 public:
-  enum class IOState { CONTINUE, ERROR, WOULDBLOCK, DONE };
-  Client(int fd): fd{fd} {};
+  //maxInFlight sizes the response ring, so the dispatch thread must never let the client have more requests in flight
+  Client(int fd, size_t maxInFlight, const HTTP::ParserOptions& parserOptions);
   int getfd();
 
   IOState handleRead();
   IOState handleWrite();
-  //used on shutdown to finish writing the currently progress response, if any
+  //used on shutdown to finish writing the response in progress, if any - all of it, for a streamed one
   IOState writeOne();
-  std::vector<Request> takeRequests();
+  //for when someone else did the reading - feeds the bytes to the parser
+  void consume(std::string_view input);
+  //for when someone else does the writing - moves out the responses that are next in line
+  size_t takeReady(std::deque<Outgoing>& into);
+  RingState& ringState();
+  //the rest are held in the parser until the next call
+  std::vector<Request> takeRequests(size_t limit = std::numeric_limits<size_t>::max());
+  //once everything before it has been taken, the status to refuse the request the parser gave up on with (just once)
+  std::optional<Response::StatusCode> takeRejection();
+  //unread bytes of the body the client is streaming to a handler
+  size_t streamBacklog() const;
+  //for the per-client limits: requests we have taken but not yet finished writing the response to, and their bytes
+  size_t inFlight() const;
+  size_t bufferedBytes() const;
+  //takes what went out off bufferedBytes - public for the ring, which does its own writing
+  void wroteBytes(size_t);
+  bool readingPaused() const;
+  void setReadingPaused(bool);
 
   unsigned long incrementSequence();
   bool isPending() const;
   bool isClosing() const;
   void setClosing();
+  std::stop_token hangupToken() const;
   bool notWriteable() const;
   void abort(bool withError);
 
@@ -55,7 +162,11 @@ public:
   Client(Client&) = delete;
   Client& operator=(Client&) = delete;
 
+  //for responses that are already whole, and nothing (for requests we skipped)
   bool addOutgoing(unsigned long sequence, std::string&& outboundStr);
+  bool addOutgoing(unsigned long sequence, Response&& response);
+  //as addOutgoing, but if the response is next in line and nobody is writing, we write it to the socket ourselves
+  bool writeThrough(unsigned long sequence, Response&& response);
 
   void initiateShutdown();
   ~Client();
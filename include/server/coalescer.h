@@ -0,0 +1,69 @@
+#ifndef COALESCER_H
+#define COALESCER_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "server/common.h"
+
+namespace MyServer {
+
+class Client;
+class Dispatch;
+
+// Single-flight for GETs to a route marked with Server::coalesce: while one request for a key (the endpoint and its
+// sorted query, see requestKey) is being handled, identical ones that come in wait on it rather than running the
+// handler themselves, and they all get its response. That's serialized once into a canned response, so each follower
+// only costs a reference count, and goes into its own client's slot like any other response.
+// A streamed response can't be shared, as its producer is only good for one client, so followers of one run the
+// handler themselves, one after another on the leader's worker - or spread over the workers, if the leader ran inline
+// on a dispatch thread.
+class Coalescer {
+private:
+  struct Follower {
+    Client* client;
+    Dispatch* owner;
+    unsigned long sequence;
+    Request request;
+  };
+
+  struct KeyHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view key) const { return std::hash<std::string_view>{}(key); }
+  };
+
+  std::mutex lock;
+  //a key is here for as long as its leader is running, with whoever has joined it since
+  std::unordered_map<std::string, std::vector<Follower>, KeyHash, std::equal_to<>> inFlight {};
+
+  //the follower's own run of the handler, for a leader whose response couldn't be shared
+  static void rerun(const Route& route, Follower& follower, std::chrono::nanoseconds inlineThreshold);
+  //puts the reply in the follower's slot, and wakes its dispatch thread if it has to
+  template <typename Reply>
+  static void answer(Follower& follower, Reply&& reply);
+
+public:
+  std::atomic<unsigned long> led {0};
+  std::atomic<unsigned long> followed {0};
+
+  // On the dispatch thread that owns the client: if an identical request is already running, this one joins it (and
+  // takes the client's next sequence number) and we're done with it. Otherwise it leads, and whoever runs it has to
+  // call finish with its response, or abandon
+  bool follow(Request& request, Client& client, Dispatch& owner);
+  // for a leader that's dropped without running, as its client went away - false if anyone joined it, in which case
+  // it has to run after all
+  bool abandon(const Request& request);
+  // hands the leader's response to everyone that joined it, and gives back the leader's own
+  Response finish(const Route& route, const Request& request, Response&& response,
+    std::chrono::nanoseconds inlineThreshold);
+};
+
+}
+
+#endif
@@ -2,63 +2,142 @@
 #define COMMON_H
 
 #include <asm-generic/socket.h>
+#include <atomic>
+#include <chrono>
 #include <cstring>
+#include <optional>
 #include <ostream>
 #include <sstream>
+#include <stop_token>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <unordered_map>
 #include <string>
 #include <functional>
+#include <memory>
 #include <utility>
 #include <iostream>
 
+#include "server/async.h"
+#include "server/request.h"
+
 namespace MyServer {
 
-using Query = std::unordered_map<std::string, std::string>;
+// what handlers get - a view into the connection's receive buffer (see server/request.h)
+using Request = RequestView;
 
-struct Request {
-  enum class Method { GET, POST, PUT, DELETE, NUM_METHODS };
-  Method method;
-  std::string endpoint;
-  Query query;
-  Query headers;
-  std::string body;
+// For a body too big to build all at once: each call gives the next piece of it (empty pieces are skipped), and
+// nothing once it's done. It's called on the dispatch thread each time the client has taken the last piece, so it
+// should be quick, and can't rely on anything the handler had on its stack.
+using BodyProducer = std::function<std::optional<std::string>()>;
+
+struct Response;
+class ResponseCache;
+class Coalescer;
+
+// A response that's the same every time, serialized once when it's made and never touched again. Copies share the
+// bytes, so any number of clients can have it queued at once for the price of a reference count. The Date header is
+// the one thing left out, as it's added when the response goes out so it stays current (see server/serialize.h).
+class CannedResponse {
+private:
+  std::shared_ptr<const std::string> bytes {};
+  size_t statusLength {0};
+
+public:
+  CannedResponse() = default;
+  //extraHeaders are whole header lines, each ending in \r\n
+  explicit CannedResponse(const Response& response, std::string_view extraHeaders = {});
+
+  explicit operator bool() const { return bytes != nullptr; }
+  std::string_view statusLine() const { return std::string_view{*bytes}.substr(0, statusLength); }
+  //the rest of the headers, the blank line and the body
+  std::string_view rest() const { return std::string_view{*bytes}.substr(statusLength); }
+  size_t size() const { return bytes->size(); }
 };
 
 struct Response {
   enum class StatusCode: unsigned {
     OK = 200,
+    NOT_MODIFIED = 304,
     BAD_REQUEST = 400,
     NOT_FOUND = 404,
+    PAYLOAD_TOO_LARGE = 413,
     IM_A_TEAPOT = 418,
     UNPROCESSABLE_ENTITY = 422,
+    REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
     INTERNAL_SERVER_ERROR = 500,
+    NOT_IMPLEMENTED = 501,
+    SERVICE_UNAVAILABLE = 503,
+    GATEWAY_TIMEOUT = 504,
   };
   enum class ContentType: unsigned {
     PLAINTEXT, JSON, NUM_CONTENTTYPES
   };
-  std::array<std::string_view, std::to_underlying(ContentType::NUM_CONTENTTYPES)> mimetypes {
-    "text/plain", "application/json"
-  };
-
   StatusCode statusCode;
   ContentType contentType;
   std::string body;
+  //if set, the body goes out with Transfer-Encoding: chunked, starting with `body` and followed by whatever this makes
+  BodyProducer stream {};
+  //if set, this goes out instead, and the rest is ignored - for replies that never change, made once up front
+  CannedResponse canned {};
 
-  std::string toHTTPResponse() {
-    std::stringstream out;
-    out << "HTTP/1.1 " << std::to_underlying(statusCode) << "\r\n";
-    out << "Content-Type: " << mimetypes[std::to_underlying(contentType)] << "; charset=US-ASCII\r\n";
-    out << "Content-Length: " << body.size() << "\r\n\r\n";
-    out << body;
-
-    return out.str();
-  }
+  //the whole thing in one string, for responses made once and sent as they are (see server/serialize.h)
+  std::string toHTTPResponse() const;
 };
 
 using Handler = std::function<Response(Request&)>;
-using HandlerMap = std::unordered_map<std::string, Handler>;
+using AsyncHandler = std::function<Async<Response>(Request&)>;
+
+enum class ExecutionPolicy {
+  // handed to the worker pool
+  WORKER,
+  // run straight on the dispatch thread - only for handlers that are cheap and never block
+  INLINE,
+  // starts on the worker pool, and moves to the dispatch thread while its handler stays quick
+  AUTO
+};
+
+struct Route {
+  // how many timings an AUTO route needs before we trust its average
+  static constexpr unsigned warmup = 64;
+
+  Handler handler;
+  //if set, handler is empty, and the policy doesn't matter - async handlers always run on the dispatch thread
+  AsyncHandler asyncHandler;
+  ExecutionPolicy policy;
+  //0 for none, otherwise requests get a 503 if they wait longer than this for a worker, and a 504 if the handler
+  //finishes after it
+  std::chrono::milliseconds deadline {0};
+  //the handler reads the body from request.bodyStream as it arrives, instead of getting it all in request.body
+  bool streamBody {false};
+  //set by Server::cache - GETs are answered from here while it has a fresh 200 for them, kept for cacheTTL
+  ResponseCache* cache {nullptr};
+  std::chrono::milliseconds cacheTTL {0};
+  //set by Server::coalesce - identical GETs share one run of the handler while it's going
+  Coalescer* coalescer {nullptr};
+  // AUTO only, updated by whichever thread ran the handler
+  mutable std::atomic<bool> inlined {false};
+  mutable std::atomic<long> averageNanos {0};
+  mutable std::atomic<unsigned> samples {0};
+
+  Route(Handler handler, ExecutionPolicy policy): handler{std::move(handler)}, policy{policy} {}
+  Route(AsyncHandler handler): asyncHandler{std::move(handler)}, policy{ExecutionPolicy::INLINE} {}
+
+  bool runInline() const {
+    return policy == ExecutionPolicy::INLINE || inlined.load(std::memory_order_relaxed);
+  }
+
+  // a racy moving average is fine, we only need a rough idea
+  // we come back off the dispatch thread at twice the threshold, so an endpoint near it doesn't flip every request
+  void record(std::chrono::nanoseconds took, std::chrono::nanoseconds threshold) const {
+    long average = averageNanos.load(std::memory_order_relaxed);
+    average += (took.count() - average) / 8;
+    averageNanos.store(average, std::memory_order_relaxed);
+    if (samples.fetch_add(1, std::memory_order_relaxed) < warmup) return;
+    if (average < threshold.count()) inlined.store(true, std::memory_order_relaxed);
+    else if (average > 2 * threshold.count()) inlined.store(false, std::memory_order_relaxed);
+  }
+};
 
 // the maximum number of bytes we will read/write from/to a client before continuing with the round robin
 constexpr size_t CHUNKSIZE = 4096;
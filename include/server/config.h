@@ -0,0 +1,102 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <chrono>
+#include <optional>
+#include <sched.h>
+#include <string>
+#include <string_view>
+
+namespace MyServer {
+
+// Settings are taken from (in increasing priority) the constructor argument, the file named by MYSERVER_CONFIG,
+// and the environment. The file holds `key = value` lines, with the keys being the environment variable names
+// without the MYSERVER_ prefix, e.g. `worker_threads = 16` for MYSERVER_WORKER_THREADS.
+struct ServerConfig {
+  enum class AcceptMode {
+    // the main thread accepts clients and hands them to the dispatch threads through a queue
+    HANDOVER,
+    // every dispatch thread owns a SO_REUSEPORT listener, and the kernel spreads connections between them
+    REUSEPORT
+  };
+
+  enum class IOBackend {
+    EPOLL,
+    // falls back to epoll if the kernel won't give us a ring
+    IO_URING
+  };
+
+  AcceptMode acceptMode { AcceptMode::HANDOVER };
+  IOBackend ioBackend { IOBackend::EPOLL };
+  // the most clients a dispatch thread will accept in one go before getting back to its existing clients
+  int acceptBatch { 64 };
+  // how long a dispatch thread keeps polling after it last had something to do, before blocking in epoll_wait
+  std::chrono::microseconds spinBudget { 200 };
+
+  // 0 picks a default from the number of cores: a quarter of them dispatch, and there's a worker for each
+  int dispatchThreads { 0 };
+  int workerThreads { 0 };
+  // the worker pool can be resized at runtime (SIGUSR1 grows it by one, SIGUSR2 shrinks it), up to this many
+  // 0 means twice workerThreads
+  int maxWorkerThreads { 0 };
+  // idle worker threads park rather than exit, and this many are kept parked however long they are idle
+  // 0 means half of workerThreads (but at least one)
+  int minWorkerThreads { 0 };
+  // how long a thread past the minimum stays parked before it exits - at most one exits per timeout, so a short lull
+  // doesn't tear down the whole pool just for the next burst to build it back up
+  std::chrono::milliseconds workerIdleTimeout { 5000 };
+  // start the minimum number of worker threads in go(), rather than on the first requests
+  bool prespawnWorkers { false };
+
+  // idle workers take tasks from busy workers' queues; off means a task waits for the worker it was given to
+  bool workStealing { true };
+
+  // per client limits on requests we've read but not finished answering, and on response bytes waiting to be written
+  // once a client is over either, we stop reading from it until it catches up; 0 for no limit on the bytes
+  // (the in-flight limit also sizes each client's response ring, so there always is one, and it's capped at
+  // maxInFlightCap)
+  static constexpr size_t maxInFlightCap = 4096;
+  size_t maxInFlightRequests { 64 };
+  size_t maxOutgoingBytes { 1 << 20 };
+
+  // a request whose request line and headers are bigger than this gets a 431, and one that says its body is bigger
+  // than maxBodyBytes gets a 413 before we read any of it - either way we hang up after answering. 0 for no limit
+  size_t maxHeaderBytes { 16384 };
+  size_t maxBodyBytes { 64 << 20 };
+  // bodies at least this big are written to an unlinked file in spoolDirectory as they arrive, and handed to the
+  // handler mapped back in, rather than held in memory; 0 keeps every body in memory
+  size_t spoolThreshold { 1 << 20 };
+  std::string spoolDirectory { "/tmp" };
+  // for routes that stream their body (Server::streamBody): how much of it we buffer for a handler that hasn't read
+  // it yet, before we stop reading from the client
+  size_t streamWindow { 256 << 10 };
+
+  // the most the response cache (Server::cache) holds, counting its bookkeeping - past it the least recently used
+  // responses go first. 0 for no limit
+  size_t cacheBytes { 64 << 20 };
+
+  // a client that closes its end while we still owe it responses is treated as gone: its queued handlers are skipped
+  // and running ones are cancelled. Off by default, as we can't tell that from a client that half-closes after its last
+  // request and still reads the answers - a hangup or error on the socket, or a failed write, cancels them regardless
+  bool cancelOnHangup { false };
+
+  // a worker whose response is next in line for an idle client writes it to the socket itself, rather than handing it
+  // to the dispatch thread (epoll only - with io_uring the kernel does the writing anyway)
+  bool writeThrough { true };
+
+  // AUTO routes run on the dispatch thread while their handlers average less than this
+  std::chrono::microseconds inlineThreshold { 20 };
+
+  // either a cpu list like "0-3,8" or a NUMA node like "node:1"; empty leaves the threads unpinned
+  // dispatch thread i is pinned to the i-th cpu of its set, the workers share theirs
+  std::string dispatchAffinity {};
+  std::string workerAffinity {};
+
+  //applies the file and environment overrides, and fills in the defaults
+  ServerConfig resolve() const;
+  static std::optional<cpu_set_t> parseAffinity(std::string_view);
+};
+
+}
+
+#endif
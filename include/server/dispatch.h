@@ -2,17 +2,26 @@
 #define DISPATCH_H
 
 #include <chrono>
+#include <coroutine>
+#include <functional>
+#include <memory>
+#include <queue>
 #include <random>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <thread>
 #include <unordered_map>
 
 #include "server/client.h"
+#include "server/common.h"
+#include "server/uring.h"
+#include "utils/concurrentQueue.h"
 #include "utils/readerBiasedSet.h"
 
 namespace MyServer {
 
 class Server;
+struct Task;
 
 class Dispatch {
 private:
@@ -25,31 +34,115 @@ private:
   std::chrono::time_point<std::chrono::system_clock> nextStatusUpdate {
     std::chrono::time_point<std::chrono::system_clock>::min()
   };
+  //the last time we had any work, used to decide when to stop spinning and block
+  std::chrono::time_point<std::chrono::steady_clock> lastBusy {};
 
   std::jthread thread;
+  //what our clients' parsers need from the config and the routes, filled in before the thread starts
+  HTTP::ParserOptions parserOptions {};
   std::unordered_map<int, Client> clients {};
   std::unordered_map<int, unsigned> pendingNotifications {};
   Utils::ReaderBiasedSet<int> clientsWantWrite {};
   int epollfd {-1};
+  //only used in REUSEPORT mode, set by the main thread before the first connection can arrive
+  std::atomic<int> listenfd {-1};
+  //eventfd in our epoll set, written by other threads to wake us up while we are blocked
+  int wakefd {-1};
+  std::atomic<bool> sleeping {false};
+
+  //only in IO_URING mode, in which case the epoll goes unused
+  static constexpr unsigned ringEntries = 1024;
+  static constexpr unsigned ringBuffers = 1024;
+  std::unique_ptr<Uring> ring {};
+  eventfd_t wakeBuffer {0};
+  bool acceptArmed {false};
+
+  //coroutines (from async handlers) waiting on us
+  struct Timer {
+    std::chrono::steady_clock::time_point deadline;
+    std::coroutine_handle<> coroutine;
+    bool* cutShort;
+    int fd {-1}; //if set, this is when to give up on the coroutine's wait for the fd, rather than resume it
+    bool operator>(const Timer& other) const { return deadline > other.deadline; }
+  };
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers {};
+  struct FdWaiter {
+    std::coroutine_handle<> coroutine;
+    bool* cutShort;
+  };
+  std::unordered_map<int, FdWaiter> fdWaiters {};
+  //ready to go, resumed at the end of the iteration so they never run in the middle of our own bookkeeping
+  std::vector<std::coroutine_handle<>> runnable {};
+  //posted by worker threads finishing jobs for our coroutines
+  Utils::ConcurrentQueue<std::coroutine_handle<>> posted {};
 
   //for basic load balancing
   std::minstd_rand eng {std::random_device{}()};
-  std::uniform_int_distribution<> dist {0, threadPoolSize - 1};
 
   void work(std::stop_token);
   void assumeClient(const int client);
+  void acceptClients();
   void dispatchRequest(Request&& request, Client& destination);
-  void doEpoll();
+  Detached runAsync(Request request, const Route& route, Client& client, unsigned long sequence);
+  //answers with a 504 at the deadline, unless the handler has answered first
+  Detached expire(
+    std::chrono::steady_clock::time_point deadline, std::shared_ptr<bool> answered, Client&, unsigned long sequence
+  );
+  void fdReady(int fd);
+  //the fd's waiter has gone, so we stop watching it for them
+  void stopWatching(int fd);
+  //returns how many coroutines ran
+  size_t resumeCoroutines();
+  //resume everything that's waiting with cutShort set, until nothing is left waiting
+  void abandonCoroutines();
+  void respond(Client&, unsigned long sequence, Response&& response);
+  void hungUp(Client&);
+  //the per client limits: once over, we stop reading from the client until its responses drain
+  bool overLimit(const Client&) const;
+  void dispatchRequests(Client&);
+  //for the ring, epoll just adds EPOLLIN back to the notifications
+  void resumeReading(Client&);
+  //hands the task to a worker, waiting if they are all full
+  void enqueue(Task&);
+  void processNotifications();
+  int waitTimeout(bool worked);
+  //returns the timeout to actually use, which is 0 if work came in while we were deciding to sleep
+  int prepareToSleep(int timeout);
+  void doEpoll(int timeout = 0);
+
+  //returns the number of completions handled
+  unsigned doRing(int timeout = 0);
+  void onReceive(const io_uring_cqe&);
+  void onSend(const io_uring_cqe&);
+  void submitSends(Client&);
+  void reapClient(std::unordered_map<int, Client>::iterator);
 
   //set to promise the SIGINT handler that we will start up no more worker threads
   std::atomic_flag exiting {false};
   void shutdown();
 public:
-  static constexpr int threadPoolSize = 6; 
+  //the dispatch thread we are running on, if any, for the awaitables in async.h
+  static thread_local Dispatch* current;
+  //the request whose async handler is running right now, so its waits can end once it's cancelled
+  const Cancellation* running {nullptr};
+  void addTimer(std::chrono::steady_clock::time_point deadline, std::coroutine_handle<>, bool* cutShort);
+  //gives up at the deadline, if there is one
+  void awaitFd(
+    int fd, unsigned events, std::coroutine_handle<>, bool* cutShort,
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()
+  );
+  //runs job on the worker pool; it may post() to resume a coroutine back on this thread
+  void offload(std::function<void()> job);
+  void post(std::coroutine_handle<>);
+  bool isExiting() const;
 
-  Dispatch(Server* parent);
+  //index picks our cpu out of the dispatch affinity set
+  Dispatch(Server* parent, int index);
+  void listen(int port);
   void join();
   void notifyForClient(int);
+  //returns false if we weren't blocked (so there was no need to wake us)
+  bool wake();
   void requestStop();
   void acknowledgeShutdown();
   ~Dispatch();
@@ -1,52 +1,150 @@
 #ifndef PARSEHTTP_H
 #define PARSEHTTP_H
 
+#include <array>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
 #include <string_view>
 #include <utility>
 
+#include "server/bodyStream.h"
 #include "server/common.h"
+#include "utils/receiveBuffer.h"
+#include "utils/spoolFile.h"
 
 namespace MyServer {
 namespace HTTP {
 
+// What the parser needs to know about the server (see the matching ServerConfig fields)
+struct ParserOptions {
+  size_t maxHeaderBytes { 16384 };
+  size_t maxBodyBytes { 64 << 20 };
+  size_t spoolThreshold { 1 << 20 };
+  std::string spoolDirectory { "/tmp" };
+  size_t streamWindow { 256 << 10 };
+  //whether the route the request is for takes its body as a stream
+  std::function<bool(Request::Method, std::string_view endpoint)> streamsBody {};
+};
+
 class RequestParser {
 private:
   enum class State {
-    PARSE_METHOD, PARSE_ENDPOINT, PARSE_QUERY_KEY, PARSE_QUERY_VALUE,
+    PARSE_METHOD, PARSE_ENDPOINT, PARSE_QUERY,
     FIND_HEADERS, PARSE_HEADER_KEY, PARSE_HEADER_VALUE, FIND_BODY,
-    PARSE_BODY, NUM_STATES
+    PARSE_BODY, PARSE_CHUNK_SIZE, PARSE_CHUNK_DATA, PARSE_CHUNK_END, PARSE_TRAILERS, NUM_STATES
   };
 
   //this stuff is because I wanted the compiler to generate the state jump table w/ a sort of pattern matching
   //more for fun than for good software engineering
-  using Action = void (RequestParser::*)(std::string_view);
+  using Action = size_t (RequestParser::*)(std::string_view);
   using StateActions = std::array<Action, std::to_underlying(State::NUM_STATES)>;
   template <int i> static consteval void instantiateActions(StateActions& actions);
   static consteval StateActions generateActions(); 
-  template <State state> void processHelper(std::string_view input);
+  template <State state> size_t processHelper(std::string_view input);
   static constexpr Action jumpToAction(State state);
 
+  // Rather than copying the input into strings a byte at a time as we go, everything we receive stays in the
+  // buffer and the states just remember where their token started, relative to the start of the current request
+  // (so that it survives the buffer moving the request to its front). Once the request is complete it's handed out as
+  // views of those tokens, pinning the block they're in.
+  struct Token {
+    size_t start {0};
+    size_t length {0};
+  };
+
+  // where the body goes: the buffer, like the rest of the request, or for big or streamed bodies, out of it as it comes
+  enum class Sink { BUFFER, SPOOL, STREAM };
+
   State state;
+  const ParserOptions* options;
   std::vector<Request> parsedRequests {};
-  Request currentRequest {};
-  std::string buffer {};
-  std::string auxbuffer {}; // used for the v of kv 
-  int count { 0 }; //used to count \r\n, etc 
+  //the request we're partway through
+  Request::Method method {Request::Method::GET};
+  Token endpoint {};
+  Token query {};
+  Token headers {};
+  std::array<std::optional<Token>, std::to_underlying(KnownHeader::NUM_KNOWN_HEADERS)> knownHeaders {};
+  size_t contentLength {0};
+  //for a chunked body kept in the buffer, the chunks are moved down one after another from bodyStart
+  size_t bodyStart {0};
+  size_t bodyLength {0};
+  Sink sink {Sink::BUFFER};
+  //while spooling, the request (everything but its body) waits here
+  Request spooling {};
+  std::optional<Utils::SpoolFile> spool {};
+  std::shared_ptr<BodyStream> stream {};
+  //once we've refused a request we don't parse anything else
+  std::optional<Response::StatusCode> rejection {};
+  Utils::ReceiveBuffer buffer {};
+  size_t requestStart {0}; //where the current request starts in the buffer
+  size_t tokenStart {0}; //where the current state's token starts, from requestStart
+  Token key {}; // the header name, while we take its value
+  size_t count { 0 }; //used to count \r\n, the bytes left of a body or chunk, etc
   bool error { false };
   bool fresh { true };
 
   static constexpr std::string_view httpnewline { "\r\n" };
+  //what a state returns when it has used all of its input and is waiting on more
+  static constexpr size_t needMore = std::numeric_limits<size_t>::max();
+  //plenty for a chunk size and any extensions
+  static constexpr size_t maxChunkLine = 1024;
 
-  void commitAndContinue(std::string_view);
+  //the request so far, as views into the buffer
+  Request makeRequest(Token body) const;
+  //the current request ends at input[head]; returns head, as the next request starts there
+  size_t commit(std::string_view input, size_t head, Token body);
+  //everything up to input[head] has been dealt with, and can go from the buffer
+  void consumed(std::string_view input, size_t head);
+  //nothing in the buffer is any use to us anymore (requests already parsed keep their part of it)
+  void dropBuffer();
+  //stops the parser for good, having answered whatever came before with `status`
+  size_t reject(Response::StatusCode status, std::string_view why);
+  //starts writing the body to a file, with whatever we have of it so far
+  bool startSpooling(std::string_view soFar);
+  //the next part of the body, to wherever it's going
+  bool deliver(std::string_view chunk);
+  //the body ends at input[head], and so does the request
+  size_t finishBody(std::string_view input, size_t head);
+  //the chunk size lines and trailers are meant to be short, so we don't wait forever for the end of one
+  size_t lineTooLong(std::string_view input, size_t limit, Response::StatusCode status);
+  bool inBody() const;
+  //feeds bytes that are already at the end of the buffer through the state machine
+  void parse(std::string_view input);
+  //`next`'s token starts at input[head]; returns head, the amount of input used by the state we're leaving
+  size_t moveTo(State next, std::string_view input, size_t head);
+  size_t offsetOf(const char* at) const;
+  std::string_view tokenUpTo(const char* end) const;
+  //the current state's token, up to input[head]
+  Token tokenTo(std::string_view input, size_t head) const;
+  std::string_view text(Token token) const;
 
 public:
   RequestParser();
+  RequestParser(const ParserOptions& options);
+  RequestParser(const RequestParser&) = delete;
+  RequestParser& operator=(const RequestParser&) = delete;
+  ~RequestParser();
   void process(std::string_view input);
+  //for reading straight into the parser's buffer: fill some of the space, then tell us how much
+  std::span<char> receiveSpace();
+  void received(size_t bytes);
   bool isError() const;
   bool isFresh() const;
   void reset();
   void clear();
-  std::vector<Request> takeRequests();
+  //the rest stay queued for the next call
+  std::vector<Request> takeRequests(size_t limit = std::numeric_limits<size_t>::max());
+  bool hasRequests() const;
+  //why we stopped parsing, if we did
+  std::optional<Response::StatusCode> rejected() const;
+  //whether we're partway through a body that's going straight to its handler
+  bool streamingBody() const;
+  //how much of the body being streamed right now its handler has yet to read
+  size_t streamBacklog() const;
 };
 
 }
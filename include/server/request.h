@@ -0,0 +1,139 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <stop_token>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "server/bodyStream.h"
+#include "utils/receiveBuffer.h"
+#include "utils/spoolFile.h"
+
+namespace MyServer {
+
+// Long running handlers can poll this to give up early, or subscribe to the client going away with a
+// std::stop_callback on clientGone (which runs on the dispatch thread that notices, so should be quick)
+struct Cancellation {
+  //stopped once nobody is going to read the response
+  std::stop_token clientGone {};
+  //from the endpoint's deadline, if it has one
+  std::chrono::steady_clock::time_point deadline { std::chrono::steady_clock::time_point::max() };
+
+  bool expired() const { return std::chrono::steady_clock::now() > deadline; }
+  bool requested() const { return clientGone.stop_requested() || expired(); }
+};
+
+// (name, value)s in the order they came in, the first N of them stored inline so the usual handful don't allocate
+template <size_t N>
+class Fields {
+public:
+  using Field = std::pair<std::string_view, std::string_view>;
+
+private:
+  std::array<Field, N> first {};
+  std::vector<Field> rest {};
+  size_t count {0};
+
+public:
+  void add(std::string_view name, std::string_view value) {
+    if (count < N) first[count] = {name, value};
+    else rest.emplace_back(name, value);
+    ++count;
+  }
+
+  size_t size() const { return count; }
+  //back to the first `size` of them
+  void truncate(size_t size) {
+    if (size >= count) return;
+    if (size < N) rest.clear();
+    else rest.resize(size - N);
+    count = size;
+  }
+  const Field& operator[](size_t i) const { return i < N ? first[i] : rest[i - N]; }
+
+  //the last one wins if a name turns up more than once
+  template <typename Equal>
+  std::optional<std::string_view> find(std::string_view name, Equal equal) const {
+    for (size_t i = count; i > 0; --i) {
+      if (equal((*this)[i - 1].first, name)) return (*this)[i - 1].second;
+    }
+    return {};
+  }
+};
+
+// The headers that change how we speak HTTP. The parser picks these out as it goes, so nobody has to search for them
+enum class KnownHeader { HOST, CONNECTION, CONTENT_LENGTH, CONTENT_TYPE, TRANSFER_ENCODING, EXPECT, NUM_KNOWN_HEADERS };
+
+// header names are case-insensitive
+bool equalsIgnoringCase(std::string_view a, std::string_view b);
+std::optional<KnownHeader> knownHeader(std::string_view name);
+// "<endpoint>?<query with its parameters sorted>", for telling identical GETs apart - in a string each thread keeps for
+// it, so it's only good until the thread's next call
+std::string_view requestKey(std::string_view endpoint, std::string_view rawQuery);
+
+// What a handler gets: the parts of the request as they are in the connection's receive buffer, which stays put for
+// as long as the request is around. Nothing is copied out, and the query and headers are only split up the first time
+// a handler asks for one of them - so a handler that doesn't look at the headers never pays for them.
+// The views are only good for the lifetime of the request, so copy out anything that has to outlive the handler.
+class RequestView {
+public:
+  enum class Method { GET, POST, PUT, DELETE, NUM_METHODS };
+  using QueryFields = Fields<8>;
+  using HeaderFields = Fields<16>;
+  using PathFields = Fields<4>;
+
+  Method method {Method::GET};
+  std::string_view endpoint {};
+  //everything between the ? and the space, if there was a ?
+  std::string_view rawQuery {};
+  //the header lines, each ending in \r\n, without the blank line after them
+  std::string_view rawHeaders {};
+  //for a big enough body, this is a file mapped into memory
+  std::string_view body {};
+  //only for routes that stream their body (Server::streamBody), in which case `body` stays empty
+  std::shared_ptr<BodyStream> bodyStream {};
+  //the known headers' values, trimmed, if they were sent
+  std::array<std::optional<std::string_view>, std::to_underlying(KnownHeader::NUM_KNOWN_HEADERS)> knownHeaders {};
+  //already parsed from the header, 0 if there wasn't one
+  size_t contentLength {0};
+  //what the route's {name}s and {name...} matched in the endpoint, filled in by the dispatch thread (see server/router.h)
+  PathFields pathParams {};
+  //filled in by the dispatch thread
+  Cancellation cancellation {};
+
+  RequestView() = default;
+  RequestView(Utils::SharedBlock pinned): pinned{std::move(pinned)} {}
+
+  std::optional<std::string_view> query(std::string_view key) const;
+  std::optional<std::string_view> param(std::string_view name) const;
+  std::optional<std::string_view> header(std::string_view name) const;
+  std::optional<std::string_view> header(KnownHeader known) const {
+    return knownHeaders[std::to_underlying(known)];
+  }
+  const QueryFields& queries() const;
+  //everything but the known headers, which have their own slots
+  const HeaderFields& headers() const;
+  //Connection: close - this is the last request the client wants answered
+  bool closesConnection() const;
+
+  void spooledTo(std::shared_ptr<const Utils::MappedFile> file) {
+    body = file->view();
+    spooled = std::move(file);
+  }
+
+private:
+  Utils::SharedBlock pinned {};
+  std::shared_ptr<const Utils::MappedFile> spooled {};
+  //only ever touched by whichever thread is running the handler
+  mutable std::optional<QueryFields> parsedQuery {};
+  mutable std::optional<HeaderFields> parsedHeaders {};
+};
+
+}
+
+#endif
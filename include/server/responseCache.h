@@ -0,0 +1,103 @@
+#ifndef RESPONSECACHE_H
+#define RESPONSECACHE_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "server/common.h"
+
+namespace MyServer {
+
+struct CacheStats {
+  //a 304 counts as a hit too
+  std::atomic<unsigned long> hits {0};
+  std::atomic<unsigned long> notModified {0};
+  std::atomic<unsigned long> misses {0};
+  std::atomic<unsigned long> stores {0};
+  //pushed out to stay under the byte limit, or found past their TTL
+  std::atomic<unsigned long> evictions {0};
+  std::atomic<unsigned long> expirations {0};
+  std::atomic<unsigned long> invalidations {0};
+  std::atomic<size_t> bytes {0};
+};
+
+// The 200s of cached routes (Server::cache), kept as canned responses with an ETag, so a hit is answered on the
+// dispatch thread for the price of a lookup and a reference count. Entries are keyed on the endpoint and the query
+// with its parameters sorted (GETs only), live for their route's TTL or until they're invalidated, and the least
+// recently used go once the cache is over its byte limit. It's split into shards by key, each with its own lock and
+// a share of the limit, so the dispatch threads don't all queue on one mutex.
+class ResponseCache {
+public:
+  using Clock = std::chrono::steady_clock;
+
+private:
+  struct Entry {
+    std::string key;
+    CannedResponse full;
+    //the same headers without the body, for a client that already has it
+    CannedResponse notModified;
+    std::string etag;
+    Clock::time_point expires;
+    size_t bytes;
+  };
+
+  struct KeyHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view key) const { return std::hash<std::string_view>{}(key); }
+  };
+
+  struct Shard {
+    std::mutex lock;
+    //most recently used at the front, and the index's keys are views into the entries' own
+    std::list<Entry> entries;
+    std::unordered_map<std::string_view, std::list<Entry>::iterator, KeyHash, std::equal_to<>> index;
+    size_t bytes {0};
+  };
+
+  static constexpr size_t shardCount = 16;
+  std::array<Shard, shardCount> shards {};
+  size_t maxShardBytes;
+  //bumped by every invalidation, so a response that was being made while one happened isn't kept
+  std::atomic<unsigned long> generations {0};
+  CacheStats stats {};
+
+  Shard& shardFor(std::string_view key);
+  //the caller holds the shard's lock
+  void erase(Shard& shard, std::list<Entry>::iterator entry);
+
+public:
+  //0 for no limit
+  explicit ResponseCache(size_t maxBytes);
+
+  ResponseCache(const ResponseCache&) = delete;
+  ResponseCache& operator=(const ResponseCache&) = delete;
+
+  // a fresh entry for the request, as a 200 or a 304 if its If-None-Match already has it
+  std::optional<Response> lookup(const Request& request);
+  // taken before the handler runs, and handed to store after
+  unsigned long generation() const { return generations.load(); }
+  // keeps a 200 (that isn't streamed or already canned) for ttl, and gives back what to send in its place - always the
+  // whole thing, even to a request with a matching If-None-Match, as identical requests may be sharing it
+  Response store(const Request& request, std::chrono::milliseconds ttl, Response&& response, unsigned long generation);
+  // drops every entry for the endpoint, or just the one for that query
+  void invalidate(std::string_view endpoint);
+  void invalidate(std::string_view endpoint, std::string_view query);
+
+  const CacheStats& statistics() const { return stats; }
+
+  // a strong validator made from the body: a quoted hash
+  static std::string etagFor(std::string_view body);
+  // If-None-Match is a list of (possibly weak) validators, or *
+  static bool matches(std::string_view ifNoneMatch, std::string_view etag);
+};
+
+}
+
+#endif
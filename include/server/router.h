@@ -0,0 +1,124 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "server/common.h"
+
+namespace MyServer {
+
+// Finds the route for a request's endpoint. A pattern is literal text, with {name} standing for a whole segment and a
+// {name...} at the end for the rest of the path, slashes and all (or nothing) - e.g. /todo/{id} or /static/{path...}.
+// Literal text wins over a {name}, and a {name} over a {name...}, falling back to the next when the better one leads
+// nowhere, so /todo/new can live alongside /todo/{id}.
+// It's a compressed radix trie: each node holds the run of text its children share. Routes are registered as a tree
+// of nodes owning their text, which is flattened into one array breadth first after each change, so a node's
+// children sit next to each other, their text is in one string, and their first bytes are in an array of their own -
+// picking the next node is a scan of a few bytes, and a lookup mostly walks forward through memory.
+// Even so, a hash lookup beats a walk for an endpoint that's all literal text (see test/benchmark/router.cpp), and
+// one that matches a pattern with no {name}s is always that pattern's, so those go through a hash map first.
+class Router {
+public:
+  using Captures = RequestView::PathFields;
+
+private:
+  static constexpr uint32_t none = UINT32_MAX;
+
+  struct Node {
+    //into text: the node's literal text, or for a {name} node, the name
+    uint32_t text {0};
+    uint32_t textLength {0};
+    //the children with literal text, firstChild onwards, in order of their first byte
+    uint32_t firstChild {0};
+    uint32_t children {0};
+    //the {name} child
+    uint32_t capture {none};
+    //into routes: for a path that ends here, and for one that carries on past here with a {name...}
+    uint32_t route {none};
+    uint32_t tail {none};
+    uint32_t tailName {0};
+    uint32_t tailNameLength {0};
+  };
+
+  //the tree we add to, which is what gets flattened
+  struct Building {
+    std::string text {};
+    std::vector<std::unique_ptr<Building>> children {};
+    std::unique_ptr<Building> capture {};
+    uint32_t route {none};
+    uint32_t tail {none};
+    std::string tailName {};
+  };
+
+  // so we can look up the request's endpoint without making a string out of it
+  struct EndpointHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view endpoint) const { return std::hash<std::string_view>{}(endpoint); }
+  };
+
+  struct Piece {
+    enum class Kind { TEXT, CAPTURE, TAIL } kind;
+    std::string_view value;
+  };
+
+  std::vector<Node> nodes {};
+  //the first byte of each node's text, by the same index
+  std::vector<char> firstBytes {};
+  std::string text {};
+  //routes hold atomics, so they stay where they are made
+  std::vector<std::unique_ptr<Route>> routes {};
+  std::unordered_map<std::string, uint32_t> byPattern {};
+  //into routes, for the patterns without any {name}s
+  std::unordered_map<std::string, uint32_t, EndpointHash, std::equal_to<>> literal {};
+  //how many patterns have one, as there's no need to walk the trie if none do
+  size_t captured {0};
+  Building root {};
+
+  //nothing if the pattern isn't one we understand, logged with why
+  static std::optional<std::vector<Piece>> parse(std::string_view pattern);
+  static Building* insertText(Building* node, std::string_view text);
+  bool insert(const std::vector<Piece>& pieces, uint32_t route, std::string_view pattern);
+  void flatten();
+  std::string_view textOf(uint32_t start, uint32_t length) const { return { text.data() + start, length }; }
+  //the literal child that rest starts with, if any
+  uint32_t staticChild(const Node& node, std::string_view rest) const;
+  const Route* match(uint32_t at, std::string_view rest, Captures& captures) const;
+
+public:
+  // Registers the pattern, replacing the route it had if it was already registered - nothing if it isn't a valid
+  // pattern, or clashes with another (a {name} in the same place under a different name)
+  template <typename... Args>
+  Route* add(const std::string& pattern, Args&&... args) {
+    if (auto known = byPattern.find(pattern); known != byPattern.end()) {
+      routes[known->second] = std::make_unique<Route>(std::forward<Args>(args)...);
+      return routes[known->second].get();
+    }
+    std::optional<std::vector<Piece>> pieces = parse(pattern);
+    if (!pieces || !insert(*pieces, routes.size(), pattern)) return nullptr;
+    routes.push_back(std::make_unique<Route>(std::forward<Args>(args)...));
+    byPattern.emplace(pattern, routes.size() - 1);
+    if (pieces->size() == 1 && pieces->front().kind == Piece::Kind::TEXT) literal.emplace(pattern, routes.size() - 1);
+    else ++captured;
+    flatten();
+    return routes.back().get();
+  }
+
+  // by the pattern it was registered with
+  Route* find(const std::string& pattern);
+  // the route for a request's endpoint, adding what its {name}s matched to captures
+  const Route* match(std::string_view endpoint, Captures& captures) const;
+  const Route* match(std::string_view endpoint) const;
+  size_t size() const { return routes.size(); }
+};
+
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <string_view>
+
+namespace MyServer::HTTP {
+
+// Finding the parser's delimiters, 32 (AVX2) or 16 (SSE4.2) bytes at a time where the cpu can, in the spirit of
+// picohttpparser. The best the cpu supports is picked the first time we scan, and the scalar version is always there
+// as a fallback (and for anything that's not x86).
+enum class ScanLevel { SCALAR, SSE42, AVX2 };
+
+// like std::string_view::find_first_of, for at most 16 delimiters
+size_t findFirstOf(std::string_view input, std::string_view delimiters);
+
+ScanLevel bestScanLevel();
+ScanLevel scanLevel();
+//for comparing the implementations - only takes effect if the cpu supports it, returns whether it did
+bool useScanLevel(ScanLevel level);
+std::string_view scanLevelName(ScanLevel level);
+
+}
+
+#endif
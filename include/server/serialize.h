@@ -0,0 +1,37 @@
+#ifndef SERIALIZE_H
+#define SERIALIZE_H
+
+#include <string>
+#include <string_view>
+
+#include "server/common.h"
+
+namespace MyServer::HTTP {
+
+// Writing out responses without a stringstream: the status line and headers are fixed fragments plus a couple of
+// numbers, so the head is sized up front and filled in with memcpys and to_chars. The body never goes through here -
+// it's sent as it is, straight after the head.
+
+// "HTTP/1.1 200 OK\r\n" and so on
+std::string_view statusLine(Response::StatusCode status);
+// "Content-Type: application/json; charset=US-ASCII\r\n" and so on
+std::string_view contentTypeHeader(Response::ContentType type);
+// "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n", remade at most once a second by each thread that asks
+std::string_view dateHeader();
+
+// The status line and headers for `response` (and for a streamed one, the size line of its first chunk) into `into`,
+// which is cleared but keeps its capacity - so a string that's reused for every head stops allocating after the first.
+void writeHead(const Response& response, std::string& into);
+// The part of a canned response that isn't canned: its status line and a fresh Date header
+void writeHead(const CannedResponse& canned, std::string& into);
+// "\r\n<size in hex>\r\n", or without the leading \r\n if it's the first chunk - 0 ends the body
+void writeChunkHead(size_t size, bool first, std::string& into);
+
+// The replies the server makes itself (404s, 400s, timeouts and so on), each serialized the first time it's asked for
+// and shared from then on: an empty body, and for a refusal, Connection: close as it's the last thing we'll say
+const CannedResponse& cannedStatus(Response::StatusCode status);
+const CannedResponse& cannedRefusal(Response::StatusCode status);
+
+}
+
+#endif
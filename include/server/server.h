@@ -1,11 +1,18 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <atomic>
+#include <csignal>
+#include <deque>
 #include <string>
 #include <sys/epoll.h>
 #include <utility>
 
+#include "server/config.h"
+#include "server/coalescer.h"
 #include "server/dispatch.h"
+#include "server/responseCache.h"
+#include "server/router.h"
 #include "server/common.h"
 #include "server/worker.h"
 #include "utils/concurrentQueue.h"
@@ -14,49 +21,73 @@ namespace MyServer {
 
 class Server {
 private:
-  static constexpr int numDispatchThreads = 2; //todo should be customisable
   Utils::ConcurrentQueue<int> incomingClientQueue {};
-  std::array<HandlerMap, std::to_underlying(Request::Method::NUM_METHODS)> handlers {};
-  int serverfd;
+  std::array<Router, std::to_underlying(Request::Method::NUM_METHODS)> routers {};
+  const ServerConfig config;
+  int serverfd {-1};
+  unsigned nextWake {0}; //only touched by the main thread
+  //the dispatch threads only hand work to the first activeWorkers of workerThreads
+  std::atomic<int> activeWorkers {0};
 
   void handover(int client);
+  void acceptLoop();
+  void waitForExit();
+  static int makeListener(int port, int flags);
 
   static std::atomic<bool> exiting;
   static std::vector<Server*> servers;
   static void sigint(int);
+  static void resizeSignal(int);
 
   friend class Dispatch;
 
-  template <typename ThreadType, size_t N, typename TupleType, size_t... Is>
-  static std::array<ThreadType, N> makeThreadsHelper(TupleType args, std::index_sequence<Is...>) {
-    return { ((void)Is, std::make_from_tuple<ThreadType>(args))...};
-  }
-  template <typename ThreadType, size_t N, typename... Args>
-  static std::array<ThreadType, N> makeThreads(Args... args) {
-    return makeThreadsHelper<ThreadType, N>(
-      std::forward_as_tuple(args...),
-      std::make_index_sequence<N>()
-    );
-  }
-
-  std::array<Worker, Dispatch::threadPoolSize> workerThreads;
-  std::array<Dispatch, numDispatchThreads> dispatchThreads;
+  //deques because neither of these can be moved, and emplace_back on a deque never has to
+  //both are filled in the constructor and never change size afterwards (the pool is resized through activeWorkers)
+  WorkerStats workerStats {};
+  ResponseCache responseCache;
+  Coalescer coalescer {};
+  std::deque<Worker> workerThreads;
+  std::deque<Dispatch> dispatchThreads;
 
 public:
-  Server():
-    dispatchThreads{makeThreads<Dispatch, numDispatchThreads>(this)},
-    workerThreads{makeThreads<Worker, Dispatch::threadPoolSize>()}
-  {}
+  Server(ServerConfig config = {});
 
   Server(const Server&) = delete;
   Server(const Server&&) = delete;
   Server& operator=(const Server&) = delete;
   Server& operator=(const Server&&) = delete;
 
-  void registerHandler(std::string endpoint, Request::Method method, Handler handler);
+  //routes can't be registered once the server is going
+  //the endpoint is a pattern, which may capture parts of the path, e.g. /todo/{id} (see server/router.h) - the other
+  //calls below that configure a route want the same pattern
+  void registerHandler(
+    std::string endpoint, Request::Method method, Handler handler, ExecutionPolicy policy = ExecutionPolicy::WORKER
+  );
+  void registerHandler(std::string endpoint, Request::Method method, AsyncHandler handler);
+  //see Route::deadline
+  void setDeadline(const std::string& endpoint, Request::Method method, std::chrono::milliseconds deadline);
+  //see Route::streamBody - the handler blocks waiting for the body, so it always runs on a worker
+  void streamBody(const std::string& endpoint, Request::Method method);
+  //GETs to the endpoint get their 200s cached for ttl (see server/responseCache.h)
+  void cache(const std::string& endpoint, std::chrono::milliseconds ttl);
+  //for handlers that change what a cached endpoint would say: every query of it, or just the one
+  //responses are cached under the path the client asked for, so this takes one too (/todo/42, not /todo/{id})
+  void invalidate(std::string_view endpoint);
+  void invalidate(std::string_view endpoint, std::string_view query);
+  const CacheStats& cacheStatistics() const { return responseCache.statistics(); }
+  //identical GETs to the endpoint that come in while one is running wait for its response (see server/coalescer.h)
+  //not for async handlers, which would hold their followers' requests across suspensions
+  void coalesce(const std::string& endpoint);
   void shutdown();
+  //clamped to [1, maxWorkerThreads], returns the new size
+  int resizeWorkerPool(int workers);
+  const WorkerStats& workerStatistics() const { return workerStats; }
 
   void go(int port);
+
+  //SIGINT and SIGTERM, which the main thread waits on (see waitForExit) - our other threads block them, so that
+  //neither can be handled on a thread that won't notice and leave the main thread asleep
+  static sigset_t exitSignals();
 };
 
 }
@@ -12,7 +12,10 @@ struct Task {
   Dispatch* owner;
   unsigned long sequence;
   Request request;
-  Handler handler;
+  //routes live in the server's handler maps, which don't change once we are serving
+  const Route* route;
+  //if set, the worker runs this instead of a handler, e.g. a blocking read on behalf of a coroutine
+  std::function<void()> job {};
 };
 
 }
@@ -0,0 +1,95 @@
+#ifndef URING_H
+#define URING_H
+
+#include <cstdint>
+#include <linux/io_uring.h>
+#include <span>
+#include <sys/socket.h>
+#include <vector>
+
+namespace MyServer {
+
+// Just enough of io_uring for the dispatch threads, talking to the kernel directly rather than through liburing.
+// Only the owning dispatch thread may submit or reap.
+class Uring {
+private:
+  int ringfd {-1};
+
+  void* sqRing {nullptr};
+  void* cqRing {nullptr};
+  size_t sqRingSize {0};
+  size_t cqRingSize {0};
+  io_uring_sqe* sqes {nullptr};
+  size_t sqesSize {0};
+
+  unsigned* sqHead; unsigned* sqTail; unsigned* sqMask; unsigned* sqArray;
+  unsigned* cqHead; unsigned* cqTail; unsigned* cqMask;
+  io_uring_cqe* cqes;
+
+  unsigned sqEntries {0};
+  unsigned localTail {0}; //sqes we have filled but not yet published to the kernel
+  unsigned unsubmitted {0};
+
+  // provided buffers for multishot receives - the kernel picks a buffer, and we hand it back once we are done with it
+  io_uring_buf_ring* bufferRing {nullptr};
+  size_t bufferRingSize {0};
+  std::vector<char> bufferMemory {};
+  unsigned bufferCount {0};
+  unsigned bufferSize {0};
+
+  int enter(unsigned toSubmit, unsigned minComplete, int timeoutMs);
+
+public:
+  // user_data layout: the operation in the top byte, the fd in the bottom 32 bits
+  enum class Op: uint8_t { ACCEPT = 1, RECV, SEND, WAKE, CANCEL, POLL };
+  static constexpr uint64_t userData(Op op, int fd) {
+    return (static_cast<uint64_t>(op) << 56) | static_cast<uint32_t>(fd);
+  }
+  static constexpr Op opOf(uint64_t data) { return static_cast<Op>(data >> 56); }
+  static constexpr int fdOf(uint64_t data) { return static_cast<int>(data & 0xffffffff); }
+
+  static constexpr uint16_t bufferGroup = 0;
+
+  //buffers must be a power of two
+  Uring(unsigned entries, unsigned buffers, unsigned bufferSize);
+  Uring(const Uring&) = delete;
+  Uring& operator=(const Uring&) = delete;
+  ~Uring();
+
+  //false if the kernel refused us (too old, or io_uring is disabled)
+  bool ok() const;
+
+  //never fails - submits what we have if the queue is full
+  io_uring_sqe* getSqe();
+  //submit everything queued, and wait up to timeoutMs for at least one completion (0 doesn't wait, -1 waits forever)
+  void submitAndWait(int timeoutMs);
+  bool hasCompletions() const;
+
+  template <typename F>
+  unsigned forEachCompletion(F&& handler) {
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    unsigned seen = 0;
+    for (; head != tail; ++head, ++seen) {
+      handler(cqes[head & *cqMask]);
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    return seen;
+  }
+
+  std::span<const char> buffer(uint16_t bufferId, size_t length) const;
+  void recycleBuffer(uint16_t bufferId);
+
+  void prepAccept(int listenfd);
+  void prepRecv(int fd);
+  //the message (and its iovecs) must stay put until the send completes
+  void prepSendmsg(int fd, const msghdr* message);
+  void prepRead(int fd, void* into, size_t length, uint64_t data);
+  void prepCancel(uint64_t target);
+  //one shot, for coroutines waiting on a socket
+  void prepPoll(int fd, unsigned events);
+};
+
+}
+
+#endif
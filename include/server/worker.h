@@ -1,24 +1,85 @@
 #ifndef WORKER_H
 #define WORKER_H
 
+#include "server/config.h"
 #include "server/task.h"
-#include <queue>
+#include "utils/boundedQueue.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sched.h>
 
 namespace MyServer {
 
-// didnt want to make the ConcurrentQueue virtual
+// shared by the whole pool, mostly so that we can check we aren't churning through threads
+struct WorkerStats {
+  //threads currently alive, parked or not
+  std::atomic<int> threads {0};
+  std::atomic<unsigned long> creations {0};
+  std::atomic<unsigned long> parks {0};
+  std::atomic<unsigned long> wakeups {0};
+  std::atomic<unsigned long> retirements {0};
+  //tasks dropped without running, as their client had gone
+  std::atomic<unsigned long> skipped {0};
+  //steady_clock ticks, used to let only one thread retire per idle timeout
+  std::atomic<std::chrono::steady_clock::rep> lastRetirement {0};
+};
+
+// Each worker has its own lock-free queue, which the dispatch threads push to without taking any locks.
+// A worker that runs out of its own tasks steals from the other workers' queues, and then parks on a futex until it's
+// given more work. Threads past the pool minimum exit once they have been parked for the idle timeout.
 class Worker
 {
 private:
-  mutable std::mutex queueMutex {};
-  std::queue<Task> taskQueue {};
-  //managed by the above mutex
-  bool deadOrDying {true};
+  enum State: uint32_t { DEAD, RUNNING, PARKED };
+
+  static constexpr size_t queueCapacity = 1024;
+  Utils::BoundedQueue<Task, queueCapacity> taskQueue {};
+  //a futex word: whoever moves us out of PARKED has to wake us
+  std::atomic<uint32_t> state {DEAD};
+  //only taken to replace the thread, never on the way to queueing a task
+  std::mutex lifecycleMutex {};
   std::jthread thread;
+  //applied to each thread we spin up, if set
+  const std::optional<cpu_set_t> affinity;
+  //the whole pool, including us, to steal from
+  std::deque<Worker>& pool;
+  WorkerStats& stats;
+  const ServerConfig& config;
+  //only touched by our thread, for picking victims
+  std::minstd_rand eng {std::random_device{}()};
 
-  void work(std::stop_token, Task&&);
+  void work(std::stop_token);
+  std::optional<Task> findTask();
+  void run(Task&);
+  //returns false if we should exit instead
+  bool park(std::stop_token);
+  bool mayRetire();
 public:
-  void add(Task&&);
+  Worker(std::deque<Worker>& pool, WorkerStats& stats, const ServerConfig& config, std::optional<cpu_set_t> affinity = {}):
+    affinity{affinity}, pool{pool}, stats{stats}, config{config} {}
+  ~Worker();
+
+  //runs the handler, turning any exceptions into error responses, and times it if the route is AUTO
+  //used directly by the dispatch threads for inline routes, and hands the response to any identical requests waiting
+  static Response execute(const Route&, Request&, std::chrono::nanoseconds inlineThreshold);
+  //execute, less the coalescing - for the followers of a coalesced request that have to run the handler themselves
+  static Response handle(const Route&, Request&, std::chrono::nanoseconds inlineThreshold);
+  //the response for a handler that threw
+  static Response fromException(std::exception_ptr);
+  //the responses for requests that missed their deadline, waiting for a worker or in the handler respectively
+  static Response unavailable();
+  static Response timedOut();
+
+  //returns false, leaving the task alone, if our queue is full
+  bool add(Task&);
+  //wakes or spins up our thread if it isn't running, e.g. to steal from a busy neighbour
+  void start();
+  bool busy() const;
   void requestStop();
   void waitForExit() const;
   //used only for diagnostics
@@ -0,0 +1,92 @@
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <optional>
+
+namespace MyServer::Utils {
+
+// Lock-free fixed capacity multi producer multi consumer queue (Dmitry Vyukov's design).
+// Each slot carries a sequence number saying whose turn it is: a producer may fill it when it equals the ticket the
+// producer claimed, and a consumer may empty it when it equals that ticket + 1. Claiming a ticket is a single CAS,
+// so nobody ever waits on anybody else unless the queue is completely full or empty.
+template <typename T, size_t Capacity>
+class BoundedQueue
+{
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    std::optional<T> value {};
+  };
+
+  static constexpr size_t mask = Capacity - 1;
+  std::array<Slot, Capacity> slots;
+  //on separate cache lines, as producers and consumers are usually different threads
+  alignas(64) std::atomic<size_t> enqueuePos {0};
+  alignas(64) std::atomic<size_t> dequeuePos {0};
+
+public:
+  BoundedQueue() {
+    for (size_t i = 0; i < Capacity; ++i) slots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  // returns false (leaving `value` alone) if the queue is full
+  bool push(T& value) {
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot& slot = slots[pos & mask];
+      size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+      if (difference == 0) {
+        if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          slot.value.emplace(std::move(value));
+          slot.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if (difference < 0) return false;
+      else pos = enqueuePos.load(std::memory_order_relaxed);
+    }
+  }
+
+  // returns immediately if there's nothing to take
+  std::optional<T> take() {
+    size_t pos = dequeuePos.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot& slot = slots[pos & mask];
+      size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos + 1);
+      if (difference == 0) {
+        if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          std::optional<T> result = std::move(slot.value);
+          slot.value.reset();
+          slot.sequence.store(pos + Capacity, std::memory_order_release);
+          return result;
+        }
+      }
+      else if (difference < 0) return {};
+      else pos = dequeuePos.load(std::memory_order_relaxed);
+    }
+  }
+
+  // both of these are only a snapshot, as other threads may be pushing and taking concurrently
+  size_t size() const {
+    size_t dequeued = dequeuePos.load(std::memory_order_acquire);
+    size_t enqueued = enqueuePos.load(std::memory_order_acquire);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+};
+
+}
+#endif
@@ -9,6 +9,7 @@
 #include <shared_mutex>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 #include <concepts>
 
 namespace MyServer::Utils {
@@ -69,6 +70,15 @@ public:
     }
   }
 
+  //a snapshot, for going through the map a bit at a time without holding the lock throughout
+  std::vector<K> keys() const {
+    std::shared_lock<std::shared_mutex> lock(rwLock);
+    std::vector<K> snapshot;
+    snapshot.reserve(map.size());
+    for (auto it = map.cbegin(); it != map.cend(); ++it) snapshot.push_back(it->first);
+    return snapshot;
+  }
+
   const MapType& getUnderlyingMap() const {
     return map;
   }
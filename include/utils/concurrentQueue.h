@@ -28,6 +28,11 @@ public:
     return result;
   }
 
+  bool empty() const {
+    std::lock_guard<std::mutex> lock {mutex};
+    return queue.empty();
+  }
+
   // you call this if you have nothing better to do
   void wait() {
     if (queue.empty()) {
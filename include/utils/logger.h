@@ -4,6 +4,7 @@
 #include <csignal>
 #include <cstring>
 #include <string>
+#include <string_view>
 #include <array>
 #include <syncstream>
 #include <thread>
@@ -37,20 +38,21 @@ void withGreeting(std::ostream& output, Args... args) {
   synced << std::endl;
 }
 
+//takes a view so that messages below the reporting level never get made into strings
 template <LogLevel level>
-inline void log(const std::string& message) {
+inline void log(std::string_view message) {
   if constexpr (std::to_underlying(reportingLevel) < std::to_underlying(level)) return;
   withGreeting<level>(std::cout, message);
 }
 
 template <>
-inline void log<LogLevel::ERROR>(const std::string& message) {
+inline void log<LogLevel::ERROR>(std::string_view message) {
   if constexpr (std::to_underlying(reportingLevel) < std::to_underlying(LogLevel::ERROR)) return;
   withGreeting<LogLevel::ERROR>(std::cerr, message, " (last error: ", strerror(errno), " (", errno, "))");
 }
 
 template <>
-inline void log<LogLevel::FATAL>(const std::string& message) {
+inline void log<LogLevel::FATAL>(std::string_view message) {
   if constexpr (std::to_underlying(reportingLevel) < std::to_underlying(LogLevel::FATAL)) return;
   std::cout.flush();
   withGreeting<LogLevel::FATAL>(
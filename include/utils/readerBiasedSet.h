@@ -24,6 +24,11 @@ public:
     set.insert(insertion);
   }
 
+  bool empty() {
+    std::lock_guard<std::mutex> readLock {readerMutex};
+    return set.empty();
+  }
+
   SetType take () {
     std::lock_guard<std::mutex> readLock {readerMutex};
     return std::exchange(set, {});
@@ -0,0 +1,177 @@
+#ifndef RECEIVEBUFFER_H
+#define RECEIVEBUFFER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <new>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <utility>
+
+#include "utils/boundedQueue.h"
+
+namespace MyServer::Utils {
+
+struct BlockHeader {
+  std::atomic<unsigned> references;
+  size_t capacity;
+};
+
+class SharedBlock;
+
+// Process wide pool of the blocks the connections receive into. A connection only holds a block while it's partway
+// through a request, so a server with lots of idle keep-alive connections doesn't hold a buffer for each of them,
+// and picking one up again is a pop off a lock-free queue rather than a trip to the allocator.
+class BufferPool {
+public:
+  static constexpr size_t blockSize = 16384;
+  static constexpr size_t maxPooled = 1024;
+
+  static SharedBlock take();
+
+private:
+  friend class SharedBlock;
+
+  //if the pool is full the block is just freed
+  static void give(BlockHeader* block);
+
+  static BoundedQueue<BlockHeader*, maxPooled>& blocks() {
+    static BoundedQueue<BlockHeader*, maxPooled> pooled {};
+    return pooled;
+  }
+};
+
+// A block along with a count of everyone looking at it: the connection's buffer, and every request parsed out of it
+// (which refer straight to its bytes). Whoever lets go last gives it back to the pool, on whichever thread that is.
+class SharedBlock {
+private:
+  BlockHeader* header {nullptr};
+
+  explicit SharedBlock(BlockHeader* header): header{header} {}
+  friend class BufferPool;
+
+  void drop() {
+    if (!header || header->references.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    if (header->capacity == BufferPool::blockSize) BufferPool::give(header);
+    else free(header);
+  }
+
+  static void free(BlockHeader* block) {
+    block->~BlockHeader();
+    ::operator delete(block);
+  }
+
+public:
+  //blocks of other sizes aren't pooled
+  static SharedBlock allocate(size_t capacity) {
+    void* memory = ::operator new(sizeof(BlockHeader) + capacity);
+    return SharedBlock { new (memory) BlockHeader { .references {1}, .capacity = capacity } };
+  }
+
+  SharedBlock() = default;
+  SharedBlock(const SharedBlock& other): header{other.header} {
+    if (header) header->references.fetch_add(1, std::memory_order_relaxed);
+  }
+  SharedBlock(SharedBlock&& other): header{std::exchange(other.header, nullptr)} {}
+  SharedBlock& operator=(SharedBlock other) {
+    std::swap(header, other.header);
+    return *this;
+  }
+  ~SharedBlock() { drop(); }
+
+  char* data() const { return reinterpret_cast<char*>(header + 1); }
+  size_t capacity() const { return header ? header->capacity : 0; }
+  //if not, we are the only one looking at it and it's ours to scribble on
+  bool shared() const { return header && header->references.load(std::memory_order_acquire) > 1; }
+  explicit operator bool() const { return header != nullptr; }
+  void reset() { drop(); header = nullptr; }
+};
+
+inline SharedBlock BufferPool::take() {
+  if (std::optional<BlockHeader*> block = blocks().take()) {
+    (*block)->references.store(1, std::memory_order_relaxed);
+    return SharedBlock { *block };
+  }
+  return SharedBlock::allocate(blockSize);
+}
+
+inline void BufferPool::give(BlockHeader* block) {
+  if (!blocks().push(block)) SharedBlock::free(block);
+}
+
+// A connection's unparsed input: the bytes [0, data().size()) of a block from the pool. Requests that don't fit in a
+// block get a bigger one from the allocator, which is freed rather than pooled once we're done with it.
+// Parsed requests pin() the block they were read into, so rather than moving what's left over to the front of a block
+// somebody is still reading from, we carry on in a fresh one.
+class ReceiveBuffer {
+private:
+  SharedBlock block {};
+  size_t used {0};
+
+  static SharedBlock blockFor(size_t wanted) {
+    if (wanted <= BufferPool::blockSize) return BufferPool::take();
+    size_t capacity = BufferPool::blockSize;
+    while (capacity < wanted) capacity *= 2;
+    return SharedBlock::allocate(capacity);
+  }
+
+  void grow(size_t wanted) {
+    SharedBlock bigger = blockFor(std::max(wanted, 2 * block.capacity()));
+    if (used > 0) std::memcpy(bigger.data(), block.data(), used);
+    block = std::move(bigger);
+  }
+
+public:
+  ReceiveBuffer() = default;
+  ReceiveBuffer(const ReceiveBuffer&) = delete;
+  ReceiveBuffer& operator=(const ReceiveBuffer&) = delete;
+
+  // room for at least `wanted` more bytes after what we have - fill some of it, then commit() what you filled
+  std::span<char> space(size_t wanted) {
+    if (used + wanted > block.capacity()) grow(used + wanted);
+    return { block.data() + used, block.capacity() - used };
+  }
+
+  void commit(size_t bytes) {
+    used += bytes;
+  }
+
+  std::string_view data() const {
+    return { block ? block.data() : nullptr, used };
+  }
+
+  //for rearranging bytes nobody has pinned a view of yet, like a chunked body being pieced back together
+  void moveWithin(size_t to, size_t from, size_t length) {
+    std::memmove(block.data() + to, block.data() + from, length);
+  }
+
+  //keeps everything we've received so far where it is, for as long as the returned block is around
+  SharedBlock pin() const {
+    return block;
+  }
+
+  // drops the first `bytes` (requests we're done with), moving whatever is left to the front
+  void discard(size_t bytes) {
+    if (bytes >= used) return release();
+    if (bytes == 0) return;
+    used -= bytes;
+    if (!block.shared()) {
+      std::memmove(block.data(), block.data() + bytes, used);
+      return;
+    }
+    SharedBlock fresh = blockFor(used);
+    std::memcpy(fresh.data(), block.data() + bytes, used);
+    block = std::move(fresh);
+  }
+
+  void release() {
+    used = 0;
+    block.reset();
+  }
+};
+
+}
+
+#endif
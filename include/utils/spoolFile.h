@@ -0,0 +1,86 @@
+#ifndef SPOOLFILE_H
+#define SPOOLFILE_H
+
+#include <cerrno>
+#include <fcntl.h>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+
+namespace MyServer::Utils {
+
+// A file mapped back into memory once it's complete, unmapped once the last request looking at it is done
+class MappedFile {
+private:
+  void* address {nullptr};
+  size_t size {0};
+
+public:
+  MappedFile(void* address, size_t size): address{address}, size{size} {}
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile() { if (address) munmap(address, size); }
+
+  std::string_view view() const { return { static_cast<const char*>(address), size }; }
+};
+
+// Somewhere to put a big request body as it arrives, rather than in memory. The file is never linked into the
+// directory (O_TMPFILE, or unlinked as soon as it's made), so it disappears with the last fd or mapping of it.
+// The writes go to the page cache, so doing them on the dispatch thread doesn't wait on the disk.
+class SpoolFile {
+private:
+  int fd {-1};
+  size_t written {0};
+
+  explicit SpoolFile(int fd): fd{fd} {}
+
+public:
+  static std::optional<SpoolFile> create(const std::string& directory) {
+    int fd = open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) {
+      std::string path = directory + "/myserver-spool-XXXXXX";
+      fd = mkostemp(path.data(), O_CLOEXEC);
+      if (fd < 0) return {};
+      unlink(path.c_str());
+    }
+    return SpoolFile {fd};
+  }
+
+  SpoolFile(const SpoolFile&) = delete;
+  SpoolFile& operator=(const SpoolFile&) = delete;
+  SpoolFile(SpoolFile&& other): fd{std::exchange(other.fd, -1)}, written{other.written} {}
+  SpoolFile& operator=(SpoolFile&& other) {
+    std::swap(fd, other.fd);
+    std::swap(written, other.written);
+    return *this;
+  }
+  ~SpoolFile() { if (fd >= 0) close(fd); }
+
+  bool write(std::string_view data) {
+    while (!data.empty()) {
+      ssize_t wrote = ::write(fd, data.data(), data.size());
+      if (wrote < 0 && errno == EINTR) continue;
+      if (wrote <= 0) return false;
+      data.remove_prefix(wrote);
+      written += wrote;
+    }
+    return true;
+  }
+
+  // the file is done with once it's mapped - the mapping keeps it around
+  std::shared_ptr<const MappedFile> map() {
+    if (written == 0) return std::make_shared<MappedFile>(nullptr, 0);
+    void* address = mmap(nullptr, written, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address == MAP_FAILED) return {};
+    close(std::exchange(fd, -1));
+    return std::make_shared<MappedFile>(address, written);
+  }
+};
+
+}
+
+#endif
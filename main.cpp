@@ -1,6 +1,8 @@
+#include <algorithm>
 #include <climits>
 #include <format>
 #include <random>
+#include <string_view>
 #include <utility>
 
 #include "server/server.h"
@@ -8,22 +10,28 @@
 #include "utils/httpException.h"
 #include "utils/json.h"
 
-int main()
+int main(int argc, char** argv)
 {
   using namespace MyServer;
   using namespace MyServer::Utils::JSON;
 
-  Server server {};
+  ServerConfig config {};
+  if (argc > 1 && std::string_view{argv[1]} == "io_uring") config.ioBackend = ServerConfig::IOBackend::IO_URING;
+  Server server {config};
 
+  //never changes, so it's serialized once here and every request shares it
+  CannedResponse hello {Response {
+    .statusCode = Response::StatusCode::OK,
+    .contentType = Response::ContentType::PLAINTEXT,
+    .body = "hello"
+  }};
   server.registerHandler(
     "/", Request::Method::GET,
-    [](Request&) -> Response  {
-      return {
-        .statusCode = Response::StatusCode::OK,
-        .contentType = Response::ContentType::PLAINTEXT,
-        .body = "hello"
-      };
-  });
+    [hello](Request&) -> Response  {
+      return { .canned = hello };
+    },
+    ExecutionPolicy::INLINE
+  );
 
   server.registerHandler(
     "/echo", Request::Method::POST,
@@ -31,9 +39,11 @@ int main()
       return {
         .statusCode = Response::StatusCode::OK,
         .contentType = Response::ContentType::PLAINTEXT,
-        .body = std::string("Server replies: ") + request.body
+        .body = std::format("Server replies: {}", request.body)
       };
-  });
+    },
+    ExecutionPolicy::AUTO
+  );
 
   using Todo = JSON<Pair<"description", std::string>, Pair<"done", bool>, Pair<"due", Nullable<std::string>>>;
   Utils::ConcurrentMap<std::string, Todo, JSON<MapOf<Todo>>> todoDatabase {};
@@ -41,14 +51,33 @@ int main()
   server.registerHandler(
     "/todo", Request::Method::GET,
     [&todoDatabase](Request& req) -> Response {
-      auto it = req.query.find("id");
-      if (it == req.query.end()) return {
+      std::optional<std::string_view> id = req.query("id");
+      // the whole list could be big, so it goes out a few todos at a time instead of as one string
+      if (!id) return {
         .statusCode = Response::StatusCode::OK,
         .contentType = Response::ContentType::JSON,
-        .body = todoDatabase.getUnderlyingMap().toString()
+        .body = "{",
+        .stream = [&todoDatabase, ids = todoDatabase.keys(), next = size_t{0}, first = true]()
+          mutable -> std::optional<std::string> {
+          constexpr size_t perPiece = 64;
+          if (next > ids.size()) return {};
+          std::string piece;
+          for (size_t end = std::min(next + perPiece, ids.size()); next < end; ++next) {
+            //anything deleted since we started is left out
+            std::optional<Todo> todo = todoDatabase.get(ids[next]);
+            if (!todo) continue;
+            piece += std::format("{}\"{}\":{}", first ? "" : ",", ids[next], todo->toString());
+            first = false;
+          }
+          if (next == ids.size()) {
+            piece += '}';
+            ++next;
+          }
+          return piece;
+        }
       };
       else {
-        std::optional<Todo> retrieved = todoDatabase.get(it->second);
+        std::optional<Todo> retrieved = todoDatabase.get(std::string{*id});
         if (retrieved) return {
           .statusCode = Response::StatusCode::OK,
           .contentType = Response::ContentType::JSON,
@@ -62,15 +91,39 @@ int main()
     }
   );
 
+  //the same lookup as /todo?id=, with the id in the path
   server.registerHandler(
-    "/todo", Request::Method::DELETE,
+    "/todo/{id}", Request::Method::GET,
     [&todoDatabase](Request& req) -> Response {
-      auto it = req.query.find("id");
-      if (it == req.query.end()) return {
+      std::optional<Todo> retrieved = todoDatabase.get(std::string{*req.param("id")});
+      if (retrieved) return {
+        .statusCode = Response::StatusCode::OK,
+        .contentType = Response::ContentType::JSON,
+        .body = retrieved->toString()
+      };
+      else return {
+        .statusCode = Response::StatusCode::NOT_FOUND,
+        .body = "check the provided id"
+      };
+    }
+  );
+
+  //the todos only change through the handlers below, which empty the cache when they do - every query of the endpoint,
+  //rather than just ?id=, so that one with extra parameters can't hang on to the old todo
+  server.cache("/todo", std::chrono::seconds{30});
+  //and when a todo goes cold, everyone asking for it at once waits on the one lookup
+  server.coalesce("/todo");
+
+  server.registerHandler(
+    "/todo", Request::Method::DELETE,
+    [&todoDatabase, &server](Request& req) -> Response {
+      std::optional<std::string_view> id = req.query("id");
+      if (!id) return {
         .statusCode = Response::StatusCode::BAD_REQUEST,
         .body = "please provide an id"
       };
-      size_t removed = todoDatabase.erase(it->second);
+      size_t removed = todoDatabase.erase(std::string{*id});
+      server.invalidate("/todo");
       if (removed) return {
         .statusCode = Response::StatusCode::OK
       };
@@ -85,7 +138,7 @@ int main()
   using TodoResponse = JSON<Pair<"id", std::string>, Pair<"todo", Todo>>;
   server.registerHandler(
     "/todo", Request::Method::PUT,
-    [&todoDatabase, &mt](Request& req) -> Response {
+    [&todoDatabase, &mt, &server](Request& req) -> Response {
       Todo todo {req};
 
       if (!todo.get<"description">()) {
@@ -94,10 +147,11 @@ int main()
       if (!todo.get<"done">()) todo.get<"done">() = false;
 
       std::string id;
-      if (auto it = req.query.find("id"); it != req.query.end()) id = it->second;
+      if (std::optional<std::string_view> given = req.query("id")) id = *given;
       else id = std::format("{:x}{:x}{:x}", mt(), mt(), mt());
 
       todoDatabase.insert_or_assign(id, todo);
+      server.invalidate("/todo");
 
       TodoResponse resp;
       resp.get<"id">() = id;
@@ -111,6 +165,43 @@ int main()
     }
   );
 
+  // holds no thread while it waits
+  server.registerHandler(
+    "/delay", Request::Method::GET,
+    [](Request& req) -> Async<Response> {
+      int millis = 100;
+      if (std::optional<std::string_view> ms = req.query("ms")) millis = std::stoi(std::string{*ms});
+      co_await sleepFor(std::chrono::milliseconds{millis});
+      co_return Response {
+        .statusCode = Response::StatusCode::OK,
+        .contentType = Response::ContentType::PLAINTEXT,
+        .body = std::format("waited {}ms", millis)
+      };
+    }
+  );
+
+  server.setDeadline("/delay", Request::Method::GET, std::chrono::seconds{1});
+
+  // takes the body a chunk at a time as it comes in, so it never has to be in memory all at once
+  server.registerHandler(
+    "/upload", Request::Method::POST,
+    [](Request& req) -> Response {
+      size_t received = 0;
+      while (std::optional<BodyChunk> chunk = req.bodyStream->next()) received += chunk->data.size();
+      if (!req.bodyStream->complete()) return {
+        .statusCode = Response::StatusCode::BAD_REQUEST,
+        .contentType = Response::ContentType::PLAINTEXT,
+        .body = "incomplete body"
+      };
+      return {
+        .statusCode = Response::StatusCode::OK,
+        .contentType = Response::ContentType::PLAINTEXT,
+        .body = std::format("received {} bytes", received)
+      };
+    }
+  );
+  server.streamBody("/upload", Request::Method::POST);
+
   server.go(8675);
   return 0;
 }
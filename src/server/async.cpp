@@ -0,0 +1,85 @@
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <sys/epoll.h>
+
+#include "server/async.h"
+#include "server/dispatch.h"
+#include "server/request.h"
+
+namespace MyServer {
+
+namespace {
+
+Dispatch& currentDispatch() {
+  if (!Dispatch::current) throw std::logic_error("Awaited outside of a dispatch thread - is this an async handler?");
+  return *Dispatch::current;
+}
+
+// whoever resumes us doesn't know which request we're for, so we tell the dispatch thread again for our next wait
+bool carryOn(bool cutShort, const Cancellation* cancellation) {
+  if (!cancellation) return !cutShort;
+  Dispatch::current->running = cancellation;
+  return !cutShort && !cancellation->requested();
+}
+
+}
+
+void SleepFor::await_suspend(std::coroutine_handle<> coroutine) {
+  Dispatch& dispatch = currentDispatch();
+  cancellation = dispatch.running;
+  auto now = std::chrono::steady_clock::now();
+  auto until = now + duration;
+  //nobody is waiting on the response any more
+  if (cancellation && cancellation->clientGone.stop_requested()) until = now;
+  else if (cancellation) until = std::min(until, cancellation->deadline);
+  dispatch.addTimer(until, coroutine, &cutShort);
+}
+
+bool SleepFor::await_resume() noexcept {
+  return carryOn(cutShort, cancellation);
+}
+
+void FdReady::await_suspend(std::coroutine_handle<> coroutine) {
+  Dispatch& dispatch = currentDispatch();
+  cancellation = dispatch.running;
+  if (cancellation && cancellation->clientGone.stop_requested()) {
+    dispatch.addTimer(std::chrono::steady_clock::now(), coroutine, &cutShort);
+  }
+  else if (cancellation) dispatch.awaitFd(fd, events, coroutine, &cutShort, cancellation->deadline);
+  else dispatch.awaitFd(fd, events, coroutine, &cutShort);
+}
+
+bool FdReady::await_resume() noexcept {
+  return carryOn(cutShort, cancellation);
+}
+
+void ReadFile::await_suspend(std::coroutine_handle<> coroutine) {
+  Dispatch& dispatch = currentDispatch();
+  cancellation = dispatch.running;
+  dispatch.offload([this, coroutine, &dispatch] {
+    std::ifstream file {path, std::ios::binary};
+    if (file) contents.emplace(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+    dispatch.post(coroutine);
+  });
+}
+
+std::optional<std::string> ReadFile::await_resume() noexcept {
+  carryOn(false, cancellation);
+  return std::move(contents);
+}
+
+SleepFor sleepUntil(std::chrono::steady_clock::time_point deadline) {
+  return { deadline - std::chrono::steady_clock::now() };
+}
+
+FdReady readable(int fd) {
+  return { fd, EPOLLIN };
+}
+
+FdReady writable(int fd) {
+  return { fd, EPOLLOUT };
+}
+
+}
@@ -1,13 +1,21 @@
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cerrno>
+#include <charconv>
+#include <optional>
+#include <span>
 #include <string>
 #include <string_view>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "server/client.h"
 #include "server/common.h"
 #include "utils/logger.h"
 #include "server/parseHTTP.h"
+#include "server/serialize.h"
 
 namespace MyServer {
 
@@ -16,6 +24,12 @@ void Client::log(const std::string& str) {
   Logger::log<level>("Client " + std::to_string(fd) + ": " + str);
 }
 
+Client::Client(int fd, size_t maxInFlight, const HTTP::ParserOptions& parserOptions):
+  httpParser{parserOptions},
+  slots{std::make_unique<Slot[]>(std::bit_ceil(maxInFlight + 1))},
+  slotMask{std::bit_ceil(maxInFlight + 1) - 1},
+  fd{fd} {}
+
 int Client::getfd() {
   return fd;
 }
@@ -23,8 +37,9 @@ int Client::getfd() {
 Client::IOState Client::handleRead() {
   if (isClosing()) return IOState::WOULDBLOCK;
 
-  char buf[CHUNKSIZE];
-  ssize_t readBytes = read(fd, buf, CHUNKSIZE);
+  //straight into the parser's buffer, which it parses in place
+  std::span<char> space = httpParser.receiveSpace();
+  ssize_t readBytes = read(fd, space.data(), std::min(space.size(), CHUNKSIZE));
 
   if (readBytes < 0) {
     if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -41,96 +56,318 @@ Client::IOState Client::handleRead() {
     return IOState::WOULDBLOCK;
   }
 
-  httpParser.process(std::string_view(buf, readBytes));
+  httpParser.received(readBytes);
+  checkParse();
+  return IOState::CONTINUE;
+}
+
+void Client::consume(std::string_view input) {
+  //the ring may have had more for us before it saw we'd stopped reading
+  if (isClosing()) return;
+  httpParser.process(input);
+  checkParse();
+}
+
+void Client::checkParse() {
+  if (closeAfterBody && !httpParser.streamingBody()) {
+    closeAfterBody = false;
+    httpParser.clear();
+    setClosing();
+  }
   if (httpParser.isError()) {
+    if (isClosing()) return;
     log<Logger::LogLevel::ERROR>("Could not parse http request");
-    outgoing[incrementSequence()] = "HTTP/1.1 400 Bad Request";
-    return IOState::CONTINUE;
+    unsigned long badRequest = incrementSequence();
+    publish(badRequest, Response { .canned = HTTP::cannedRefusal(Response::StatusCode::BAD_REQUEST) });
+    //we can't tell where the next request would start, so this is the last thing we say (and the ring has room for it)
+    setClosing();
   }
-  return IOState::CONTINUE;
 }
 
-Client::IOState Client::handleWrite() {
-  // if a worker thread is writing to the (client-private) queue, we don't bother blocking a dispatch thread
-  std::unique_lock<std::mutex> lock { queueMutex, std::try_to_lock };
-  if (!lock.owns_lock()) return IOState::CONTINUE;
-  else if (outgoing.empty()) return IOState::DONE;
+Client::Slot& Client::slotFor(unsigned long sequence) {
+  return slots[sequence & slotMask];
+}
 
-  const std::map<unsigned long, std::string>::const_iterator cbegin = outgoing.cbegin();
-  if (cbegin->first > sequence) return IOState::CONTINUE;
+// the release (well, seq_cst) store pairs with the dispatch thread's load in gather/handleWrite - once it's ready the
+// dispatch thread may write and free the slot, so it's counted in outgoingBytes before then
+void Client::publish(unsigned long sequence, std::string&& response) {
+  Slot& slot = slotFor(sequence);
+  slot.head.clear();
+  slot.body = std::move(response);
+  outgoingBytes += slot.size();
+  slot.ready.store(true);
+}
 
-  size_t allotment = CHUNKSIZE;
-  do {
-    const std::string& out = cbegin->second;
+void Client::publish(unsigned long sequence, Response&& response) {
+  Slot& slot = slotFor(sequence);
+  fill(slot, std::move(response));
+  outgoingBytes += slot.size();
+  slot.ready.store(true);
+}
 
-    size_t desired = std::min(out.size() - written, allotment);
-    ssize_t bytesOut = write(fd, out.data() + written, desired);
+void Client::fill(Slot& slot, Response&& response) {
+  if (response.canned) {
+    HTTP::writeHead(response.canned, slot.head);
+    slot.canned = std::move(response.canned);
+    return;
+  }
+  HTTP::writeHead(response, slot.head);
+  slot.chunkOpen = response.stream && !response.body.empty();
+  slot.body = std::move(response.body);
+  slot.more = std::move(response.stream);
+}
 
-    // not exactly sure what it means if we get EPOLLIN but can't write any bytes
-    // for now I'll consider it an error
-    if (bytesOut <= 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) return IOState::WOULDBLOCK;
-      else {
-        initiateShutdown();
-        return IOState::ERROR;
-      }
+// the dispatch thread's side: points the iovecs at the run of ready responses from writeSequence on,
+// less the bytes of the first one we have already written
+size_t Client::gather(std::span<iovec> iovecs) {
+  unsigned long next = writeSequence.load(std::memory_order_relaxed);
+  size_t offset = written;
+  size_t gathered = 0;
+  //a head (if there's any of it left) and a body for each - even an empty body, so that it's retired
+  for (; gathered + 2 <= iovecs.size() && slotFor(next).ready.load(); ++next) {
+    Slot& slot = slotFor(next);
+    if (offset < slot.head.size()) {
+      iovecs[gathered++] = { .iov_base = slot.head.data() + offset, .iov_len = slot.head.size() - offset };
+      offset = 0;
     }
+    else offset -= slot.head.size();
+    //the kernel only reads through iov_base, so it's fine to point it at a canned response's const bytes
+    std::string_view body = slot.bodyBytes();
+    iovecs[gathered++] = { .iov_base = const_cast<char*>(body.data()) + offset, .iov_len = body.size() - offset };
+    offset = 0;
+    //there's more of a streamed response to come, so nothing after it can go yet
+    if (slot.more) break;
+  }
+  return gathered;
+}
 
-    allotment -= bytesOut;
-    written += bytesOut;
+// Pieces are only made once the last one has gone, so a streamed response holds one piece at a time however big it
+// is, and goes no faster than the client takes it
+void Client::refill(Slot& slot) {
+  std::optional<std::string> piece;
+  try {
+    do piece = slot.more(); while (piece && piece->empty());
+  }
+  catch (...) {
+    //we've already said it's a 200, so all we can do is cut the body short, which the client will notice
+    log<Logger::LogLevel::ERROR>("A streamed response's producer threw");
+    slot.more = {};
+    slot.head.clear();
+    slot.body = std::string{};
+    initiateShutdown();
+    return;
+  }
+  HTTP::writeChunkHead(piece ? piece->size() : 0, !slot.chunkOpen, slot.head);
+  if (piece) {
+    slot.body = std::move(*piece);
+    slot.chunkOpen = true;
+  }
+  else {
+    slot.body = std::string{};
+    slot.more = {};
+  }
+  outgoingBytes += slot.size();
+}
 
-    if (written >= out.size()) {
-      ++sequence;
-      written = 0;
-      outgoing.erase(cbegin);
-    }
-  } while (!outgoing.empty() && allotment > 0) ;
+void Client::advance() {
+  Slot& slot = slotFor(writeSequence.load(std::memory_order_relaxed));
+  if (!slot.more) return retire();
+  refill(slot);
+  written = 0;
+  midStream = true;
+}
 
- if (outgoing.empty()) {
-    if (pending == 0) sequence = 0;
-    return IOState::DONE;
-  }
-  return IOState::CONTINUE;
+// frees the slot for the response sequence + capacity - nobody can have that yet, as the in-flight limit is below
+// the capacity, and the dispatch thread only reads requests past the limit once writeSequence has moved on
+void Client::retire() {
+  unsigned long current = writeSequence.load(std::memory_order_relaxed);
+  Slot& slot = slotFor(current);
+  //the head keeps its capacity for the next response in this slot
+  slot.head.clear();
+  slot.body = std::string{};
+  slot.canned = {};
+  slot.more = {};
+  slot.chunkOpen = false;
+  slot.ready.store(false, std::memory_order_relaxed);
+  written = 0;
+  midStream = false;
+  writeSequence.store(current + 1);
 }
 
-Client::IOState Client::writeOne() {
-  if (written == 0) return IOState::DONE;
-  const std::string& out = outgoing.cbegin()->second;
+Client::IOState Client::handleWrite() {
+  // a worker is writing its response straight to the socket - it lets us know if there's anything left for us
+  if (writing.exchange(true)) return IOState::WOULDBLOCK;
+  IOState state = writeReady();
+  writing.store(false);
+  return state;
+}
 
-  size_t desired = std::min(out.size() - written, CHUNKSIZE);
-  ssize_t bytesOut = write(fd, out.data() + written, desired);
+Client::IOState Client::writeReady() {
+  // responses may complete out of order, so we can only write the run of them that is next in sequence
+  std::array<iovec, maxGather> iovecs;
+  size_t gathered = gather(iovecs);
+  if (gathered == 0) return IOState::DONE;
 
-  if (bytesOut <= 0) {
+  ssize_t bytesOut = writev(fd, iovecs.data(), static_cast<int>(gathered));
+  if (bytesOut < 0) {
     if (errno == EAGAIN || errno == EWOULDBLOCK) return IOState::WOULDBLOCK;
+    initiateShutdown();
+    return IOState::ERROR;
+  }
+
+  size_t offered = 0;
+  for (size_t i = 0; i < gathered; ++i) offered += iovecs[i].iov_len;
+  wroteBytes(bytesOut);
+
+  // retire everything that went out in full, and remember how far we got into the one that didn't
+  size_t remaining = written + bytesOut;
+  while (slotFor(writeSequence.load(std::memory_order_relaxed)).ready.load()) {
+    size_t size = slotFor(writeSequence.load(std::memory_order_relaxed)).size();
+    if (remaining < size) break;
+    remaining -= size;
+    advance();
+  }
+  written = remaining;
+
+  // a short write means the socket buffer is full, which the next attempt will confirm
+  if (static_cast<size_t>(bytesOut) < offered) return IOState::CONTINUE;
+  // or we hit maxGather with more still ready
+  if (slotFor(writeSequence.load()).ready.load()) return IOState::CONTINUE;
+  // whoever completes the next response in sequence will let the dispatch thread know
+  return IOState::DONE;
+}
+
+Client::IOState Client::writeOne() {
+  if (writing.exchange(true)) return IOState::CONTINUE;
+  IOState state = IOState::DONE;
+  Slot& current = slotFor(writeSequence.load(std::memory_order_relaxed));
+  if ((written > 0 || midStream) && current.ready.load()) {
+    std::string_view rest = written < current.head.size()
+      ? std::string_view{current.head}.substr(written)
+      : current.bodyBytes().substr(written - current.head.size());
+    //a producer that threw leaves nothing to write, and the slot just has to go
+    ssize_t bytesOut = rest.empty() ? 0 : write(fd, rest.data(), std::min(rest.size(), CHUNKSIZE));
+
+    if (bytesOut < 0) {
+      state = errno == EAGAIN || errno == EWOULDBLOCK ? IOState::WOULDBLOCK : IOState::ERROR;
+    }
     else {
-      initiateShutdown();
-      return IOState::ERROR;
+      written += bytesOut;
+      wroteBytes(bytesOut);
+      if (written < current.size()) state = IOState::CONTINUE;
+      else {
+        //the rest of a streamed response is still this one, so we see it out
+        advance();
+        if (midStream) state = IOState::CONTINUE;
+      }
     }
   }
+  writing.store(false);
+  return state;
+}
 
-  if (written >= out.size()) return IOState::DONE;
-  return IOState::CONTINUE;
+size_t Client::takeReady(std::deque<Outgoing>& into) {
+  size_t taken = 0;
+  while (slotFor(writeSequence.load(std::memory_order_relaxed)).ready.load()) {
+    Slot& slot = slotFor(writeSequence.load(std::memory_order_relaxed));
+    //the kernel takes a streamed response's pieces one at a time, so we only ever have the next one ready
+    if (slot.more && !into.empty()) break;
+    if (!slot.head.empty()) {
+      into.push_back({ .owned = std::move(slot.head) });
+      //the head is the kernel's until its send completes, so the slot gets one of the spares instead
+      slot.head = std::string{};
+      if (!ring.spares.empty()) {
+        slot.head = std::move(ring.spares.back());
+        ring.spares.pop_back();
+      }
+    }
+    if (slot.canned) into.push_back({ .canned = std::move(slot.canned) });
+    else if (!slot.body.empty()) into.push_back({ .owned = std::move(slot.body) });
+    if (slot.more) {
+      refill(slot);
+      break;
+    }
+    retire();
+    ++taken;
+  }
+  return taken;
+}
+
+Client::RingState& Client::ringState() {
+  return ring;
 }
 
 // addOutgoing returns true if it's worth notifying the dispatch thread about this client.
-// if the queue was already occupied, the dispatch thread will be writing it out anyway, so no notification
-// if wrhup (e.g., an error) we notify the dispatch thread to close the client if we are the last worker thread referencing the client
+// if this isn't the next response in line, whoever completes that one will notify instead
+// if closing (e.g., an error) we notify the dispatch thread to close the client if we are the last worker thread referencing the client
+// (everything here is seq_cst: either we see the dispatch thread's writeSequence, or it sees our response)
 bool Client::addOutgoing(unsigned long sequence, std::string&& outboundStr) {
-  std::lock_guard<std::mutex> lock { queueMutex };
-  bool awoken = false;
-  if (!wrhup) {
-    size_t oldSize = outgoing.size();
-    outgoing.insert_or_assign(sequence, std::move(outboundStr));
-    awoken = outgoing.size() == 1;
+  bool next = false;
+  if (!wrhup.load()) {
+    publish(sequence, std::move(outboundStr));
+    next = writeSequence.load() == sequence;
   }
-  else awoken = pending == 1;
-  --pending;
-  return awoken;
+  return letGo() || next;
+}
+
+bool Client::addOutgoing(unsigned long sequence, Response&& response) {
+  bool next = false;
+  if (!wrhup.load()) {
+    publish(sequence, std::move(response));
+    next = writeSequence.load() == sequence;
+  }
+  return letGo() || next;
+}
+
+bool Client::writeThrough(unsigned long sequence, Response&& response) {
+  //with other requests in flight, it's cheaper to leave the dispatch thread to write the lot in one go, and the rest
+  //of a streamed response goes out a piece at a time from the dispatch thread anyway
+  bool next = !wrhup.load() && (pending.load() & ~closingBit) == 1 && writeSequence.load() == sequence;
+  if (response.stream || !next || writing.exchange(true)) {
+    return addOutgoing(sequence, std::move(response));
+  }
+  // we're next in line, so nothing else is waiting to go out, and holding `writing` keeps the dispatch thread away
+  // (the slot is ours to fill, but nobody looks at it until it's ready)
+  Slot& slot = slotFor(sequence);
+  fill(slot, std::move(response));
+  std::array<iovec, 2> parts {{
+    { .iov_base = slot.head.data(), .iov_len = slot.head.size() },
+    { .iov_base = const_cast<char*>(slot.bodyBytes().data()), .iov_len = slot.bodyBytes().size() }
+  }};
+  msghdr message { .msg_iov = parts.data(), .msg_iovlen = parts.size() };
+  ssize_t bytesOut = sendmsg(fd, &message, MSG_NOSIGNAL);
+  size_t sent = bytesOut > 0 ? bytesOut : 0;
+  bool wake;
+  if (sent < slot.size()) {
+    //the dispatch thread writes the rest (and finds out about any error)
+    outgoingBytes += slot.size() - sent;
+    written = sent;
+    slot.ready.store(true);
+    wake = true;
+  }
+  else {
+    slot.body = std::string{};
+    slot.canned = {};
+    writeSequence.store(sequence + 1);
+    //the next response may have been published while we were still in its way, or the dispatch thread may be
+    //waiting for us to drop below the limits
+    wake = slotFor(sequence + 1).ready.load() || readPaused.load();
+  }
+  writing.store(false);
+  return letGo() || wake;
+}
+
+// once pending gets to 0 the dispatch thread may destroy us, so the decrement is the last we touch - a shutdown that
+// came in while we were busy is in the value it leaves, so there's no window where neither of us sees it
+bool Client::letGo() {
+  return pending.fetch_sub(1) == (closingBit | 1);
 }
 
 bool Client::isPending() const {
   //safe as only one dispatch thread considers a client
-  return !(pending.load() == 0 && outgoing.empty() && httpParser.isFresh());
+  bool unwritten = !wrhup.load() && writeSequence.load() != sequence;
+  bool answered = (pending.load() & ~closingBit) == 0;
+  return !(answered && !unwritten && httpParser.isFresh() && !httpParser.hasRequests() && ring.sending.empty());
 }
 
 bool Client::isClosing() const {
@@ -145,10 +382,6 @@ unsigned long Client::incrementSequence() {
   return sequence++;
 }
 
-void Client::resetSequence() {
-  sequence = 0;
-}
-
 void Client::close() {
   if (fd < 0) {
     log<Logger::LogLevel::FATAL> ("(Application error) Tried to close a closed socket");
@@ -160,28 +393,82 @@ void Client::close() {
 }
 
 void Client::initiateShutdown() {
-  if (wrhup) return;
-  wrhup = true;
-  {
-    std::lock_guard<std::mutex> lock {queueMutex};
-    outgoing.clear(); 
-  }
+  if (wrhup.exchange(true)) return;
+  //workers may still be publishing into the ring, so it's left alone until we're destroyed
+  outgoingBytes = 0;
   httpParser.clear();
-  resetSequence();
+  //the kernel may still be reading from these, in which case the dispatch thread clears them once it's done
+  if (ring.sendsInFlight == 0) ring.sending.clear();
   setClosing();
+  //after wrhup, so that anyone who sees the stop also sees that we won't take their response
+  hangup.request_stop();
 }
 
 void Client::setClosing() {
   log<Logger::LogLevel::DEBUG>("Initiating client shutdown");
   closing = true;
+  pending.fetch_or(closingBit);
+}
+
+std::stop_token Client::hangupToken() const {
+  return hangup.get_token();
+}
+
+// sequence is ours, but a worker writing its response through moves writeSequence on - seq_cst, as the dispatch thread
+// rechecks this after pausing reads, while the worker checks readPaused after its store: one of us sees the other
+size_t Client::inFlight() const {
+  return sequence - writeSequence.load();
+}
+
+size_t Client::bufferedBytes() const {
+  return outgoingBytes.load(std::memory_order_relaxed);
+}
+
+// a shutdown zeroes the count while we may be writing, so what we wrote can be more than is left
+void Client::wroteBytes(size_t bytes) {
+  size_t left = outgoingBytes.load();
+  while (!outgoingBytes.compare_exchange_weak(left, left - std::min(bytes, left)));
+}
+
+bool Client::readingPaused() const {
+  return readPaused;
 }
 
-std::vector<Request> Client::takeRequests() {
-  std::vector requests = httpParser.takeRequests();
+void Client::setReadingPaused(bool paused) {
+  readPaused = paused;
+}
+
+std::vector<Request> Client::takeRequests(size_t limit) {
+  std::vector requests = httpParser.takeRequests(limit);
+  //anything they sent after a Connection: close goes unanswered, and we hang up once we've answered up to it
+  auto last = std::find_if(requests.begin(), requests.end(), [](const Request& r) { return r.closesConnection(); });
+  if (last != requests.end()) {
+    requests.erase(last + 1, requests.end());
+    if (httpParser.streamingBody()) closeAfterBody = true;
+    else {
+      httpParser.clear();
+      setClosing();
+    }
+  }
   pending += requests.size();
   return requests;
 }
 
+std::optional<Response::StatusCode> Client::takeRejection() {
+  std::optional<Response::StatusCode> status = httpParser.rejected();
+  if (!status || answeredRejection || httpParser.hasRequests()) return {};
+  answeredRejection = true;
+  //it's answered through addOutgoing like any other request
+  ++pending;
+  //we stopped parsing partway through a request, so it's the last thing we say
+  setClosing();
+  return status;
+}
+
+size_t Client::streamBacklog() const {
+  return httpParser.streamBacklog();
+}
+
 Client::~Client() {
   log<Logger::LogLevel::DEBUG>("Client shutdown complete");
   close();
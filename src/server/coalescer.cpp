@@ -0,0 +1,83 @@
+#include <memory>
+#include <utility>
+
+#include "server/client.h"
+#include "server/coalescer.h"
+#include "server/dispatch.h"
+#include "server/worker.h"
+
+namespace MyServer {
+
+bool Coalescer::follow(Request& request, Client& client, Dispatch& owner) {
+  std::string_view key = requestKey(request.endpoint, request.rawQuery);
+  std::lock_guard held {lock};
+  auto running = inFlight.find(key);
+  if (running == inFlight.end()) {
+    inFlight.try_emplace(std::string{key});
+    ++led;
+    return false;
+  }
+  running->second.push_back({
+    .client = &client, .owner = &owner, .sequence = client.incrementSequence(), .request = std::move(request)
+  });
+  ++followed;
+  return true;
+}
+
+bool Coalescer::abandon(const Request& request) {
+  std::string_view key = requestKey(request.endpoint, request.rawQuery);
+  std::lock_guard held {lock};
+  auto running = inFlight.find(key);
+  if (running == inFlight.end()) return true;
+  if (!running->second.empty()) return false;
+  inFlight.erase(running);
+  return true;
+}
+
+Response Coalescer::finish(const Route& route, const Request& request, Response&& response,
+  std::chrono::nanoseconds inlineThreshold) {
+  std::vector<Follower> followers;
+  {
+    std::string_view key = requestKey(request.endpoint, request.rawQuery);
+    std::lock_guard held {lock};
+    auto running = inFlight.find(key);
+    if (running == inFlight.end()) return std::move(response);
+    //anything identical from here on leads a fresh run, so it can't miss a change made after the handler looked
+    followers = std::move(running->second);
+    inFlight.erase(running);
+  }
+  if (followers.empty()) return std::move(response);
+
+  if (!response.stream && !response.canned) response = Response { .canned = CannedResponse {response} };
+  for (Follower& follower: followers) {
+    if (follower.request.cancellation.clientGone.stop_requested()) {
+      //nobody is going to read it, but the client still has to know we're done with it
+      answer(follower, std::string{});
+    }
+    else if (!response.stream) {
+      bool late = follower.request.cancellation.expired();
+      answer(follower, late ? Worker::timedOut() : Response { .canned = response.canned });
+    }
+    else if (Dispatch::current) {
+      //the leader ran inline, and the dispatch thread has better things to do than run the handler again for each of
+      //these - so they go to the workers, which share them out
+      auto waiting = std::make_shared<Follower>(std::move(follower));
+      Dispatch::current->offload([&route, waiting, inlineThreshold]() { rerun(route, *waiting, inlineThreshold); });
+    }
+    else rerun(route, follower, inlineThreshold);
+  }
+  return std::move(response);
+}
+
+void Coalescer::rerun(const Route& route, Follower& follower, std::chrono::nanoseconds inlineThreshold) {
+  answer(follower, Worker::handle(route, follower.request, inlineThreshold));
+}
+
+template <typename Reply>
+void Coalescer::answer(Follower& follower, Reply&& reply) {
+  //once it has our response the client may be closed, so we can't ask for its fd after
+  int fd = follower.client->getfd();
+  if (follower.client->addOutgoing(follower.sequence, std::forward<Reply>(reply))) follower.owner->notifyForClient(fd);
+}
+
+}
@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include "server/config.h"
+#include "utils/logger.h"
+
+namespace MyServer {
+
+namespace {
+
+bool parseInt(std::string_view value, int& into) {
+  int parsed;
+  auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), parsed);
+  if (error != std::errc{} || end != value.data() + value.size() || parsed < 0) return false;
+  into = parsed;
+  return true;
+}
+
+bool parseSize(std::string_view value, size_t& into) {
+  size_t parsed;
+  auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), parsed);
+  if (error != std::errc{} || end != value.data() + value.size()) return false;
+  into = parsed;
+  return true;
+}
+
+bool parseBool(std::string_view value, bool& into) {
+  if (value == "1" || value == "true" || value == "on") into = true;
+  else if (value == "0" || value == "false" || value == "off") into = false;
+  else return false;
+  return true;
+}
+
+using Setter = bool (*)(ServerConfig&, std::string_view);
+constexpr std::array<std::pair<std::string_view, Setter>, 24> settings {{
+  {"ACCEPT_MODE", [](ServerConfig& config, std::string_view value) {
+    if (value == "handover") config.acceptMode = ServerConfig::AcceptMode::HANDOVER;
+    else if (value == "reuseport") config.acceptMode = ServerConfig::AcceptMode::REUSEPORT;
+    else return false;
+    return true;
+  }},
+  {"IO_BACKEND", [](ServerConfig& config, std::string_view value) {
+    if (value == "epoll") config.ioBackend = ServerConfig::IOBackend::EPOLL;
+    else if (value == "io_uring") config.ioBackend = ServerConfig::IOBackend::IO_URING;
+    else return false;
+    return true;
+  }},
+  {"ACCEPT_BATCH", [](ServerConfig& config, std::string_view value) {
+    return parseInt(value, config.acceptBatch);
+  }},
+  {"SPIN_BUDGET_US", [](ServerConfig& config, std::string_view value) {
+    int micros;
+    if (!parseInt(value, micros)) return false;
+    config.spinBudget = std::chrono::microseconds{micros};
+    return true;
+  }},
+  {"DISPATCH_THREADS", [](ServerConfig& config, std::string_view value) {
+    return parseInt(value, config.dispatchThreads);
+  }},
+  {"WORKER_THREADS", [](ServerConfig& config, std::string_view value) {
+    return parseInt(value, config.workerThreads);
+  }},
+  {"MAX_WORKER_THREADS", [](ServerConfig& config, std::string_view value) {
+    return parseInt(value, config.maxWorkerThreads);
+  }},
+  {"MIN_WORKER_THREADS", [](ServerConfig& config, std::string_view value) {
+    return parseInt(value, config.minWorkerThreads);
+  }},
+  {"WORKER_IDLE_TIMEOUT_MS", [](ServerConfig& config, std::string_view value) {
+    int millis;
+    if (!parseInt(value, millis)) return false;
+    config.workerIdleTimeout = std::chrono::milliseconds{millis};
+    return true;
+  }},
+  {"PRESPAWN_WORKERS", [](ServerConfig& config, std::string_view value) {
+    return parseBool(value, config.prespawnWorkers);
+  }},
+  {"WORK_STEALING", [](ServerConfig& config, std::string_view value) {
+    return parseBool(value, config.workStealing);
+  }},
+  {"MAX_IN_FLIGHT_REQUESTS", [](ServerConfig& config, std::string_view value) {
+    int limit;
+    if (!parseInt(value, limit) || limit < 0) return false;
+    config.maxInFlightRequests = limit;
+    return true;
+  }},
+  {"MAX_OUTGOING_BYTES", [](ServerConfig& config, std::string_view value) {
+    return parseSize(value, config.maxOutgoingBytes);
+  }},
+  {"MAX_HEADER_BYTES", [](ServerConfig& config, std::string_view value) {
+    return parseSize(value, config.maxHeaderBytes);
+  }},
+  {"MAX_BODY_BYTES", [](ServerConfig& config, std::string_view value) {
+    return parseSize(value, config.maxBodyBytes);
+  }},
+  {"SPOOL_THRESHOLD", [](ServerConfig& config, std::string_view value) {
+    return parseSize(value, config.spoolThreshold);
+  }},
+  {"SPOOL_DIRECTORY", [](ServerConfig& config, std::string_view value) {
+    if (value.empty()) return false;
+    config.spoolDirectory = value;
+    return true;
+  }},
+  {"STREAM_WINDOW", [](ServerConfig& config, std::string_view value) {
+    size_t window;
+    if (!parseSize(value, window) || window == 0) return false;
+    config.streamWindow = window;
+    return true;
+  }},
+  {"CACHE_BYTES", [](ServerConfig& config, std::string_view value) {
+    return parseSize(value, config.cacheBytes);
+  }},
+  {"CANCEL_ON_HANGUP", [](ServerConfig& config, std::string_view value) {
+    return parseBool(value, config.cancelOnHangup);
+  }},
+  {"WRITE_THROUGH", [](ServerConfig& config, std::string_view value) {
+    return parseBool(value, config.writeThrough);
+  }},
+  {"INLINE_THRESHOLD_US", [](ServerConfig& config, std::string_view value) {
+    int micros;
+    if (!parseInt(value, micros)) return false;
+    config.inlineThreshold = std::chrono::microseconds{micros};
+    return true;
+  }},
+  {"DISPATCH_AFFINITY", [](ServerConfig& config, std::string_view value) {
+    if (!ServerConfig::parseAffinity(value)) return false;
+    config.dispatchAffinity = value;
+    return true;
+  }},
+  {"WORKER_AFFINITY", [](ServerConfig& config, std::string_view value) {
+    if (!ServerConfig::parseAffinity(value)) return false;
+    config.workerAffinity = value;
+    return true;
+  }},
+}};
+
+void set(ServerConfig& config, std::string_view key, std::string_view value, std::string_view source) {
+  auto setting = std::ranges::find(settings, key, &std::pair<std::string_view, Setter>::first);
+  if (setting == settings.end()) {
+    Logger::log<Logger::LogLevel::WARN>("Unknown setting " + std::string{key} + " in " + std::string{source});
+  }
+  else if (!setting->second(config, value)) {
+    Logger::log<Logger::LogLevel::WARN>(
+      "Ignoring bad value '" + std::string{value} + "' for " + std::string{key} + " in " + std::string{source}
+    );
+  }
+}
+
+std::string_view trim(std::string_view str) {
+  while (!str.empty() && std::isspace(str.front())) str.remove_prefix(1);
+  while (!str.empty() && std::isspace(str.back())) str.remove_suffix(1);
+  return str;
+}
+
+}
+
+ServerConfig ServerConfig::resolve() const {
+  ServerConfig resolved = *this;
+
+  if (const char* path = std::getenv("MYSERVER_CONFIG")) {
+    std::ifstream file {path};
+    if (!file) Logger::log<Logger::LogLevel::ERROR>("Couldn't open config file " + std::string{path});
+    for (std::string line; std::getline(file, line);) {
+      std::string_view entry = trim(line);
+      if (entry.empty() || entry.front() == '#') continue;
+      size_t equals = entry.find('=');
+      if (equals == std::string_view::npos) {
+        Logger::log<Logger::LogLevel::WARN>("Ignoring config line without an '=': " + line);
+        continue;
+      }
+      std::string key {trim(entry.substr(0, equals))};
+      std::ranges::transform(key, key.begin(), [](unsigned char c) { return std::toupper(c); });
+      set(resolved, key, trim(entry.substr(equals + 1)), path);
+    }
+  }
+
+  for (const auto& [key, _]: settings) {
+    std::string variable = "MYSERVER_" + std::string{key};
+    if (const char* value = std::getenv(variable.c_str())) set(resolved, key, value, "the environment");
+  }
+
+  int cores = std::max(1u, std::thread::hardware_concurrency());
+  if (resolved.dispatchThreads == 0) resolved.dispatchThreads = std::max(1, cores / 4);
+  if (resolved.workerThreads == 0) resolved.workerThreads = cores;
+  if (resolved.maxWorkerThreads == 0) resolved.maxWorkerThreads = 2 * resolved.workerThreads;
+  resolved.maxWorkerThreads = std::max(resolved.maxWorkerThreads, resolved.workerThreads);
+  if (resolved.minWorkerThreads == 0) resolved.minWorkerThreads = std::max(1, resolved.workerThreads / 2);
+  resolved.minWorkerThreads = std::min(resolved.minWorkerThreads, resolved.maxWorkerThreads);
+  if (resolved.maxInFlightRequests == 0) {
+    Logger::log<Logger::LogLevel::WARN>("MAX_IN_FLIGHT_REQUESTS can't be 0, using the default");
+    resolved.maxInFlightRequests = ServerConfig{}.maxInFlightRequests;
+  }
+  //every connection gets a ring this big, so a typo here shouldn't cost gigabytes
+  if (resolved.maxInFlightRequests > maxInFlightCap) {
+    Logger::log<Logger::LogLevel::WARN>("MAX_IN_FLIGHT_REQUESTS is capped at " + std::to_string(maxInFlightCap));
+    resolved.maxInFlightRequests = maxInFlightCap;
+  }
+  return resolved;
+}
+
+std::optional<cpu_set_t> ServerConfig::parseAffinity(std::string_view affinity) {
+  std::string cpuList {affinity};
+  if (affinity.starts_with("node:")) {
+    std::string node {affinity.substr(5)};
+    std::ifstream nodeCpus {"/sys/devices/system/node/node" + node + "/cpulist"};
+    if (!std::getline(nodeCpus, cpuList)) return {};
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  std::string_view remaining = trim(cpuList);
+  while (!remaining.empty()) {
+    size_t comma = remaining.find(',');
+    std::string_view range = remaining.substr(0, comma);
+    remaining = comma == std::string_view::npos ? std::string_view{} : remaining.substr(comma + 1);
+
+    size_t dash = range.find('-');
+    int first, last;
+    if (!parseInt(trim(range.substr(0, dash)), first)) return {};
+    if (dash == std::string_view::npos) last = first;
+    else if (!parseInt(trim(range.substr(dash + 1)), last)) return {};
+    if (last < first || last >= CPU_SETSIZE) return {};
+    for (int cpu = first; cpu <= last; ++cpu) CPU_SET(cpu, &set);
+  }
+  if (CPU_COUNT(&set) == 0) return {};
+  return set;
+}
+
+}
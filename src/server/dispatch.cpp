@@ -1,26 +1,88 @@
+#include <algorithm>
 #include <csignal>
 #include <cstring>
-#include <fcntl.h>
+#include <limits>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include <format>
 #include <string>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <utility>
 
 #include "server/dispatch.h"
+#include "server/coalescer.h"
+#include "server/responseCache.h"
+#include "server/serialize.h"
 #include "server/server.h"
 #include "server/task.h"
 #include "utils/logger.h"
 #include "server/client.h"
 
 namespace MyServer {
+
+thread_local Dispatch* Dispatch::current {nullptr};
+
 //todo disconnect inactive clients
-Dispatch::Dispatch(Server* server): server{server} {
+Dispatch::Dispatch(Server* server, int index): server{server} {
   epollfd = insist(epoll_create1(0), "Couldn't create epoll");
+  wakefd = insist(eventfd(0, EFD_NONBLOCK), "Couldn't create eventfd");
+  epoll_event event {
+    .events = EPOLLIN,
+    .data = { .fd = wakefd }
+  };
+  insist(epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &event), "Couldn't EPOLL_CTL_ADD the eventfd");
+
+  if (server->config.ioBackend == ServerConfig::IOBackend::IO_URING) {
+    ring = std::make_unique<Uring>(ringEntries, ringBuffers, CHUNKSIZE);
+    if (!ring->ok()) {
+      Logger::log<Logger::LogLevel::ERROR>("io_uring unavailable, falling back to epoll");
+      ring.reset();
+    }
+    //the eventfd wakes us through a read in the ring instead
+    else epoll_ctl(epollfd, EPOLL_CTL_DEL, wakefd, nullptr);
+  }
+
+  const ServerConfig& config = server->config;
+  parserOptions = {
+    .maxHeaderBytes = config.maxHeaderBytes,
+    .maxBodyBytes = config.maxBodyBytes,
+    .spoolThreshold = config.spoolThreshold,
+    .spoolDirectory = config.spoolDirectory,
+    .streamWindow = config.streamWindow,
+    //routes are all registered before the server goes, so this never races with a change
+    .streamsBody = [server](Request::Method method, std::string_view endpoint) {
+      const Route* route = server->routers[std::to_underlying(method)].match(endpoint);
+      return route && route->streamBody;
+    }
+  };
   thread = std::jthread(std::bind_front(&Dispatch::work, this));
+
+  if (std::optional<cpu_set_t> cpus = ServerConfig::parseAffinity(server->config.dispatchAffinity)) {
+    //each dispatch thread gets a cpu to itself, wrapping around if there are more threads than cpus
+    std::vector<int> candidates;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &*cpus)) candidates.push_back(cpu);
+    }
+    cpu_set_t ours;
+    CPU_ZERO(&ours);
+    CPU_SET(candidates[index % candidates.size()], &ours);
+    if (pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &ours) != 0) {
+      Logger::log<Logger::LogLevel::WARN>("Couldn't pin dispatch thread " + std::to_string(index));
+    }
+  }
 }
 
 void Dispatch::work(std::stop_token token) {
+  current = this;
+  //the worker threads we start inherit this
+  sigset_t exitSignals = Server::exitSignals();
+  pthread_sigmask(SIG_BLOCK, &exitSignals, nullptr);
+  if (ring) ring->prepRead(wakefd, &wakeBuffer, sizeof(wakeBuffer), Uring::userData(Uring::Op::WAKE, wakefd));
+
   for(;;) {
     auto now = std::chrono::system_clock::now();
     if (now > nextStatusUpdate) {
@@ -45,6 +107,7 @@ void Dispatch::work(std::stop_token token) {
       for (const Worker& worker: server->workerThreads) {
         taskCount += worker.tasks();
       }
+      int activeWorkers = server->activeWorkers.load(std::memory_order_relaxed);
 
       Logger::log<Logger::LogLevel::INFO>(
         std::format(
@@ -55,8 +118,31 @@ void Dispatch::work(std::stop_token token) {
 
       Logger::log<Logger::LogLevel::INFO>(
         std::format(
-          "{} want read, {} want write, {} rdhuped. {} many tasks queued",
-          read, write, rdhup, taskCount
+          "{} want read, {} want write, {} rdhuped. {} many tasks queued for {} workers",
+          read, write, rdhup, taskCount, activeWorkers
+        )
+      );
+
+      const WorkerStats& stats = server->workerStats;
+      Logger::log<Logger::LogLevel::INFO>(
+        std::format(
+          "{} worker threads alive. {} created, {} retired, {} parks and {} wakeups so far, {} tasks skipped",
+          stats.threads.load(), stats.creations.load(), stats.retirements.load(), stats.parks.load(), stats.wakeups.load(),
+          stats.skipped.load()
+        )
+      );
+
+      const Coalescer& coalescer = server->coalescer;
+      if (coalescer.led.load() > 0) Logger::log<Logger::LogLevel::INFO>(
+        std::format("Coalescing: {} requests led, and {} followed them", coalescer.led.load(), coalescer.followed.load())
+      );
+
+      const CacheStats& cache = server->responseCache.statistics();
+      if (cache.hits.load() + cache.misses.load() > 0) Logger::log<Logger::LogLevel::INFO>(
+        std::format(
+          "Cache: {} hits ({} not modified), {} misses, {} stored, {} evicted, {} expired, {} invalidated, {} bytes",
+          cache.hits.load(), cache.notModified.load(), cache.misses.load(), cache.stores.load(), cache.evictions.load(),
+          cache.expirations.load(), cache.invalidations.load(), cache.bytes.load()
         )
       );
 
@@ -69,90 +155,143 @@ void Dispatch::work(std::stop_token token) {
     }
 
     //take new clients
-    if (clients.empty()) {
-      if (token.stop_requested()) {
-        Logger::log<Logger::LogLevel::INFO>("Dispatch thread exiting");
-        break;
-      }
-      Logger::log<Logger::LogLevel::INFO>("Dispatch thread waiting for work");
-      server->incomingClientQueue.wait();
-    }
-    if (std::optional<int> client; (client = server->incomingClientQueue.take())) {
+    bool worked = !pendingNotifications.empty();
+    for (int taken = 0; taken < server->config.acceptBatch; ++taken) {
+      std::optional<int> client = server->incomingClientQueue.take();
+      if (!client) break;
       if (client == -1) {
         // main thread does this to wake us up on shutdown
         shutdown();
         return;
       }
       assumeClient(*client);
+      worked = true;
     }
 
-    //process existing notifications
-    auto notificationIt = pendingNotifications.begin();
-    while (notificationIt != pendingNotifications.end()) {
-      int fd = notificationIt->first;
-      auto clientIt = clients.find(fd);
-
-      if (clientIt == clients.end()) {
-        Logger::log<Logger::LogLevel::ERROR>("Processed notification about a missing client");
-        notificationIt = pendingNotifications.erase(notificationIt);
-        continue;
+    if (ring) {
+      if (!acceptArmed && listenfd >= 0) {
+        ring->prepAccept(listenfd);
+        acceptArmed = true;
       }
-      Client& client = clientIt->second;
+      if (doRing(prepareToSleep(waitTimeout(worked))) > 0) lastBusy = std::chrono::steady_clock::now();
+      if (resumeCoroutines() > 0) lastBusy = std::chrono::steady_clock::now();
+      for (int awokenClient: clientsWantWrite.take()) {
+        auto clientIt = clients.find(awokenClient);
+        if (clientIt == clients.end()) continue;
+        submitSends(clientIt->second);
+        resumeReading(clientIt->second);
+        reapClient(clientIt);
+      }
+      continue;
+    }
 
-      unsigned& clientNotifications = notificationIt->second;
-      bool removeClient = false;
+    processNotifications();
+    doEpoll(prepareToSleep(waitTimeout(worked)));
+    if (resumeCoroutines() > 0) lastBusy = std::chrono::steady_clock::now();
+    //additionally, see if we now want to write to some dormant clients
+    //clientsWantWrite.take() may block, but only for a single insertion to a set
+    for (int awokenClient: clientsWantWrite.take()) {
+      pendingNotifications[awokenClient] |= EPOLLOUT;
+    }
+  }
+}
+
+void Dispatch::processNotifications() {
+  auto notificationIt = pendingNotifications.begin();
+  while (notificationIt != pendingNotifications.end()) {
+    int fd = notificationIt->first;
+    auto clientIt = clients.find(fd);
 
-      if (clientNotifications & EPOLLIN) {
+    if (clientIt == clients.end()) {
+      Logger::log<Logger::LogLevel::ERROR>("Processed notification about a missing client");
+      notificationIt = pendingNotifications.erase(notificationIt);
+      continue;
+    }
+    Client& client = clientIt->second;
+
+    unsigned& clientNotifications = notificationIt->second;
+
+    if (clientNotifications & EPOLLIN) {
+      //we're edge triggered, so we have to remember to come back to the socket ourselves once we've caught up
+      if (overLimit(client)) {
+        client.setReadingPaused(true);
+        clientNotifications ^= EPOLLIN;
+      }
+      else {
         Client::IOState state = client.handleRead();
         if (state == Client::IOState::WOULDBLOCK) clientNotifications ^= EPOLLIN;
         else if (state == Client::IOState::ERROR) {
           clientNotifications = 0u;
         }
       }
+    }
 
-      for (Request& request: client.takeRequests()){
-        dispatchRequest(std::move(request), client);
-      }
+    dispatchRequests(client);
 
-      if (clientNotifications & EPOLLHUP) {
-        client.initiateShutdown();
-        clientNotifications ^= EPOLLHUP;
-      }
+    if (clientNotifications & EPOLLHUP) {
+      client.initiateShutdown();
+      clientNotifications ^= EPOLLHUP;
+    }
 
-      if (clientNotifications & EPOLLRDHUP) {
-        client.setClosing();
-        clientNotifications ^= EPOLLRDHUP;
-      }
+    if (clientNotifications & EPOLLRDHUP) {
+      hungUp(client);
+      clientNotifications ^= EPOLLRDHUP;
+    }
 
-      if (clientNotifications & EPOLLOUT) {
-        //this also handles the error - the client shuts itself down in this case, and we drop the notification
-        //if still pending the last worker thread will let us know to check again (and close it)
-        if (client.handleWrite() != Client::IOState::CONTINUE) clientNotifications ^= EPOLLOUT;
-      }
+    if (clientNotifications & EPOLLOUT) {
+      //this also handles the error - the client shuts itself down in this case, and we drop the notification
+      //if still pending the last worker thread will let us know to check again (and close it)
+      if (client.handleWrite() != Client::IOState::CONTINUE) clientNotifications ^= EPOLLOUT;
+      //anything the parser held back while we were at the limit can go now that some responses are out
+      dispatchRequests(client);
+    }
 
-      if (client.isClosing() && !client.isPending()) {
-        clients.erase(clientIt);
-        clientNotifications = 0u;
-      }
+    if (client.readingPaused() && !overLimit(client)) {
+      client.setReadingPaused(false);
+      clientNotifications |= EPOLLIN;
+    }
 
-      if (clientNotifications == 0u) {
-        notificationIt = pendingNotifications.erase(notificationIt);
-      }
-      else ++notificationIt;
+    if (client.isClosing() && !client.isPending()) {
+      clients.erase(clientIt);
+      clientNotifications = 0u;
     }
 
-    doEpoll();
-    //additionally, see if we now want to write to some dormant clients
-    //clientsWantWrite.take() may block, but only for a single insertion to a set
-    for (int awokenClient: clientsWantWrite.take()) {
-      pendingNotifications[awokenClient] |= EPOLLOUT;
+    if (clientNotifications == 0u) {
+      notificationIt = pendingNotifications.erase(notificationIt);
     }
+    else ++notificationIt;
+  }
+}
+
+// We spin (epoll_wait with no timeout) while there's work around, as a notification is probably coming soon.
+// Once we've been idle for the spin budget, we block until something wakes us, or until the next status update.
+int Dispatch::waitTimeout(bool worked) {
+  using namespace std::chrono;
+  auto now = steady_clock::now();
+  if (worked) lastBusy = now;
+  if (!pendingNotifications.empty() || !runnable.empty() || now - lastBusy < server->config.spinBudget) return 0;
+
+  auto untilStatus = ceil<milliseconds>(nextStatusUpdate - system_clock::now());
+  if (!timers.empty()) untilStatus = std::min(untilStatus, ceil<milliseconds>(timers.top().deadline - now));
+  return std::max(0, static_cast<int>(untilStatus.count()));
+}
+
+int Dispatch::prepareToSleep(int timeout) {
+  if (timeout == 0) return 0;
+  //pairs with wake(): either we see the new work here, or the waker sees that we are sleeping
+  sleeping = true;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!server->incomingClientQueue.empty() || !clientsWantWrite.empty() || !posted.empty()) {
+    sleeping = false;
+    return 0;
   }
+  return timeout;
 }
 
-void Dispatch::doEpoll() {
+void Dispatch::doEpoll(int timeout) {
   //check new notifications
-  ssize_t count = epoll_wait(epollfd, eventBuffer, maxNotifications, 0);
+  ssize_t count = epoll_wait(epollfd, eventBuffer, maxNotifications, timeout);
+  sleeping = false;
   if (count < 0) {
     if (errno == EINTR) {
       Logger::log<Logger::LogLevel::ERROR>("EINTR during epoll_wait - checking stop token");
@@ -160,20 +299,233 @@ void Dispatch::doEpoll() {
     else {
       Logger::log<Logger::LogLevel::ERROR>("Couldn't epoll_wait - may miss notifications!");
     }
+    return;
   }
-  else for (int i = 0; i < count; ++i) {
-    pendingNotifications[eventBuffer[i].data.fd] = eventBuffer[i].events;
+  for (int i = 0; i < count; ++i) {
+    int fd = eventBuffer[i].data.fd;
+    if (fd == wakefd) {
+      eventfd_t ignored;
+      eventfd_read(wakefd, &ignored);
+    }
+    else if (fd == listenfd) acceptClients();
+    else if (fdWaiters.contains(fd)) fdReady(fd);
+    else pendingNotifications[fd] = eventBuffer[i].events;
+  }
+}
+
+/* io_uring backend */
+// Rather than being told a socket is ready and then making the syscall ourselves, we keep a multishot recv armed on
+// every client (the kernel picks one of our provided buffers for each completion), and hand all of a client's ready
+// responses to the kernel as a single sendmsg. Everything we queue up in an iteration goes to the kernel in one
+// io_uring_enter.
+
+unsigned Dispatch::doRing(int timeout) {
+  ring->submitAndWait(timeout);
+  sleeping = false;
+  return ring->forEachCompletion([this](const io_uring_cqe& completion) {
+    switch (Uring::opOf(completion.user_data)) {
+      case Uring::Op::ACCEPT:
+        if (completion.res >= 0) assumeClient(completion.res);
+        else if (completion.res != -ECONNABORTED && completion.res != -ECANCELED) {
+          Logger::log<Logger::LogLevel::ERROR>("Received unhandled error during multishot accept");
+        }
+        //rearmed at the top of the loop if we are still listening
+        if (!(completion.flags & IORING_CQE_F_MORE)) acceptArmed = false;
+        break;
+      case Uring::Op::RECV:
+        onReceive(completion);
+        break;
+      case Uring::Op::SEND:
+        onSend(completion);
+        break;
+      case Uring::Op::WAKE:
+        ring->prepRead(wakefd, &wakeBuffer, sizeof(wakeBuffer), Uring::userData(Uring::Op::WAKE, wakefd));
+        break;
+      case Uring::Op::POLL:
+        //cancelled polls complete too, but by then we've already forgotten the waiter
+        fdReady(Uring::fdOf(completion.user_data));
+        break;
+      case Uring::Op::CANCEL:
+        break;
+    }
+  });
+}
+
+void Dispatch::onReceive(const io_uring_cqe& completion) {
+  auto clientIt = clients.find(Uring::fdOf(completion.user_data));
+  if (completion.flags & IORING_CQE_F_BUFFER) {
+    uint16_t bufferId = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+    std::span<const char> buffer = ring->buffer(bufferId, std::max(completion.res, 0));
+    if (clientIt != clients.end() && !exiting.test()) clientIt->second.consume({buffer.data(), buffer.size()});
+    ring->recycleBuffer(bufferId);
+  }
+
+  if (clientIt == clients.end()) {
+    Logger::log<Logger::LogLevel::ERROR>("Received data for a missing client");
+    return;
+  }
+  Client& client = clientIt->second;
+  Client::RingState& state = client.ringState();
+  bool rearm = !(completion.flags & IORING_CQE_F_MORE);
+  if (rearm) state.receiving = false;
+
+  if (completion.res == 0) hungUp(client);
+  else if (completion.res < 0 && completion.res != -ENOBUFS && completion.res != -ECANCELED) {
+    client.initiateShutdown();
+  }
+
+  if (!exiting.test()) dispatchRequests(client);
+
+  //a multishot recv keeps going until it is cancelled, so that's how we stop reading from a client over its limits
+  if (overLimit(client) && !client.isClosing()) {
+    if (!client.readingPaused() && state.receiving) ring->prepCancel(Uring::userData(Uring::Op::RECV, client.getfd()));
+    client.setReadingPaused(true);
+  }
+  //multishot recvs end when we run out of buffers, for example
+  else if (rearm && !client.isClosing()) {
+    ring->prepRecv(client.getfd());
+    state.receiving = true;
+  }
+  submitSends(client);
+  reapClient(clientIt);
+}
+
+void Dispatch::onSend(const io_uring_cqe& completion) {
+  auto clientIt = clients.find(Uring::fdOf(completion.user_data));
+  if (clientIt == clients.end()) {
+    Logger::log<Logger::LogLevel::ERROR>("Sent data for a missing client");
+    return;
+  }
+  Client& client = clientIt->second;
+  Client::RingState& state = client.ringState();
+  --state.sendsInFlight;
+
+  //drop whatever went out in full, and resubmit the rest from where a short send stopped
+  if (completion.res >= 0) {
+    size_t remaining = completion.res;
+    while (!state.sending.empty() && remaining >= state.sending.front().bytes().size() - state.sentOffset) {
+      Client::Outgoing& sent = state.sending.front();
+      remaining -= sent.bytes().size() - state.sentOffset;
+      //small enough to be worth writing another head into
+      bool spare = !sent.canned && sent.owned.capacity() <= Client::spareCapacity;
+      if (spare && state.spares.size() < Client::maxGather) {
+        state.spares.push_back(std::move(sent.owned));
+      }
+      state.sending.pop_front();
+      state.sentOffset = 0;
+    }
+    state.sentOffset += remaining;
+  }
+  else if (completion.res < 0 && completion.res != -ECANCELED) {
+    client.initiateShutdown();
+  }
+
+  if (completion.res > 0) client.wroteBytes(completion.res);
+
+  if (state.sendsInFlight == 0) {
+    if (client.notWriteable()) state.sending.clear();
+    else submitSends(client);
+  }
+  resumeReading(client);
+  reapClient(clientIt);
+}
+
+void Dispatch::resumeReading(Client& client) {
+  Client::RingState& state = client.ringState();
+  if (!client.readingPaused() || overLimit(client) || client.isClosing()) return;
+  client.setReadingPaused(false);
+  //whatever we held back in the parser
+  dispatchRequests(client);
+  if (overLimit(client)) client.setReadingPaused(true);
+  //if our cancel hasn't landed yet, onReceive rearms once it has
+  else if (!state.receiving) {
+    ring->prepRecv(client.getfd());
+    state.receiving = true;
+  }
+}
+
+// one sendmsg in flight per client at a time, which keeps the responses in order
+void Dispatch::submitSends(Client& client) {
+  Client::RingState& state = client.ringState();
+  if (state.sendsInFlight > 0 || client.notWriteable() || exiting.test()) return;
+  client.takeReady(state.sending);
+
+  size_t gathered = std::min(state.sending.size(), Client::maxGather);
+  if (gathered == 0) return;
+  for (size_t i = 0; i < gathered; ++i) {
+    std::string_view out = state.sending[i].bytes();
+    size_t offset = i == 0 ? state.sentOffset : 0;
+    state.iovecs[i] = { .iov_base = const_cast<char*>(out.data()) + offset, .iov_len = out.size() - offset };
+  }
+  state.message = { .msg_iov = state.iovecs.data(), .msg_iovlen = gathered };
+  ring->prepSendmsg(client.getfd(), &state.message);
+  ++state.sendsInFlight;
+}
+
+// we can only close a client once the kernel is done with it, or a new client could get its fd while we still
+// have operations in flight for the old one
+void Dispatch::reapClient(std::unordered_map<int, Client>::iterator clientIt) {
+  Client& client = clientIt->second;
+  Client::RingState& state = client.ringState();
+  if (!client.isClosing() || client.isPending() || state.sendsInFlight > 0) return;
+
+  if (state.receiving) {
+    if (!state.cancelling) {
+      ring->prepCancel(Uring::userData(Uring::Op::RECV, client.getfd()));
+      state.cancelling = true;
+    }
+    return;
+  }
+  clients.erase(clientIt);
+}
+
+void Dispatch::listen(int port) {
+  int listener = Server::makeListener(port, SOCK_NONBLOCK);
+
+  //level triggered, so if we leave some of the backlog for the next iteration we will hear about it again
+  epoll_event event {
+    .events = EPOLLIN,
+    .data = { .fd = listener }
+  };
+  listenfd = listener;
+  //with io_uring, the dispatch thread arms a multishot accept itself once it notices the listener
+  if (ring) wake();
+  else insist(epoll_ctl(epollfd, EPOLL_CTL_ADD, listener, &event), "Couldn't EPOLL_CTL_ADD a listener");
+}
+
+void Dispatch::acceptClients() {
+  for (int accepted = 0; accepted < server->config.acceptBatch; ++accepted) {
+    int client = accept4(listenfd, nullptr, nullptr, SOCK_NONBLOCK);
+    if (client < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+      else if (errno == ECONNABORTED || errno == EINTR) continue;
+      Logger::log<Logger::LogLevel::ERROR>("Received unhandled error during accept");
+      return;
+    }
+    assumeClient(client);
   }
 }
 
 void Dispatch::assumeClient(int clientfd) {
   Logger::log<Logger::LogLevel::DEBUG>("Assuming client " + std::to_string(clientfd));
 
-  // set client as nonblocking
-  insist(
-    fcntl(clientfd, F_SETFL, insist(fcntl(clientfd, F_GETFL), "could not get file flags") | O_NONBLOCK),
-    "could not set file flags"
-  );
+  //we already batch up everything that's ready into one write, so Nagle would only hold back the tail of it
+  int noDelay = 1;
+  if (setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)) < 0) {
+    Logger::log<Logger::LogLevel::WARN>("Couldn't set TCP_NODELAY on client " + std::to_string(clientfd));
+  }
+
+  //clients arrive already nonblocking, from accept4
+  if (ring) {
+    auto [clientIt, _] = clients.emplace(
+      std::piecewise_construct, 
+      std::forward_as_tuple(clientfd),
+      std::forward_as_tuple(clientfd, server->config.maxInFlightRequests, parserOptions)
+    );
+    ring->prepRecv(clientfd);
+    clientIt->second.ringState().receiving = true;
+    return;
+  }
 
   epoll_event event {
     .events = EPOLL_EVENT_FLAGS | EPOLLET,
@@ -186,7 +538,7 @@ void Dispatch::assumeClient(int clientfd) {
   else clients.emplace(
     std::piecewise_construct, 
     std::forward_as_tuple(clientfd),
-    std::forward_as_tuple(clientfd)
+    std::forward_as_tuple(clientfd, server->config.maxInFlightRequests, parserOptions)
   );
   //(https://devblogs.microsoft.com/oldnewthing/20231023-00/?p=108916)
 }
@@ -194,31 +546,167 @@ void Dispatch::assumeClient(int clientfd) {
 //dispatch thread may block here, by a worker thread and/or the other dispatch threads
 void Dispatch::dispatchRequest(Request&& request, Client& client) {
   Logger::log<Logger::LogLevel::DEBUG>("Dispatching a request");
-  const HandlerMap& methodMap = server->handlers[std::to_underlying(request.method)];
-  auto handlerIt = methodMap.find(request.endpoint);
-  if (handlerIt == methodMap.end()) {
+  const Route* route = server->routers[std::to_underlying(request.method)].match(request.endpoint, request.pathParams);
+  if (route) {
+    request.cancellation.clientGone = client.hangupToken();
+    if (route->deadline.count() > 0) {
+      request.cancellation.deadline = std::chrono::steady_clock::now() + route->deadline;
+    }
+    //we stop reading once the handler falls a window behind, and it lets us know when it catches up
+    if (request.bodyStream) {
+      int fd = client.getfd();
+      request.bodyStream->onDrained([this, fd]() { notifyForClient(fd); });
+    }
+  }
+  if (!route) {
     Logger::log<Logger::LogLevel::DEBUG>("Couldn't find the handler");
-    client.addOutgoing(client.incrementSequence(), "HTTP/1.1 404 Not Found\r\nContent-Length: 0");
+    Response notFound { .canned = HTTP::cannedStatus(Response::StatusCode::NOT_FOUND) };
+    respond(client, client.incrementSequence(), std::move(notFound));
+  }
+  else if (client.notWriteable()) {
+    //they have gone already
+    client.addOutgoing(client.incrementSequence(), std::string{});
+  }
+  else if (std::optional<Response> hit = route->cache ? route->cache->lookup(request) : std::nullopt) {
+    //a hit never leaves this thread
+    respond(client, client.incrementSequence(), std::move(*hit));
+  }
+  else if (route->coalescer && route->coalescer->follow(request, client, *this)) {
+    //answered along with the identical request that's already running
+  }
+  else if (route->asyncHandler) {
+    runAsync(std::move(request), *route, client, client.incrementSequence());
+    running = nullptr;
+  }
+  else if (route->runInline()) {
+    unsigned long sequence = client.incrementSequence();
+    Response result = Worker::execute(*route, request, server->config.inlineThreshold);
+    respond(client, sequence, std::move(result));
   }
   else {
-    server->workerThreads[dist(eng)].add(
-      Task {
-        .destination = &client, .owner = this,
-        .sequence = client.incrementSequence(),
-        .request = std::move(request),
-        .handler = handlerIt->second
-      }
-    );
+    Task task {
+      .destination = &client, .owner = this,
+      .sequence = client.incrementSequence(),
+      .request = std::move(request),
+      .route = route
+    };
+    enqueue(task);
+  }
+}
+
+void Dispatch::enqueue(Task& task) {
+  //the pool may be resized under us, but the deque itself never changes so any index below its size is fine
+  int workers = server->activeWorkers.load(std::memory_order_relaxed);
+  std::uniform_int_distribution<> dist {0, workers - 1};
+  int chosen = dist(eng);
+  bool wasBusy = server->workerThreads[chosen].busy();
+  //if every queue is full we have to wait for the workers to catch up - better than dropping the request
+  for (int attempt = 0; !server->workerThreads[chosen].add(task); ++attempt) {
+    chosen = (chosen + 1) % workers;
+    if (attempt >= workers) std::this_thread::yield();
+  }
+  //the task may be stuck behind a slow handler, so make sure someone is around to steal it
+  if (wasBusy && server->config.workStealing) server->workerThreads[dist(eng)].start();
+}
+
+// The request lives in our frame, so the handler can keep referring to it across suspensions.
+// The client can't go anywhere either, as it stays pending until we add our response.
+Detached Dispatch::runAsync(Request request, const Route& route, Client& client, unsigned long sequence) {
+  unsigned long generation = route.cache ? route.cache->generation() : 0;
+  //with a deadline, whichever of the handler and the 504 is first answers, and the other leaves it be
+  auto answered = std::make_shared<bool>(false);
+  if (route.deadline.count() > 0) expire(request.cancellation.deadline, answered, client, sequence);
+  Response result;
+  running = &request.cancellation;
+  try {
+    result = co_await route.asyncHandler(request);
+  }
+  catch (...) {
+    result = Worker::fromException(std::current_exception());
+  }
+  //we may have let go of the client already
+  if (std::exchange(*answered, true)) co_return;
+  if (request.cancellation.expired()) result = Worker::timedOut();
+  else if (route.cache) result = route.cache->store(request, route.cacheTTL, std::move(result), generation);
+  if (client.addOutgoing(sequence, std::move(result))) notifyForClient(client.getfd());
+}
+
+// The handler's own waits end at the deadline too, but it may be waiting on something that can't be cut short, like
+// a worker reading a file for it
+Detached Dispatch::expire(
+  std::chrono::steady_clock::time_point deadline, std::shared_ptr<bool> answered, Client& client, unsigned long sequence
+) {
+  bool onTime = co_await sleepUntil(deadline);
+  //on shutdown the handler is cut short as well, and answers for itself
+  if (!onTime || std::exchange(*answered, true)) co_return;
+  if (client.addOutgoing(sequence, Worker::timedOut())) notifyForClient(client.getfd());
+}
+
+// Checked on every read, so these have to be cheap - they're all just counters owned by this thread, or atomics
+bool Dispatch::overLimit(const Client& client) const {
+  const ServerConfig& config = server->config;
+  return client.inFlight() >= config.maxInFlightRequests
+    || (config.maxOutgoingBytes > 0 && client.bufferedBytes() >= config.maxOutgoingBytes)
+    || client.streamBacklog() >= config.streamWindow;
+}
+
+// anything over the client's allowance stays in its parser until it has caught up
+void Dispatch::dispatchRequests(Client& client) {
+  const ServerConfig& config = server->config;
+  size_t allowance = std::numeric_limits<size_t>::max();
+  if (config.maxOutgoingBytes > 0 && client.bufferedBytes() >= config.maxOutgoingBytes) allowance = 0;
+  else allowance = config.maxInFlightRequests - std::min(config.maxInFlightRequests, client.inFlight());
+
+  for (Request& request: client.takeRequests(allowance)) {
+    dispatchRequest(std::move(request), client);
   }
+  //the parser gave up on a request that was too big, once everything before it is answered
+  if (std::optional<Response::StatusCode> status = client.takeRejection()) {
+    respond(client, client.incrementSequence(), Response { .canned = HTTP::cannedRefusal(*status) });
+  }
+}
+
+// EOF from the client - whether they are still waiting for responses is up to the config
+void Dispatch::hungUp(Client& client) {
+  if (server->config.cancelOnHangup && client.isPending()) client.initiateShutdown();
+  else client.setClosing();
+}
+
+// for responses made on this thread, so there's no need to go through clientsWantWrite: the ring path submits sends
+// after dispatching anyway, and in epoll mode we're in the middle of processing this client's notifications
+void Dispatch::respond(Client& client, unsigned long sequence, Response&& response) {
+  if (client.addOutgoing(sequence, std::move(response)) && !ring) pendingNotifications[client.getfd()] |= EPOLLOUT;
 }
 
 void Dispatch::shutdown() {
   exiting.test_and_set();
   exiting.notify_all();
+  //stop the kernel from routing any more connections to us
+  if (int listener = listenfd.exchange(-1); listener >= 0) {
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, listener, nullptr);
+    close(listener);
+  }
   //diminished event loop just to handle remaining outgoing
-  bool finished = false;
+  bool finished = ring != nullptr;
+  if (ring) {
+    //let the sends the kernel already has finish, but start no more
+    constexpr int patience = 50;
+    for (int i = 0; i < patience; ++i) {
+      bool sending = false;
+      for (auto& [_, client]: clients) sending |= client.ringState().sendsInFlight > 0;
+      if (!sending) break;
+      doRing(100);
+    }
+  }
+  //everyone we're partway through writing to gets to finish, not just those we happened to have a notification for
+  if (!ring) {
+    for (const auto& [fd, _]: clients) pendingNotifications[fd] |= EPOLLOUT;
+  }
+  //and clients that can't take any more just now get a while to catch up, but not forever
+  auto giveUp = std::chrono::steady_clock::now() + std::chrono::seconds{5};
   while (!finished) {
     finished = true;
+    bool blocked = false;
 
     auto notificationIt = pendingNotifications.begin();
     while (notificationIt != pendingNotifications.end()) {
@@ -237,6 +725,7 @@ void Dispatch::shutdown() {
       if (clientNotifications & EPOLLOUT) {
         Client::IOState state = client.writeOne();
         if (state != Client::IOState::DONE) finished = false;
+        blocked |= state == Client::IOState::WOULDBLOCK;
         if (state != Client::IOState::CONTINUE) {
           clientNotifications = 0;
           if (state == Client::IOState::ERROR) {
@@ -253,7 +742,8 @@ void Dispatch::shutdown() {
       else ++notificationIt;
     }
 
-    doEpoll();
+    auto patience = std::chrono::ceil<std::chrono::milliseconds>(giveUp - std::chrono::steady_clock::now());
+    doEpoll(blocked ? std::max<int>(patience.count(), 0) : 0);
   }
 
   Logger::log<Logger::LogLevel::INFO>("Finished writing to clients, waiting for worker threads to exit");
@@ -261,14 +751,136 @@ void Dispatch::shutdown() {
     worker.waitForExit();
   }
 
+  abandonCoroutines();
+
   Logger::log<Logger::LogLevel::INFO>("Clearing clients");
   clients.clear();
 
   Logger::log<Logger::LogLevel::INFO>("Clients closed, dispatch thread exiting");
 }
 
+/* coroutine support */
+
+void Dispatch::addTimer(std::chrono::steady_clock::time_point deadline, std::coroutine_handle<> coroutine, bool* cutShort) {
+  if (exiting.test()) {
+    *cutShort = true;
+    runnable.push_back(coroutine);
+  }
+  else timers.push({ deadline, coroutine, cutShort });
+}
+
+void Dispatch::awaitFd(
+  int fd, unsigned events, std::coroutine_handle<> coroutine, bool* cutShort,
+  std::chrono::steady_clock::time_point deadline
+) {
+  if (!exiting.test()) {
+    epoll_event event {
+      .events = events | EPOLLONESHOT,
+      .data = { .fd = fd }
+    };
+    if (ring) ring->prepPoll(fd, events);
+    if (ring || epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) == 0) {
+      fdWaiters[fd] = { coroutine, cutShort };
+      if (deadline != std::chrono::steady_clock::time_point::max()) timers.push({ deadline, coroutine, cutShort, fd });
+      return;
+    }
+    Logger::log<Logger::LogLevel::ERROR>("Couldn't EPOLL_CTL_ADD an fd for a coroutine");
+  }
+  *cutShort = true;
+  runnable.push_back(coroutine);
+}
+
+void Dispatch::fdReady(int fd) {
+  auto waiterIt = fdWaiters.find(fd);
+  if (waiterIt == fdWaiters.end()) return;
+  if (!ring) epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, nullptr);
+  runnable.push_back(waiterIt->second.coroutine);
+  fdWaiters.erase(waiterIt);
+}
+
+void Dispatch::stopWatching(int fd) {
+  if (ring) ring->prepCancel(Uring::userData(Uring::Op::POLL, fd));
+  else epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void Dispatch::offload(std::function<void()> job) {
+  //the workers may already be gone
+  if (exiting.test()) {
+    job();
+    return;
+  }
+  Task task { .destination = nullptr, .owner = this, .sequence = 0, .request = {}, .route = nullptr, .job = std::move(job) };
+  enqueue(task);
+}
+
+void Dispatch::post(std::coroutine_handle<> coroutine) {
+  posted.add(coroutine);
+  wake();
+}
+
+bool Dispatch::isExiting() const {
+  return exiting.test();
+}
+
+size_t Dispatch::resumeCoroutines() {
+  auto now = std::chrono::steady_clock::now();
+  while (!timers.empty() && timers.top().deadline <= now) {
+    const Timer& timer = timers.top();
+    auto waiterIt = timer.fd < 0 ? fdWaiters.end() : fdWaiters.find(timer.fd);
+    if (timer.fd < 0) runnable.push_back(timer.coroutine);
+    //unless the fd came ready first
+    else if (waiterIt != fdWaiters.end() && waiterIt->second.coroutine == timer.coroutine) {
+      stopWatching(timer.fd);
+      *timer.cutShort = true;
+      runnable.push_back(timer.coroutine);
+      fdWaiters.erase(waiterIt);
+    }
+    timers.pop();
+  }
+  while (std::optional<std::coroutine_handle<>> coroutine = posted.take()) runnable.push_back(*coroutine);
+
+  //anything these make runnable waits for the next iteration
+  std::vector<std::coroutine_handle<>> resuming;
+  std::swap(resuming, runnable);
+  for (std::coroutine_handle<> coroutine: resuming) {
+    coroutine.resume();
+    running = nullptr;
+  }
+  return resuming.size();
+}
+
+// Coroutines waiting on worker jobs that never ran (the workers stop without finishing their queues) are left be
+void Dispatch::abandonCoroutines() {
+  constexpr int patience = 100;
+  for (int i = 0; i < patience; ++i) {
+    while (!timers.empty()) {
+      //an fd's waiter is resumed below
+      if (timers.top().fd < 0) {
+        *timers.top().cutShort = true;
+        runnable.push_back(timers.top().coroutine);
+      }
+      timers.pop();
+    }
+    for (auto& [fd, waiter]: fdWaiters) {
+      *waiter.cutShort = true;
+      runnable.push_back(waiter.coroutine);
+      stopWatching(fd);
+    }
+    fdWaiters.clear();
+    if (resumeCoroutines() == 0) return;
+  }
+  Logger::log<Logger::LogLevel::ERROR>("Coroutines still waiting after shutdown, leaving them");
+}
+
 void Dispatch::notifyForClient(int clientfd) {
   clientsWantWrite.add(clientfd);
+  wake();
+}
+
+bool Dispatch::wake() {
+  if (!sleeping.exchange(false)) return false;
+  eventfd_write(wakefd, 1);
+  return true;
 }
 
 void Dispatch::requestStop() {
@@ -284,6 +896,7 @@ void Dispatch::join() {
 }
 
 Dispatch::~Dispatch() {
+  close(wakefd);
   close(epollfd);
 }
 
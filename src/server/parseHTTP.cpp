@@ -1,18 +1,43 @@
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <iterator>
 #include <string_view>
 #include <utility>
 
 #include "server/parseHTTP.h"
+#include "server/scan.h"
 #include "utils/logger.h"
 
 namespace MyServer {
 namespace HTTP {
 
-RequestParser::RequestParser(): state{State::PARSE_METHOD} {};
+namespace {
+const ParserOptions defaultOptions {};
+}
+
+RequestParser::RequestParser(): RequestParser{defaultOptions} {}
+
+RequestParser::RequestParser(const ParserOptions& options): state{State::PARSE_METHOD}, options{&options} {}
+
+RequestParser::~RequestParser() {
+  clear();
+}
 
 void RequestParser::reset() {
   state = State::PARSE_METHOD;
-  currentRequest = {};
-  buffer = ""; auxbuffer = "";
+  method = Request::Method::GET;
+  endpoint = {}; query = {}; headers = {};
+  knownHeaders = {};
+  contentLength = 0;
+  bodyStart = 0; bodyLength = 0;
+  sink = Sink::BUFFER;
+  spooling = {};
+  spool.reset();
+  //if the handler hasn't had the whole body, it's not going to get it
+  if (stream) std::exchange(stream, {})->abandon();
+  tokenStart = 0; key = {};
   count = 0;
   error = false;
   fresh = true;
@@ -20,14 +45,48 @@ void RequestParser::reset() {
 
 void RequestParser::clear() {
   reset();
+  rejection.reset();
   parsedRequests.clear();
+  dropBuffer();
+}
+
+void RequestParser::dropBuffer() {
+  requestStart = 0;
+  buffer.release();
 }
 
-void RequestParser::commitAndContinue(std::string_view input) {
+Request RequestParser::makeRequest(Token body) const {
+  Request request {buffer.pin()};
+  request.method = method;
+  request.endpoint = text(endpoint);
+  request.rawQuery = text(query);
+  request.rawHeaders = text(headers);
+  request.body = text(body);
+  for (size_t i = 0; i < knownHeaders.size(); ++i) {
+    if (knownHeaders[i]) request.knownHeaders[i] = text(*knownHeaders[i]);
+  }
+  request.contentLength = contentLength;
+  return request;
+}
+
+size_t RequestParser::commit(std::string_view input, size_t head, Token body) {
   Logger::log<Logger::LogLevel::DEBUG>("Parsed a HTTP request");
-  parsedRequests.push_back(std::move(currentRequest));
+  parsedRequests.push_back(makeRequest(body));
+  consumed(input, head);
+  reset();
+  return head;
+}
+
+void RequestParser::consumed(std::string_view input, size_t head) {
+  requestStart += offsetOf(input.data() + head);
+  tokenStart = 0;
+}
+
+size_t RequestParser::reject(Response::StatusCode status, std::string_view why) {
+  Logger::log<Logger::LogLevel::WARN>("Refusing a request: " + std::string{why});
+  rejection = status;
   reset();
-  process(input);
+  return needMore;
 }
 
 bool RequestParser::isError() const {
@@ -38,185 +97,353 @@ bool RequestParser::isFresh() const {
   return fresh;
 }
 
+size_t RequestParser::moveTo(State next, std::string_view input, size_t head) {
+  state = next;
+  tokenStart = offsetOf(input.data() + head);
+  return head;
+}
+
+size_t RequestParser::offsetOf(const char* at) const {
+  return at - buffer.data().data() - requestStart;
+}
+
+std::string_view RequestParser::tokenUpTo(const char* end) const {
+  const char* start = buffer.data().data() + requestStart + tokenStart;
+  return { start, static_cast<size_t>(end - start) };
+}
+
+RequestParser::Token RequestParser::tokenTo(std::string_view input, size_t head) const {
+  return { tokenStart, offsetOf(input.data() + head) - tokenStart };
+}
+
+std::string_view RequestParser::text(Token token) const {
+  return buffer.data().substr(requestStart + token.start, token.length);
+}
+
 /* State machine goes here */
+// Each state consumes what it can of the input. If it finishes its part of the request it moves to the next state
+// and returns how much it took, otherwise it returns needMore and picks up where it left off with the next input.
 template <RequestParser::State s>
-void RequestParser::processHelper(std::string_view) {
+size_t RequestParser::processHelper(std::string_view) {
   Logger::log<Logger::LogLevel::FATAL>("RequestParser entered some weird state");
+  return needMore;
 }
 
 template <>
-void RequestParser::processHelper<RequestParser::State::PARSE_METHOD>(std::string_view input) {
-  state = RequestParser::State::PARSE_METHOD;
-  int head = 0;
-  while (head < input.size() && input[head] != ' ') buffer += input[head++];
-  if (head < input.size() && input[head] == ' ') {
-    if (buffer == "GET") currentRequest.method = Request::Method::GET;
-    else if (buffer == "POST") currentRequest.method = Request::Method::POST;
-    else if (buffer == "PUT") currentRequest.method = Request::Method::PUT;
-    else if (buffer == "DELETE") currentRequest.method = Request::Method::DELETE;
-    else {
-      Logger::log<Logger::LogLevel::WARN>("Parsed this unsupported method: " + buffer);
-      error = true;
-    }
-    buffer = "";
-    (this->*jumpToAction(RequestParser::State::PARSE_ENDPOINT))(input.substr(head + 1));
+size_t RequestParser::processHelper<RequestParser::State::PARSE_METHOD>(std::string_view input) {
+  size_t head = findFirstOf(input, " ");
+  if (head == std::string_view::npos) return needMore;
+
+  std::string_view name = tokenUpTo(input.data() + head);
+  if (name == "GET") method = Request::Method::GET;
+  else if (name == "POST") method = Request::Method::POST;
+  else if (name == "PUT") method = Request::Method::PUT;
+  else if (name == "DELETE") method = Request::Method::DELETE;
+  else {
+    Logger::log<Logger::LogLevel::WARN>("Parsed this unsupported method: " + std::string{name});
+    error = true;
   }
+  return moveTo(RequestParser::State::PARSE_ENDPOINT, input, head + 1);
 }
 
 template <>
-void RequestParser::processHelper<RequestParser::State::PARSE_ENDPOINT>(std::string_view input) {
-  state = RequestParser::State::PARSE_ENDPOINT;
-  int head = 0;
-  while (head < input.size() && input[head] != ' ' && input[head] != '?') buffer += input[head++];
-
-  if (head < input.size()) {
-    if (input[head] == ' ') {
-      currentRequest.endpoint = std::exchange(buffer, "");
-      (this->*jumpToAction(RequestParser::State::FIND_HEADERS))(input.substr(head + 1));
-    }
-    else if (input[head] == '?') {
-      currentRequest.endpoint = std::exchange(buffer, "");
-      (this->*jumpToAction(RequestParser::State::PARSE_QUERY_KEY))(input.substr(head + 1));
-    }
-    // else we just continue in this state
-  }
+size_t RequestParser::processHelper<RequestParser::State::PARSE_ENDPOINT>(std::string_view input) {
+  size_t head = findFirstOf(input, " ?");
+  if (head == std::string_view::npos) return needMore;
+
+  endpoint = tokenTo(input, head);
+  if (input[head] == ' ') return moveTo(RequestParser::State::FIND_HEADERS, input, head + 1);
+  else return moveTo(RequestParser::State::PARSE_QUERY, input, head + 1);
 }
 
 template <>
-void RequestParser::processHelper<RequestParser::State::FIND_HEADERS>(std::string_view input) {
-  state = RequestParser::State::FIND_HEADERS;
-  int head = 0;
+size_t RequestParser::processHelper<RequestParser::State::FIND_HEADERS>(std::string_view input) {
+  size_t head = 0;
   while (head < input.size()) {
+    //until we've seen a \r, there's nothing to do but look for one
+    if (count == 0) {
+      size_t cr = findFirstOf(input.substr(head), "\r");
+      if (cr == std::string_view::npos) return needMore;
+      head += cr;
+    }
     if (input[head] != RequestParser::httpnewline[count & 1]) {
       if (count == 2) {
         count = 0;
-        (this->*jumpToAction(RequestParser::State::PARSE_HEADER_KEY))(input.substr(head));
-        return;
+        //the first header starts the header block
+        if (headers.start == 0) headers.start = offsetOf(input.data() + head);
+        return moveTo(RequestParser::State::PARSE_HEADER_KEY, input, head);
       }
       else count = 0;
     }
     else {
       ++count;
       if (count == 4) {
-        //no more headers
+        //no more headers - the block ends after the last header's \r\n
         count = 0;
-        (this->*jumpToAction(RequestParser::State::FIND_BODY))(input.substr(head + 1));
-        return;
+        size_t end = offsetOf(input.data() + head + 1) - 2;
+        if (headers.start == 0) headers.start = end;
+        headers.length = end - headers.start;
+        return moveTo(RequestParser::State::FIND_BODY, input, head + 1);
       }
     }
 
     ++head;
   }
+  return needMore;
 }
 
+//the query is split up by the request, if the handler asks for it
 template <>
-void RequestParser::processHelper<RequestParser::State::PARSE_QUERY_KEY>(std::string_view input) {
-  state = RequestParser::State::PARSE_QUERY_KEY;
-  int head = 0;
-  while (head < input.size() && input[head] != ' ' && input[head] != '=') buffer += input[head++];
-  if (head < input.size() && input[head] == '=') {
-    (this->*jumpToAction(RequestParser::State::PARSE_QUERY_VALUE))(input.substr(head + 1));
-  }
-}
+size_t RequestParser::processHelper<RequestParser::State::PARSE_QUERY>(std::string_view input) {
+  size_t head = findFirstOf(input, " ");
+  if (head == std::string_view::npos) return needMore;
 
-template <>
-void RequestParser::processHelper<RequestParser::State::PARSE_QUERY_VALUE>(std::string_view input) {
-  state = RequestParser::State::PARSE_QUERY_VALUE;
-  int head = 0;
-  while (head < input.size() && input[head] != ' ' && input[head] != '&' && input[head] != ' ') auxbuffer += input[head++];
-  if (head < input.size()) {
-    if (input[head] == '&') {
-      //take more queries
-      currentRequest.query[std::exchange(buffer, "")] = std::exchange(auxbuffer, "");
-      (this->*jumpToAction(RequestParser::State::PARSE_QUERY_KEY))(input.substr(head + 1));
-    }
-    else if (input[head] == ' ') {
-      currentRequest.query[std::exchange(buffer, "")] = std::exchange(auxbuffer, "");
-      (this->*jumpToAction(RequestParser::State::FIND_HEADERS))(input.substr(head + 1));
-    }
-  }
+  query = tokenTo(input, head);
+  return moveTo(RequestParser::State::FIND_HEADERS, input, head + 1);
 }
 
 template <>
-void RequestParser::processHelper<RequestParser::State::PARSE_HEADER_KEY>(std::string_view input) {
-  state = RequestParser::State::PARSE_HEADER_KEY;
-  int head = 0;
-  while (head < input.size() && input[head] != ':') buffer += input[head++];
-  if (head < input.size() && input[head] == ':') {
-    (this->*jumpToAction(RequestParser::State::PARSE_HEADER_VALUE))(input.substr(head + 1));
-  }
+size_t RequestParser::processHelper<RequestParser::State::PARSE_HEADER_KEY>(std::string_view input) {
+  size_t head = findFirstOf(input, ":");
+  if (head == std::string_view::npos) return needMore;
+
+  key = tokenTo(input, head);
+  return moveTo(RequestParser::State::PARSE_HEADER_VALUE, input, head + 1);
 }
 
 template <>
-void RequestParser::processHelper<RequestParser::State::PARSE_HEADER_VALUE>(std::string_view input) {
-  state = RequestParser::State::PARSE_HEADER_VALUE;
-  int head = 0;
+size_t RequestParser::processHelper<RequestParser::State::PARSE_HEADER_VALUE>(std::string_view input) {
+  size_t head = 0;
   while (head < input.size() && count < 2) {
+    if (count == 0) {
+      size_t cr = findFirstOf(input.substr(head), "\r");
+      if (cr == std::string_view::npos) return needMore;
+      head += cr;
+    }
     //newline symbols cannot be part of the value anyway
     if (input[head] == RequestParser::httpnewline[count]) ++count;
-    else {
-      auxbuffer += input[head];
-      count = 0;
-    }
+    else count = 0;
     ++head;
   }
+  if (count < 2) return needMore;
 
-  if (count == 2) {
+  //the rest of the headers are split up again by the request if the handler asks, but these we want now
+  std::optional<KnownHeader> known = knownHeader(text(key));
+  if (known) {
     //HTTP standard requires we remove trailing whitespace from header values...
-    //Would be better to not take the spaces at the front, but would need an extra TAKE_SPACE state
-    int l = 0;
-    while (l < auxbuffer.size() && std::isspace(auxbuffer[l])) ++l;
-    int r = auxbuffer.size() - 1;
-    while (r > l && std::isspace(auxbuffer[r])) --r;
-    auxbuffer = auxbuffer.substr(l, r - l + 1);
-    currentRequest.headers[std::exchange(buffer, "")] = std::exchange(auxbuffer, "");
+    std::string_view value = tokenUpTo(input.data() + head - 2);
+    while (!value.empty() && std::isspace(value.front())) value.remove_prefix(1);
+    while (!value.empty() && std::isspace(value.back())) value.remove_suffix(1);
 
-    //purposefully do not reset count, so FIND_HEADERS knows if it's found the next header or the body
-    (this->*jumpToAction(RequestParser::State::FIND_HEADERS))(input.substr(head));
+    //a length we can't read exactly would let the client decide where its next request starts, so it's refused here,
+    //before anything looks at it
+    if (known == KnownHeader::CONTENT_LENGTH) {
+      std::optional<Token> previous = knownHeaders[std::to_underlying(KnownHeader::CONTENT_LENGTH)];
+      if (previous && text(*previous) != value) {
+        return reject(Response::StatusCode::BAD_REQUEST, "conflicting Content-Lengths");
+      }
+      size_t length = 0;
+      auto [end, parsed] = std::from_chars(value.data(), value.data() + value.size(), length);
+      if (parsed == std::errc::result_out_of_range) {
+        return reject(Response::StatusCode::PAYLOAD_TOO_LARGE, "Content-Length out of range");
+      }
+      if (parsed != std::errc{} || end != value.data() + value.size()) {
+        return reject(Response::StatusCode::BAD_REQUEST, "non-numeric Content-Length " + std::string{value});
+      }
+      if (options->maxBodyBytes > 0 && length > options->maxBodyBytes) {
+        return reject(Response::StatusCode::PAYLOAD_TOO_LARGE, "body too large");
+      }
+      contentLength = length;
+    }
+    knownHeaders[std::to_underlying(*known)] = Token { offsetOf(value.data()), value.size() };
   }
+
+  //purposefully do not reset count, so FIND_HEADERS knows if it's found the next header or the body
+  return moveTo(RequestParser::State::FIND_HEADERS, input, head);
 }
 
 template <>
-void RequestParser::processHelper<RequestParser::State::FIND_BODY>(std::string_view input) {
-  state = RequestParser::State::FIND_BODY;
+size_t RequestParser::processHelper<RequestParser::State::FIND_BODY>(std::string_view input) {
+  if (options->maxHeaderBytes > 0 && offsetOf(input.data()) > options->maxHeaderBytes) {
+    return reject(Response::StatusCode::REQUEST_HEADER_FIELDS_TOO_LARGE, "headers too large");
+  }
+  bool chunked = false;
+  if (std::optional<Token> coding = knownHeaders[std::to_underlying(KnownHeader::TRANSFER_ENCODING)]) {
+    if (!equalsIgnoringCase(text(*coding), "chunked")) {
+      return reject(Response::StatusCode::NOT_IMPLEMENTED, "unsupported transfer coding " + std::string{text(*coding)});
+    }
+    //with both, we and a proxy in front of us could disagree on where the request ends
+    if (knownHeaders[std::to_underlying(KnownHeader::CONTENT_LENGTH)]) {
+      return reject(Response::StatusCode::BAD_REQUEST, "both Content-Length and Transfer-Encoding");
+    }
+    chunked = true;
+  }
   //if there is no Content-Length, we expect no body, and we entered this state after seeing the \r\n\r\n - we are done!
-  auto it = currentRequest.headers.find("Content-Length");
+  //(and a Content-Length over maxBodyBytes was refused as soon as we saw it)
+  if (!chunked && contentLength == 0) return commit(input, 0, {});
+  count = contentLength;
 
-  if (it == currentRequest.headers.end() || it->second == "0") {
-    commitAndContinue(input);
+  //a streamed body's request goes out now, so the handler can start on the body as it arrives
+  if (options->streamsBody && options->streamsBody(method, text(endpoint))) {
+    Request& request = parsedRequests.emplace_back(makeRequest({}));
+    stream = request.bodyStream = std::make_shared<BodyStream>(options->streamWindow);
+    sink = Sink::STREAM;
+    consumed(input, 0);
   }
-  else {
-    long contentLength = 0;
-    for (const char& c: it->second) {
-      if (!std::isdigit(c)) {
-        contentLength = -1;
-        break;
-      }
-      contentLength *= 10;
-      contentLength += c - '0';
+  //(we find out how big a chunked body is as it comes, so it moves to a file once it gets big enough)
+  else if (!chunked && options->spoolThreshold > 0 && contentLength >= options->spoolThreshold) {
+    if (!startSpooling({})) return reject(Response::StatusCode::INTERNAL_SERVER_ERROR, "couldn't spool the body");
+    consumed(input, 0);
+  }
+  bodyStart = offsetOf(input.data());
+  return moveTo(chunked ? RequestParser::State::PARSE_CHUNK_SIZE : RequestParser::State::PARSE_BODY, input, 0);
+}
+
+template <>
+size_t RequestParser::processHelper<RequestParser::State::PARSE_BODY>(std::string_view input) {
+  size_t taken = std::min(input.size(), count);
+  count -= taken;
+  if (sink == Sink::BUFFER) {
+    if (count > 0) return needMore;
+    return commit(input, taken, tokenTo(input, taken));
+  }
+
+  // the body goes out of the buffer as soon as we have it, so all we hold on to is the latest read
+  if (!deliver(input.substr(0, taken))) return reject(Response::StatusCode::INTERNAL_SERVER_ERROR, "lost the body");
+  consumed(input, taken);
+  if (count > 0) return needMore;
+  return finishBody(input, taken);
+}
+
+// hex size[;extensions]\r\n, then that many bytes of chunk, then \r\n - until a 0 size, then trailers like headers
+template <>
+size_t RequestParser::processHelper<RequestParser::State::PARSE_CHUNK_SIZE>(std::string_view input) {
+  size_t head = findFirstOf(input, "\n");
+  if (head == std::string_view::npos) return lineTooLong(input, maxChunkLine, Response::StatusCode::BAD_REQUEST);
+
+  std::string_view line = tokenUpTo(input.data() + head);
+  size_t size = 0;
+  auto [end, error] = std::from_chars(line.data(), line.data() + line.size(), size, 16);
+  std::string_view rest = line.substr(end - line.data());
+  bool valid = error == std::errc{} && end != line.data() && rest.ends_with('\r')
+    && (rest.size() == 1 || rest.front() == ';' || rest.front() == ' ' || rest.front() == '\t');
+  if (!valid) return reject(Response::StatusCode::BAD_REQUEST, "bad chunk size line");
+
+  if (size == 0) return moveTo(RequestParser::State::PARSE_TRAILERS, input, head + 1);
+  //compared without adding, so a huge size can't wrap around and slip under the limit - and with no limit, the body
+  //still has to fit in a size_t
+  size_t limit = options->maxBodyBytes > 0 ? options->maxBodyBytes : std::numeric_limits<size_t>::max();
+  if (size > limit - bodyLength) return reject(Response::StatusCode::PAYLOAD_TOO_LARGE, "chunked body too large");
+  count = size;
+  return moveTo(RequestParser::State::PARSE_CHUNK_DATA, input, head + 1);
+}
+
+template <>
+size_t RequestParser::processHelper<RequestParser::State::PARSE_CHUNK_DATA>(std::string_view input) {
+  size_t taken = std::min(input.size(), count);
+  count -= taken;
+  if (!deliver(input.substr(0, taken))) return reject(Response::StatusCode::INTERNAL_SERVER_ERROR, "lost the body");
+  if (sink == Sink::BUFFER && options->spoolThreshold > 0 && bodyLength >= options->spoolThreshold) {
+    if (!startSpooling(text({ bodyStart, bodyLength }))) {
+      return reject(Response::StatusCode::INTERNAL_SERVER_ERROR, "couldn't spool the body");
     }
+  }
+  if (sink != Sink::BUFFER) consumed(input, taken);
+  if (count > 0) return needMore;
+  return moveTo(RequestParser::State::PARSE_CHUNK_END, input, taken);
+}
+
+template <>
+size_t RequestParser::processHelper<RequestParser::State::PARSE_CHUNK_END>(std::string_view input) {
+  size_t head = findFirstOf(input, "\n");
+  if (head == std::string_view::npos) return lineTooLong(input, 1, Response::StatusCode::BAD_REQUEST);
+  if (tokenUpTo(input.data() + head) != "\r") return reject(Response::StatusCode::BAD_REQUEST, "chunk without its \\r\\n");
+  return moveTo(RequestParser::State::PARSE_CHUNK_SIZE, input, head + 1);
+}
+
+//we don't do anything with trailers, so they're skipped a line at a time until the blank one
+template <>
+size_t RequestParser::processHelper<RequestParser::State::PARSE_TRAILERS>(std::string_view input) {
+  size_t head = findFirstOf(input, "\n");
+  if (head == std::string_view::npos) {
+    return lineTooLong(input, options->maxHeaderBytes, Response::StatusCode::REQUEST_HEADER_FIELDS_TOO_LARGE);
+  }
+  if (tokenUpTo(input.data() + head) != "\r") return moveTo(RequestParser::State::PARSE_TRAILERS, input, head + 1);
+  return finishBody(input, head + 1);
+}
+
+size_t RequestParser::lineTooLong(std::string_view input, size_t limit, Response::StatusCode status) {
+  if (limit > 0 && offsetOf(input.data() + input.size()) - tokenStart > limit) return reject(status, "line too long");
+  return needMore;
+}
+
+bool RequestParser::inBody() const {
+  return state >= State::PARSE_BODY;
+}
 
-    if (contentLength == -1) {
-      Logger::log<Logger::LogLevel::ERROR>("Client sent non-numeric Content-Length: " + it->second);
-      error = true;
+bool RequestParser::startSpooling(std::string_view soFar) {
+  spool = Utils::SpoolFile::create(options->spoolDirectory);
+  if (!spool) {
+    Logger::log<Logger::LogLevel::ERROR>("Couldn't make a file to spool a body to in " + options->spoolDirectory);
+    return false;
+  }
+  if (!spool->write(soFar)) return false;
+  spooling = makeRequest({});
+  sink = Sink::SPOOL;
+  return true;
+}
+
+bool RequestParser::deliver(std::string_view chunk) {
+  switch (sink) {
+    case Sink::STREAM: {
+      //the handler returned without reading it all, so the rest is read past to get to the next request
+      if (!stream->wanted()) break;
+      //a chunk keeps its whole block until the handler is done with it, while the window only counts the chunk - so
+      //small ones are copied out, or a client trickling its body in could have us hold a block for every few bytes
+      Utils::SharedBlock pinned = buffer.pin();
+      if (chunk.size() < pinned.capacity() / 4) {
+        pinned = Utils::SharedBlock::allocate(chunk.size());
+        std::memcpy(pinned.data(), chunk.data(), chunk.size());
+        chunk = { pinned.data(), chunk.size() };
+      }
+      stream->push({ std::move(pinned), chunk });
+      break;
     }
-    else {
-      buffer.reserve(contentLength);
-      count = contentLength;
+    case Sink::SPOOL:
+      if (!spool->write(chunk)) {
+        Logger::log<Logger::LogLevel::ERROR>("Couldn't write to a spooled body");
+        return false;
+      }
+      break;
+    case Sink::BUFFER: {
+      //only chunked bodies come through here, each chunk moved down to follow on from the last
+      size_t from = chunk.data() - buffer.data().data();
+      size_t to = requestStart + bodyStart + bodyLength;
+      if (from != to) buffer.moveWithin(to, from, chunk.size());
+      break;
     }
-    (this->*jumpToAction(RequestParser::State::PARSE_BODY))(input);
   }
+  bodyLength += chunk.size();
+  return true;
 }
 
-template <>
-void RequestParser::processHelper<RequestParser::State::PARSE_BODY>(std::string_view input) {
-  state = RequestParser::State::PARSE_BODY;
-  int head = 0;
-  while (head < input.size() && count-- > 0) buffer += input[head++]; 
-  if (count <= 0) {
-    currentRequest.body = std::move(buffer);
-    commitAndContinue(input.substr(head));
+size_t RequestParser::finishBody(std::string_view input, size_t head) {
+  if (sink == Sink::BUFFER) return commit(input, head, { bodyStart, bodyLength });
+
+  if (sink == Sink::STREAM) std::exchange(stream, {})->finish();
+  else {
+    std::shared_ptr<const Utils::MappedFile> file = spool->map();
+    if (!file) {
+      Logger::log<Logger::LogLevel::ERROR>("Couldn't map a spooled body");
+      return reject(Response::StatusCode::INTERNAL_SERVER_ERROR, "couldn't map the spooled body");
+    }
+    spooling.spooledTo(std::move(file));
+    parsedRequests.push_back(std::move(spooling));
   }
+  Logger::log<Logger::LogLevel::DEBUG>("Parsed a HTTP request");
+  consumed(input, head);
+  reset();
+  return head;
 }
 
 // I wanted to do this with a for loop but it doesn't compile...
@@ -240,12 +467,65 @@ constexpr RequestParser::Action RequestParser::jumpToAction(RequestParser::State
   return actions[std::to_underlying(state)];
 }
 
+void RequestParser::parse(std::string_view input) {
+  //one state after another, for as many requests as there are in the input, without growing the stack
+  while (true) {
+    size_t taken = (this->*jumpToAction(state))(input);
+    if (taken == needMore) return;
+    input.remove_prefix(taken);
+  }
+}
+
 void RequestParser::process(std::string_view input) {
-  return (this->*jumpToAction(state))(input);
+  std::span<char> space = buffer.space(input.size());
+  std::memcpy(space.data(), input.data(), input.size());
+  received(input.size());
+}
+
+std::span<char> RequestParser::receiveSpace() {
+  return buffer.space(CHUNKSIZE);
+}
+
+void RequestParser::received(size_t bytes) {
+  buffer.commit(bytes);
+  if (rejection) return dropBuffer();
+  std::string_view data = buffer.data();
+  parse(data.substr(data.size() - bytes));
+  //a request line and headers we're still waiting on the end of
+  size_t unfinished = data.size() - requestStart;
+  if (!rejection && !inBody() && options->maxHeaderBytes > 0 && unfinished > options->maxHeaderBytes) {
+    reject(Response::StatusCode::REQUEST_HEADER_FIELDS_TOO_LARGE, "headers too large");
+  }
+  if (rejection) return dropBuffer();
+  //whatever we've finished with goes, and the buffer goes back to the pool if that's everything
+  buffer.discard(requestStart);
+  requestStart = 0;
+}
+
+std::vector<Request> RequestParser::takeRequests(size_t limit) {
+  if (parsedRequests.size() <= limit) return std::exchange(parsedRequests, {});
+  std::vector<Request> taken {
+    std::make_move_iterator(parsedRequests.begin()),
+    std::make_move_iterator(parsedRequests.begin() + limit)
+  };
+  parsedRequests.erase(parsedRequests.begin(), parsedRequests.begin() + limit);
+  return taken;
+}
+
+bool RequestParser::hasRequests() const {
+  return !parsedRequests.empty();
+}
+
+std::optional<Response::StatusCode> RequestParser::rejected() const {
+  return rejection;
+}
+
+bool RequestParser::streamingBody() const {
+  return stream != nullptr;
 }
 
-std::vector<Request> RequestParser::takeRequests() {
-  return std::exchange(parsedRequests, {});
+size_t RequestParser::streamBacklog() const {
+  return stream ? stream->backlog() : 0;
 }
 
 }
@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <cctype>
+#include <string>
+#include <vector>
+
+#include "server/request.h"
+#include "server/scan.h"
+
+namespace MyServer {
+
+namespace {
+
+std::string_view trim(std::string_view value) {
+  size_t l = 0;
+  while (l < value.size() && std::isspace(static_cast<unsigned char>(value[l]))) ++l;
+  size_t r = value.size();
+  while (r > l && std::isspace(static_cast<unsigned char>(value[r - 1]))) --r;
+  return value.substr(l, r - l);
+}
+
+bool same(std::string_view a, std::string_view b) {
+  return a == b;
+}
+
+char lower(char c) {
+  return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+}
+
+}
+
+bool equalsIgnoringCase(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) return false;
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (lower(a[i]) != lower(b[i])) return false;
+  }
+  return true;
+}
+
+// every name has a different length, so that's all we need to pick which one to compare against
+std::optional<KnownHeader> knownHeader(std::string_view name) {
+  auto is = [&](std::string_view known, KnownHeader header) -> std::optional<KnownHeader> {
+    if (equalsIgnoringCase(name, known)) return header;
+    return {};
+  };
+  switch (name.size()) {
+    case 4: return is("host", KnownHeader::HOST);
+    case 6: return is("expect", KnownHeader::EXPECT);
+    case 10: return is("connection", KnownHeader::CONNECTION);
+    case 12: return is("content-type", KnownHeader::CONTENT_TYPE);
+    case 14: return is("content-length", KnownHeader::CONTENT_LENGTH);
+    case 17: return is("transfer-encoding", KnownHeader::TRANSFER_ENCODING);
+    default: return {};
+  }
+}
+
+// key=value&key=value - a key without an = gets an empty value
+const RequestView::QueryFields& RequestView::queries() const {
+  if (parsedQuery) return *parsedQuery;
+  parsedQuery.emplace();
+  std::string_view rest = rawQuery;
+  while (!rest.empty()) {
+    size_t end = HTTP::findFirstOf(rest, "&");
+    std::string_view pair = rest.substr(0, end);
+    rest = end == std::string_view::npos ? std::string_view{} : rest.substr(end + 1);
+    if (pair.empty()) continue;
+
+    size_t equals = pair.find('=');
+    if (equals == std::string_view::npos) parsedQuery->add(pair, {});
+    else parsedQuery->add(pair.substr(0, equals), pair.substr(equals + 1));
+  }
+  return *parsedQuery;
+}
+
+// the parser has already checked that every line ends in \r\n, so we only need to split them up again
+const RequestView::HeaderFields& RequestView::headers() const {
+  if (parsedHeaders) return *parsedHeaders;
+  parsedHeaders.emplace();
+  std::string_view rest = rawHeaders;
+  while (!rest.empty()) {
+    size_t end = HTTP::findFirstOf(rest, "\r");
+    std::string_view line = rest.substr(0, end);
+    rest = end == std::string_view::npos ? std::string_view{} : rest.substr(std::min(end + 2, rest.size()));
+
+    size_t colon = line.find(':');
+    if (colon == std::string_view::npos || knownHeader(line.substr(0, colon))) continue;
+    //HTTP standard requires we remove trailing whitespace from header values
+    parsedHeaders->add(line.substr(0, colon), trim(line.substr(colon + 1)));
+  }
+  return *parsedHeaders;
+}
+
+std::optional<std::string_view> RequestView::query(std::string_view key) const {
+  return queries().find(key, same);
+}
+
+std::optional<std::string_view> RequestView::param(std::string_view name) const {
+  return pathParams.find(name, same);
+}
+
+std::optional<std::string_view> RequestView::header(std::string_view name) const {
+  if (std::optional<KnownHeader> known = knownHeader(name)) return header(*known);
+  return headers().find(name, equalsIgnoringCase);
+}
+
+// ?b=2&a=1 and ?a=1&b=2 are the same request, so they get the same key - but ?id=1&id=2 and ?id=2&id=1 may not be,
+// so repeats of a name keep the order they came in
+std::string_view requestKey(std::string_view endpoint, std::string_view rawQuery) {
+  thread_local std::string key;
+  thread_local std::vector<std::string_view> parameters;
+  parameters.clear();
+  while (!rawQuery.empty()) {
+    size_t end = rawQuery.find('&');
+    std::string_view parameter = rawQuery.substr(0, end);
+    rawQuery = end == std::string_view::npos ? std::string_view{} : rawQuery.substr(end + 1);
+    if (!parameter.empty()) parameters.push_back(parameter);
+  }
+  std::stable_sort(parameters.begin(), parameters.end(), [](std::string_view a, std::string_view b) {
+    return a.substr(0, a.find('=')) < b.substr(0, b.find('='));
+  });
+
+  key.assign(endpoint).push_back('?');
+  for (size_t i = 0; i < parameters.size(); ++i) {
+    if (i > 0) key.push_back('&');
+    key.append(parameters[i]);
+  }
+  return key;
+}
+
+// the header is a comma separated list of options, of which close is the only one we care about
+bool RequestView::closesConnection() const {
+  std::optional<std::string_view> connection = header(KnownHeader::CONNECTION);
+  if (!connection) return false;
+  std::string_view rest = *connection;
+  while (!rest.empty()) {
+    size_t comma = rest.find(',');
+    if (equalsIgnoringCase(trim(rest.substr(0, comma)), "close")) return true;
+    if (comma == std::string_view::npos) break;
+    rest.remove_prefix(comma + 1);
+  }
+  return false;
+}
+
+}
@@ -0,0 +1,156 @@
+#include <cctype>
+#include <format>
+
+#include "server/responseCache.h"
+
+namespace MyServer {
+
+namespace {
+
+std::string_view trim(std::string_view value) {
+  while (!value.empty() && std::isspace(static_cast<unsigned char>(value.front()))) value.remove_prefix(1);
+  while (!value.empty() && std::isspace(static_cast<unsigned char>(value.back()))) value.remove_suffix(1);
+  return value;
+}
+
+// a weak comparison, so W/ on either side doesn't matter
+std::string_view opaque(std::string_view tag) {
+  if (tag.starts_with("W/")) tag.remove_prefix(2);
+  return tag;
+}
+
+}
+
+ResponseCache::ResponseCache(size_t maxBytes): maxShardBytes{maxBytes / shardCount} {}
+
+ResponseCache::Shard& ResponseCache::shardFor(std::string_view key) {
+  return shards[KeyHash{}(key) % shardCount];
+}
+
+void ResponseCache::erase(Shard& shard, std::list<Entry>::iterator entry) {
+  shard.bytes -= entry->bytes;
+  stats.bytes -= entry->bytes;
+  shard.index.erase(entry->key);
+  shard.entries.erase(entry);
+}
+
+std::optional<Response> ResponseCache::lookup(const Request& request) {
+  //before taking the lock, as the first header lookup splits up the lot
+  std::optional<std::string_view> ifNoneMatch = request.header("If-None-Match");
+  std::string_view key = requestKey(request.endpoint, request.rawQuery);
+  Shard& shard = shardFor(key);
+  std::lock_guard held {shard.lock};
+
+  auto found = shard.index.find(key);
+  if (found == shard.index.end()) {
+    ++stats.misses;
+    return {};
+  }
+  auto entry = found->second;
+  if (Clock::now() >= entry->expires) {
+    erase(shard, entry);
+    ++stats.expirations;
+    ++stats.misses;
+    return {};
+  }
+  shard.entries.splice(shard.entries.begin(), shard.entries, entry);
+  ++stats.hits;
+  if (ifNoneMatch && matches(*ifNoneMatch, entry->etag)) {
+    ++stats.notModified;
+    return Response { .canned = entry->notModified };
+  }
+  return Response { .canned = entry->full };
+}
+
+Response ResponseCache::store(
+  const Request& request, std::chrono::milliseconds ttl, Response&& response, unsigned long generation
+) {
+  if (response.statusCode != Response::StatusCode::OK || response.stream || response.canned) return std::move(response);
+
+  std::string etag = etagFor(response.body);
+  std::string validator = std::format("ETag: {}\r\n", etag);
+  Entry entry {
+    .key = std::string{requestKey(request.endpoint, request.rawQuery)},
+    .full = CannedResponse {response, validator},
+    .notModified = CannedResponse {Response { .statusCode = Response::StatusCode::NOT_MODIFIED }, validator},
+    .etag = std::move(etag),
+    .expires = Clock::now() + ttl,
+    .bytes = 0
+  };
+  //roughly: the bytes we keep, the key twice (the index has a view of it), and the bookkeeping around them
+  entry.bytes = entry.full.size() + entry.notModified.size() + entry.etag.size() + 2 * entry.key.size()
+    + sizeof(Entry) + 64;
+
+  Response reply { .canned = entry.full };
+  if (maxShardBytes > 0 && entry.bytes > maxShardBytes) return reply;
+
+  Shard& shard = shardFor(entry.key);
+  {
+    std::lock_guard held {shard.lock};
+    //someone invalidated while the handler ran, so this may be older than what they changed
+    if (generations.load() != generation) return reply;
+    if (auto found = shard.index.find(entry.key); found != shard.index.end()) erase(shard, found->second);
+    shard.bytes += entry.bytes;
+    stats.bytes += entry.bytes;
+    shard.entries.push_front(std::move(entry));
+    shard.index.emplace(shard.entries.front().key, shard.entries.begin());
+    while (maxShardBytes > 0 && shard.bytes > maxShardBytes) {
+      erase(shard, std::prev(shard.entries.end()));
+      ++stats.evictions;
+    }
+  }
+  ++stats.stores;
+  return reply;
+}
+
+// goes through every entry, but invalidating a whole endpoint should be rare next to looking things up
+void ResponseCache::invalidate(std::string_view endpoint) {
+  ++generations;
+  for (Shard& shard: shards) {
+    std::lock_guard held {shard.lock};
+    for (auto entry = shard.entries.begin(); entry != shard.entries.end();) {
+      auto next = std::next(entry);
+      std::string_view key = entry->key;
+      if (key.starts_with(endpoint) && key.size() > endpoint.size() && key[endpoint.size()] == '?') {
+        erase(shard, entry);
+        ++stats.invalidations;
+      }
+      entry = next;
+    }
+  }
+}
+
+void ResponseCache::invalidate(std::string_view endpoint, std::string_view query) {
+  ++generations;
+  std::string_view key = requestKey(endpoint, query);
+  Shard& shard = shardFor(key);
+  std::lock_guard held {shard.lock};
+  auto found = shard.index.find(key);
+  if (found == shard.index.end()) return;
+  erase(shard, found->second);
+  ++stats.invalidations;
+}
+
+// FNV-1a: it only has to change when the body does
+std::string ResponseCache::etagFor(std::string_view body) {
+  uint64_t hash = 14695981039346656037ull;
+  for (char c: body) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ull;
+  }
+  return std::format("\"{:016x}\"", hash);
+}
+
+bool ResponseCache::matches(std::string_view ifNoneMatch, std::string_view etag) {
+  ifNoneMatch = trim(ifNoneMatch);
+  if (ifNoneMatch == "*") return true;
+  while (!ifNoneMatch.empty()) {
+    size_t comma = ifNoneMatch.find(',');
+    if (opaque(trim(ifNoneMatch.substr(0, comma))) == opaque(etag)) return true;
+    if (comma == std::string_view::npos) break;
+    ifNoneMatch.remove_prefix(comma + 1);
+  }
+  return false;
+}
+
+}
@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <deque>
+
+#include "server/router.h"
+#include "utils/logger.h"
+
+namespace MyServer {
+
+namespace {
+
+void invalid(std::string_view pattern, std::string_view why) {
+  Logger::log<Logger::LogLevel::ERROR>(std::string{"Can't route "} + std::string{pattern} + ": " + std::string{why});
+}
+
+}
+
+// "/todo/{id}/tags/{tag...}" is "/todo/", id, "/tags/", then the tail tag
+std::optional<std::vector<Router::Piece>> Router::parse(std::string_view pattern) {
+  static constexpr std::string_view ellipsis = "...";
+  if (!pattern.starts_with('/')) {
+    invalid(pattern, "it has to start with a /");
+    return {};
+  }
+  std::vector<Piece> pieces;
+  std::string_view rest = pattern;
+  while (!rest.empty()) {
+    size_t open = rest.find('{');
+    if (open > 0) pieces.push_back({ Piece::Kind::TEXT, rest.substr(0, open) });
+    if (open == std::string_view::npos) break;
+
+    size_t close = rest.find('}', open);
+    if (close == std::string_view::npos) {
+      invalid(pattern, "a { is never closed");
+      return {};
+    }
+    //a capture is always a whole segment
+    if (open == 0 || rest[open - 1] != '/') {
+      invalid(pattern, "a {name} has to start a segment");
+      return {};
+    }
+    std::string_view name = rest.substr(open + 1, close - open - 1);
+    rest.remove_prefix(close + 1);
+    bool tail = name.ends_with(ellipsis);
+    if (tail) name.remove_suffix(ellipsis.size());
+    if (name.empty() || name.find_first_of("{/") != std::string_view::npos) {
+      invalid(pattern, "a {name} needs a name, without a { or / in it");
+      return {};
+    }
+    if (tail && !rest.empty()) {
+      invalid(pattern, "a {name...} has to come last");
+      return {};
+    }
+    if (!rest.empty() && rest.front() != '/') {
+      invalid(pattern, "a {name} has to end a segment");
+      return {};
+    }
+    pieces.push_back({ tail ? Piece::Kind::TAIL : Piece::Kind::CAPTURE, name });
+  }
+  return pieces;
+}
+
+// the usual radix trie insertion: follow the child that shares our first byte for as long as the text agrees, and
+// split it where it stops agreeing
+Router::Building* Router::insertText(Building* node, std::string_view text) {
+  while (!text.empty()) {
+    auto child = std::find_if(node->children.begin(), node->children.end(), [&](const auto& child) {
+      return child->text.front() == text.front();
+    });
+    if (child == node->children.end()) {
+      node->children.push_back(std::make_unique<Building>(Building { .text = std::string{text} }));
+      return node->children.back().get();
+    }
+    std::string_view existing = (*child)->text;
+    size_t common = std::mismatch(existing.begin(), existing.end(), text.begin(), text.end()).first - existing.begin();
+    if (common < existing.size()) {
+      auto split = std::make_unique<Building>(Building { .text = std::string{existing.substr(0, common)} });
+      (*child)->text.erase(0, common);
+      split->children.push_back(std::move(*child));
+      *child = std::move(split);
+    }
+    node = child->get();
+    text.remove_prefix(common);
+  }
+  return node;
+}
+
+// a failure part way through may leave a node split, which matches exactly what it did before
+bool Router::insert(const std::vector<Piece>& pieces, uint32_t route, std::string_view pattern) {
+  Building* node = &root;
+  for (const Piece& piece: pieces) {
+    switch (piece.kind) {
+      case Piece::Kind::TEXT:
+        node = insertText(node, piece.value);
+        break;
+      case Piece::Kind::CAPTURE:
+        if (!node->capture) node->capture = std::make_unique<Building>(Building { .text = std::string{piece.value} });
+        else if (node->capture->text != piece.value) {
+          invalid(pattern, "another route captures the same segment as {" + node->capture->text + "}");
+          return false;
+        }
+        node = node->capture.get();
+        break;
+      case Piece::Kind::TAIL:
+        if (node->tail != none) {
+          invalid(pattern, "another route already has a {name...} here");
+          return false;
+        }
+        node->tail = route;
+        node->tailName = piece.value;
+        return true;
+    }
+  }
+  if (node->route != none) {
+    invalid(pattern, "another route matches exactly the same paths");
+    return false;
+  }
+  node->route = route;
+  return true;
+}
+
+void Router::flatten() {
+  nodes.assign(1, Node {});
+  firstBytes.assign(1, '\0');
+  text.clear();
+  std::deque<std::pair<const Building*, uint32_t>> pending {{&root, 0}};
+  std::vector<const Building*> children;
+  while (!pending.empty()) {
+    auto [building, at] = pending.front();
+    pending.pop_front();
+
+    Node node {
+      .text = static_cast<uint32_t>(text.size()),
+      .textLength = static_cast<uint32_t>(building->text.size()),
+      .route = building->route,
+      .tail = building->tail
+    };
+    text.append(building->text);
+    if (building->tail != none) {
+      node.tailName = text.size();
+      node.tailNameLength = building->tailName.size();
+      text.append(building->tailName);
+    }
+
+    children.clear();
+    for (const auto& child: building->children) children.push_back(child.get());
+    std::sort(children.begin(), children.end(), [](const Building* a, const Building* b) {
+      return a->text.front() < b->text.front();
+    });
+    node.firstChild = nodes.size();
+    node.children = children.size();
+    for (const Building* child: children) {
+      pending.emplace_back(child, nodes.size());
+      nodes.emplace_back();
+      firstBytes.push_back(child->text.front());
+    }
+    if (building->capture) {
+      node.capture = nodes.size();
+      pending.emplace_back(building->capture.get(), nodes.size());
+      nodes.emplace_back();
+      firstBytes.push_back('\0');
+    }
+    nodes[at] = node;
+  }
+}
+
+Route* Router::find(const std::string& pattern) {
+  auto known = byPattern.find(pattern);
+  return known == byPattern.end() ? nullptr : routes[known->second].get();
+}
+
+const Route* Router::match(std::string_view endpoint, Captures& captures) const {
+  if (auto found = literal.find(endpoint); found != literal.end()) return routes[found->second].get();
+  if (captured == 0) return nullptr;
+  return match(0, endpoint, captures);
+}
+
+// the same, without making captures unless we need them - that costs about as much as a literal match
+const Route* Router::match(std::string_view endpoint) const {
+  if (auto found = literal.find(endpoint); found != literal.end()) return routes[found->second].get();
+  if (captured == 0) return nullptr;
+  Captures unused;
+  return match(0, endpoint, unused);
+}
+
+uint32_t Router::staticChild(const Node& node, std::string_view rest) const {
+  if (rest.empty()) return none;
+  //no two children start with the same byte, so there's only ever one to try
+  const char* first = firstBytes.data() + node.firstChild;
+  for (uint32_t i = 0; i < node.children; ++i) {
+    if (first[i] != rest.front()) continue;
+    const Node& child = nodes[node.firstChild + i];
+    if (rest.size() < child.textLength) return none;
+    //labels are a few bytes, which isn't worth a call to memcmp - and we know the first one matches
+    const char* label = text.data() + child.text;
+    for (uint32_t j = 1; j < child.textLength; ++j) {
+      if (label[j] != rest[j]) return none;
+    }
+    return node.firstChild + i;
+  }
+  return none;
+}
+
+// whatever's left of the endpoint once we're at the node - its own text (or segment, for a {name}) is already matched
+const Route* Router::match(uint32_t at, std::string_view rest, Captures& captures) const {
+  //down through literal text for as long as there's nothing to fall back on, without recursing
+  while (nodes[at].capture == none && nodes[at].tail == none) {
+    const Node& node = nodes[at];
+    if (rest.empty() && node.route != none) return routes[node.route].get();
+    uint32_t next = staticChild(node, rest);
+    if (next == none) return nullptr;
+    rest.remove_prefix(nodes[next].textLength);
+    at = next;
+  }
+
+  const Node& node = nodes[at];
+  if (rest.empty() && node.route != none) return routes[node.route].get();
+  if (uint32_t next = staticChild(node, rest); next != none) {
+    if (const Route* found = match(next, rest.substr(nodes[next].textLength), captures)) return found;
+  }
+
+  if (node.capture != none) {
+    std::string_view segment = rest.substr(0, rest.find('/'));
+    if (!segment.empty()) {
+      size_t before = captures.size();
+      const Node& capture = nodes[node.capture];
+      captures.add(textOf(capture.text, capture.textLength), segment);
+      if (const Route* found = match(node.capture, rest.substr(segment.size()), captures)) return found;
+      captures.truncate(before);
+    }
+  }
+
+  if (node.tail != none) {
+    captures.add(textOf(node.tailName, node.tailNameLength), rest);
+    return routes[node.tail].get();
+  }
+  return nullptr;
+}
+
+}
@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MYSERVER_X86_SIMD
+#endif
+
+#include "server/scan.h"
+
+namespace MyServer::HTTP {
+
+namespace {
+
+size_t findScalar(std::string_view input, std::string_view delimiters) {
+  return input.find_first_of(delimiters);
+}
+
+#ifdef MYSERVER_X86_SIMD
+
+// The SIMD versions never load past the end of the input if that could cross into the next page (which might not be
+// mapped) - a short input that sits right at the end of a page goes through the scalar version instead
+bool blockFits(const char* at, size_t width) {
+  constexpr uintptr_t pageSize = 4096;
+  return (reinterpret_cast<uintptr_t>(at) & (pageSize - 1)) <= pageSize - width;
+}
+
+__attribute__((target("sse4.2")))
+size_t findSSE42(std::string_view input, std::string_view delimiters) {
+  alignas(16) std::array<char, 16> padded {};
+  int setSize = static_cast<int>(std::min<size_t>(delimiters.size(), 16));
+  std::copy_n(delimiters.begin(), setSize, padded.begin());
+  __m128i set = _mm_load_si128(reinterpret_cast<const __m128i*>(padded.data()));
+
+  //cmpestri takes the length of the block, so bytes past the end of the input are never matched
+  auto scan = [&](size_t at, int length) __attribute__((target("sse4.2"))) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input.data() + at));
+    return _mm_cmpestri(set, setSize, block, length, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+  };
+
+  size_t head = 0;
+  for (; head + 16 <= input.size(); head += 16) {
+    if (int found = scan(head, 16); found < 16) return head + found;
+  }
+  if (head == input.size()) return std::string_view::npos;
+  if (head > 0) head = input.size() - 16; //rescan the last 16 bytes - what we've already seen had nothing in it
+  else if (!blockFits(input.data(), 16)) return findScalar(input, delimiters);
+  int length = static_cast<int>(input.size() - head);
+  if (int found = scan(head, length); found < length) return head + found;
+  return std::string_view::npos;
+}
+
+__attribute__((target("avx2,bmi")))
+size_t scanAVX2(std::string_view input, std::string_view delimiters) {
+  //the parser only ever looks for one or two delimiters, so comparing against each of them beats cmpestri's latency -
+  //repeating the last delimiter to fill out a fixed four keeps the loop free of branches on the count
+  if (delimiters.empty() || delimiters.size() > 4) return findSSE42(input, delimiters);
+  size_t last = delimiters.size() - 1;
+  __m256i first = _mm256_set1_epi8(delimiters[0]);
+  __m256i second = _mm256_set1_epi8(delimiters[std::min<size_t>(1, last)]);
+  __m256i third = _mm256_set1_epi8(delimiters[std::min<size_t>(2, last)]);
+  __m256i fourth = _mm256_set1_epi8(delimiters[last]);
+
+  auto scan = [&](size_t at) __attribute__((target("avx2,bmi"))) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input.data() + at));
+    __m256i matches = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(block, first), _mm256_cmpeq_epi8(block, second)),
+      _mm256_or_si256(_mm256_cmpeq_epi8(block, third), _mm256_cmpeq_epi8(block, fourth))
+    );
+    return static_cast<unsigned>(_mm256_movemask_epi8(matches));
+  };
+
+  if (input.size() < 32) {
+    if (input.empty()) return std::string_view::npos;
+    if (!blockFits(input.data(), 32)) return findSSE42(input, delimiters);
+    unsigned mask = scan(0) & ((1u << input.size()) - 1);
+    return mask != 0 ? _tzcnt_u32(mask) : std::string_view::npos;
+  }
+  for (size_t head = 0; head + 32 <= input.size(); head += 32) {
+    if (unsigned mask = scan(head)) return head + _tzcnt_u32(mask);
+  }
+  //as above, the last partial block is rescanned as the 32 bytes ending at the end of the input
+  size_t tail = input.size() - 32;
+  if (unsigned mask = scan(tail)) return tail + _tzcnt_u32(mask);
+  return std::string_view::npos;
+}
+
+//the compiler doesn't always clear the upper halves of the ymm registers on the way out (at -O1 it doesn't at all),
+//and the rest of the server's SSE code pays for every transition if we leave them dirty
+__attribute__((target("avx2,bmi")))
+size_t findAVX2(std::string_view input, std::string_view delimiters) {
+  size_t found = scanAVX2(input, delimiters);
+  _mm256_zeroupper();
+  return found;
+}
+
+#endif
+
+using Finder = size_t (*)(std::string_view, std::string_view);
+
+constexpr std::array<Finder, 3> finders {
+#ifdef MYSERVER_X86_SIMD
+  findScalar, findSSE42, findAVX2
+#else
+  findScalar, findScalar, findScalar
+#endif
+};
+
+ScanLevel detect() {
+#ifdef MYSERVER_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi")) return ScanLevel::AVX2;
+  if (__builtin_cpu_supports("sse4.2")) return ScanLevel::SSE42;
+#endif
+  return ScanLevel::SCALAR;
+}
+
+std::atomic<Finder>& finder() {
+  static std::atomic<Finder> chosen { finders[static_cast<size_t>(bestScanLevel())] };
+  return chosen;
+}
+
+}
+
+size_t findFirstOf(std::string_view input, std::string_view delimiters) {
+  return finder().load(std::memory_order_relaxed)(input, delimiters);
+}
+
+ScanLevel bestScanLevel() {
+  static const ScanLevel best = detect();
+  return best;
+}
+
+ScanLevel scanLevel() {
+  Finder current = finder().load(std::memory_order_relaxed);
+  for (ScanLevel level: {ScanLevel::SCALAR, ScanLevel::SSE42, ScanLevel::AVX2}) {
+    if (finders[static_cast<size_t>(level)] == current) return level;
+  }
+  return ScanLevel::SCALAR;
+}
+
+bool useScanLevel(ScanLevel level) {
+  if (level > bestScanLevel()) return false;
+  finder().store(finders[static_cast<size_t>(level)], std::memory_order_relaxed);
+  return true;
+}
+
+std::string_view scanLevelName(ScanLevel level) {
+  switch (level) {
+    case ScanLevel::AVX2: return "avx2";
+    case ScanLevel::SSE42: return "sse4.2";
+    default: return "scalar";
+  }
+}
+
+}
@@ -0,0 +1,195 @@
+#include <array>
+#include <charconv>
+#include <ctime>
+#include <map>
+#include <mutex>
+
+#include "server/serialize.h"
+
+namespace MyServer::HTTP {
+
+namespace {
+
+// room for a size_t in decimal, or in hex
+constexpr size_t maxDigits = 20;
+
+std::string_view digits(size_t value, int base, std::array<char, maxDigits>& into) {
+  auto [end, _] = std::to_chars(into.data(), into.data() + into.size(), value, base);
+  return { into.data(), static_cast<size_t>(end - into.data()) };
+}
+
+// a 304 has no body, nor anything saying how long it is
+bool hasBody(Response::StatusCode status) {
+  return status != Response::StatusCode::NOT_MODIFIED;
+}
+
+// Content-Type and the framing of a whole body, which are the same whether or not there's a Date before them
+void appendFraming(const Response& response, std::string& into) {
+  static constexpr std::string_view contentLength = "Content-Length: ";
+  std::array<char, maxDigits> number;
+  if (!hasBody(response.statusCode)) {
+    into.append("\r\n");
+    return;
+  }
+  into.append(contentTypeHeader(response.contentType));
+  into.append(contentLength).append(digits(response.body.size(), 10, number)).append("\r\n\r\n");
+}
+
+using enum Response::StatusCode;
+constexpr std::array knownStatuses {
+  OK, NOT_MODIFIED, BAD_REQUEST, NOT_FOUND, PAYLOAD_TOO_LARGE, IM_A_TEAPOT, UNPROCESSABLE_ENTITY, REQUEST_HEADER_FIELDS_TOO_LARGE,
+  INTERNAL_SERVER_ERROR, NOT_IMPLEMENTED, SERVICE_UNAVAILABLE, GATEWAY_TIMEOUT
+};
+
+using CannedTable = std::array<CannedResponse, knownStatuses.size()>;
+
+CannedResponse makeCanned(Response::StatusCode status, std::string_view extraHeaders) {
+  return CannedResponse { Response { .statusCode = status, .contentType = Response::ContentType::PLAINTEXT }, extraHeaders };
+}
+
+CannedTable makeTable(std::string_view extraHeaders) {
+  CannedTable table;
+  for (size_t i = 0; i < knownStatuses.size(); ++i) table[i] = makeCanned(knownStatuses[i], extraHeaders);
+  return table;
+}
+
+// every known status is made up front, so the usual lookup is a scan of a dozen ints without a lock - a code someone
+// cast in gets made the first time, and kept (the map never moves what it holds)
+const CannedResponse& lookup(const CannedTable& table, Response::StatusCode status, std::string_view extraHeaders) {
+  for (size_t i = 0; i < knownStatuses.size(); ++i) {
+    if (knownStatuses[i] == status) return table[i];
+  }
+  static std::mutex lock;
+  static std::map<std::pair<unsigned, std::string_view>, CannedResponse> others;
+  std::lock_guard held {lock};
+  auto [it, made] = others.try_emplace({std::to_underlying(status), extraHeaders});
+  if (made) it->second = makeCanned(status, extraHeaders);
+  return it->second;
+}
+
+constexpr std::string_view closing = "Connection: close\r\n";
+
+}
+
+std::string_view statusLine(Response::StatusCode status) {
+  using enum Response::StatusCode;
+  switch (status) {
+    case OK: return "HTTP/1.1 200 OK\r\n";
+    case NOT_MODIFIED: return "HTTP/1.1 304 Not Modified\r\n";
+    case BAD_REQUEST: return "HTTP/1.1 400 Bad Request\r\n";
+    case NOT_FOUND: return "HTTP/1.1 404 Not Found\r\n";
+    case PAYLOAD_TOO_LARGE: return "HTTP/1.1 413 Payload Too Large\r\n";
+    case IM_A_TEAPOT: return "HTTP/1.1 418 I'm a teapot\r\n";
+    case UNPROCESSABLE_ENTITY: return "HTTP/1.1 422 Unprocessable Entity\r\n";
+    case REQUEST_HEADER_FIELDS_TOO_LARGE: return "HTTP/1.1 431 Request Header Fields Too Large\r\n";
+    case INTERNAL_SERVER_ERROR: return "HTTP/1.1 500 Internal Server Error\r\n";
+    case NOT_IMPLEMENTED: return "HTTP/1.1 501 Not Implemented\r\n";
+    case SERVICE_UNAVAILABLE: return "HTTP/1.1 503 Service Unavailable\r\n";
+    case GATEWAY_TIMEOUT: return "HTTP/1.1 504 Gateway Timeout\r\n";
+  }
+  //a code someone cast in without adding it above still gets a valid (if reasonless) status line
+  thread_local std::array<char, 32> line {};
+  std::array<char, maxDigits> code;
+  std::string_view number = digits(std::to_underlying(status), 10, code);
+  std::string_view prefix = "HTTP/1.1 ";
+  char* end = std::copy(prefix.begin(), prefix.end(), line.data());
+  end = std::copy(number.begin(), number.end(), end);
+  *end++ = ' '; *end++ = '\r'; *end++ = '\n';
+  return { line.data(), static_cast<size_t>(end - line.data()) };
+}
+
+std::string_view contentTypeHeader(Response::ContentType type) {
+  switch (type) {
+    case Response::ContentType::JSON: return "Content-Type: application/json; charset=US-ASCII\r\n";
+    default: return "Content-Type: text/plain; charset=US-ASCII\r\n";
+  }
+}
+
+std::string_view dateHeader() {
+  thread_local std::array<char, 64> cached {};
+  thread_local size_t length = 0;
+  thread_local std::time_t second = -1;
+  std::time_t now = std::time(nullptr);
+  if (now != second) {
+    second = now;
+    std::tm parts;
+    gmtime_r(&now, &parts);
+    length = std::strftime(cached.data(), cached.size(), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &parts);
+  }
+  return { cached.data(), length };
+}
+
+void writeHead(const Response& response, std::string& into) {
+  static constexpr std::string_view contentLength = "Content-Length: ";
+  static constexpr std::string_view chunked = "Transfer-Encoding: chunked\r\n\r\n";
+  std::string_view status = statusLine(response.statusCode);
+  std::string_view type = contentTypeHeader(response.contentType);
+  std::string_view date = dateHeader();
+
+  into.clear();
+  //whichever way the body is framed, this is enough for it
+  into.reserve(status.size() + type.size() + date.size() + chunked.size() + maxDigits + 4);
+  into.append(status).append(type).append(date);
+  std::array<char, maxDigits> number;
+  if (!hasBody(response.statusCode)) into.append("\r\n");
+  else if (!response.stream) into.append(contentLength).append(digits(response.body.size(), 10, number)).append("\r\n\r\n");
+  else {
+    into.append(chunked);
+    //the first chunk is whatever body the handler gave us up front
+    if (!response.body.empty()) into.append(digits(response.body.size(), 16, number)).append("\r\n");
+  }
+}
+
+void writeHead(const CannedResponse& canned, std::string& into) {
+  into.clear();
+  into.append(canned.statusLine()).append(dateHeader());
+}
+
+void writeChunkHead(size_t size, bool first, std::string& into) {
+  std::array<char, maxDigits> number;
+  into.clear();
+  if (!first) into.append("\r\n");
+  into.append(digits(size, 16, number)).append("\r\n");
+  //the last chunk is followed by the (empty) trailers
+  if (size == 0) into.append("\r\n");
+}
+
+const CannedResponse& cannedStatus(Response::StatusCode status) {
+  static const CannedTable table = makeTable({});
+  return lookup(table, status, {});
+}
+
+const CannedResponse& cannedRefusal(Response::StatusCode status) {
+  static const CannedTable table = makeTable(closing);
+  return lookup(table, status, closing);
+}
+
+}
+
+namespace MyServer {
+
+CannedResponse::CannedResponse(const Response& response, std::string_view extraHeaders) {
+  std::string_view status = HTTP::statusLine(response.statusCode);
+  std::string serialized;
+  serialized.reserve(status.size() + extraHeaders.size() + 128 + response.body.size());
+  serialized.append(status).append(extraHeaders);
+  HTTP::appendFraming(response, serialized);
+  serialized.append(response.body);
+  statusLength = status.size();
+  bytes = std::make_shared<const std::string>(std::move(serialized));
+}
+
+std::string Response::toHTTPResponse() const {
+  std::string out;
+  if (canned) {
+    HTTP::writeHead(canned, out);
+    out.append(canned.rest());
+    return out;
+  }
+  HTTP::writeHead(*this, out);
+  out.append(body);
+  if (stream && !body.empty()) out.append("\r\n");
+  return out;
+}
+
+}
@@ -1,7 +1,9 @@
+#include <algorithm>
 #include <cerrno>
 #include <csignal>
 #include <string>
 #include <cstring>
+#include <format>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -17,29 +19,130 @@ namespace MyServer {
 
 std::vector<Server*> Server::servers {};
 std::atomic<bool> Server::exiting { false };
+
+Server::Server(ServerConfig config): config{config.resolve()}, responseCache{this->config.cacheBytes} {
+  std::optional<cpu_set_t> workerAffinity = ServerConfig::parseAffinity(this->config.workerAffinity);
+  for (int i = 0; i < this->config.maxWorkerThreads; ++i) {
+    workerThreads.emplace_back(workerThreads, workerStats, this->config, workerAffinity);
+  }
+  activeWorkers = this->config.workerThreads;
+  for (int i = 0; i < this->config.dispatchThreads; ++i) dispatchThreads.emplace_back(this, i);
+
+  Logger::log<Logger::LogLevel::INFO>(
+    std::format(
+      "Starting {} dispatch threads and up to {} worker threads (of at most {})",
+      dispatchThreads.size(), activeWorkers.load(), workerThreads.size()
+    )
+  );
+}
+
 void Server::handover(int client) {
   Logger::log<Logger::LogLevel::DEBUG>("Handing over client " + std::to_string(client));
   incomingClientQueue.add(client);
+  //wake the next blocked dispatch thread, if any - the others are awake and will check the queue anyway
+  for (size_t i = 0; i < dispatchThreads.size(); ++i) {
+    if (dispatchThreads[nextWake++ % dispatchThreads.size()].wake()) break;
+  }
 }
 
-void Server::registerHandler(std::string endpoint, Request::Method method, Handler handler) {
-  handlers[std::to_underlying(method)][std::move(endpoint)] = std::move(handler);
+// Workers past the new size are sent no more tasks, and their threads exit once they've drained their queues.
+// Only does atomic operations, so that the signal handler can call it
+int Server::resizeWorkerPool(int workers) {
+  workers = std::clamp(workers, 1, static_cast<int>(workerThreads.size()));
+  activeWorkers.store(workers, std::memory_order_relaxed);
+  return workers;
 }
 
-void Server::go(int port) {
+void Server::registerHandler(std::string endpoint, Request::Method method, Handler handler, ExecutionPolicy policy) {
+  routers[std::to_underlying(method)].add(endpoint, std::move(handler), policy);
+}
+
+void Server::registerHandler(std::string endpoint, Request::Method method, AsyncHandler handler) {
+  routers[std::to_underlying(method)].add(endpoint, std::move(handler));
+}
+
+void Server::setDeadline(const std::string& endpoint, Request::Method method, std::chrono::milliseconds deadline) {
+  Route* route = routers[std::to_underlying(method)].find(endpoint);
+  if (!route) {
+    Logger::log<Logger::LogLevel::ERROR>("Tried to set a deadline for unregistered endpoint " + endpoint);
+    return;
+  }
+  route->deadline = deadline;
+}
+
+void Server::streamBody(const std::string& endpoint, Request::Method method) {
+  Route* route = routers[std::to_underlying(method)].find(endpoint);
+  if (!route) {
+    Logger::log<Logger::LogLevel::ERROR>("Tried to stream the body of unregistered endpoint " + endpoint);
+    return;
+  }
+  if (route->asyncHandler) {
+    Logger::log<Logger::LogLevel::ERROR>("Async handlers can't stream their body, for endpoint " + endpoint);
+    return;
+  }
+  route->streamBody = true;
+  route->policy = ExecutionPolicy::WORKER;
+}
+
+void Server::cache(const std::string& endpoint, std::chrono::milliseconds ttl) {
+  Route* route = routers[std::to_underlying(Request::Method::GET)].find(endpoint);
+  if (!route) {
+    Logger::log<Logger::LogLevel::ERROR>("Tried to cache unregistered endpoint " + endpoint);
+    return;
+  }
+  route->cache = &responseCache;
+  route->cacheTTL = ttl;
+}
+
+void Server::coalesce(const std::string& endpoint) {
+  Route* route = routers[std::to_underlying(Request::Method::GET)].find(endpoint);
+  if (!route) {
+    Logger::log<Logger::LogLevel::ERROR>("Tried to coalesce unregistered endpoint " + endpoint);
+    return;
+  }
+  if (route->asyncHandler) {
+    Logger::log<Logger::LogLevel::ERROR>("Async handlers can't be coalesced, for endpoint " + endpoint);
+    return;
+  }
+  route->coalescer = &coalescer;
+}
+
+void Server::invalidate(std::string_view endpoint) {
+  responseCache.invalidate(endpoint);
+}
+
+void Server::invalidate(std::string_view endpoint, std::string_view query) {
+  responseCache.invalidate(endpoint, query);
+}
+
+// flags are passed on to socket(), e.g. SOCK_NONBLOCK for the listeners living in a dispatch epoll
+int Server::makeListener(int port, int flags) {
   struct sockaddr_in address;
   int opt = 1;
-  int addrlen = sizeof(address);
 
   address.sin_family = AF_INET;
   address.sin_addr.s_addr = INADDR_ANY;
   address.sin_port = htons(port);
-  sockaddr* const addressbp = reinterpret_cast<sockaddr*>(&address);
 
-  serverfd = insist(socket(AF_INET, SOCK_STREAM, 0), "Couldn't make server socket");
-  insist(setsockopt(serverfd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)), "Couldn't set the socket as reusable");
-  insist(bind(serverfd, addressbp, sizeof(address)), "Couldn't bind to server socket");
-  insist(listen(serverfd, 128), "Couldn't listen to server file descriptor");
+  int listener = insist(socket(AF_INET, SOCK_STREAM | flags, 0), "Couldn't make server socket");
+  insist(setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)), "Couldn't set the socket as reusable");
+  insist(setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)), "Couldn't set the socket port as reusable");
+  insist(bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)), "Couldn't bind to server socket");
+  insist(listen(listener, SOMAXCONN), "Couldn't listen to server file descriptor");
+  return listener;
+}
+
+void Server::go(int port) {
+  if (config.acceptMode == ServerConfig::AcceptMode::HANDOVER) {
+    serverfd = makeListener(port, 0);
+  }
+  else for (Dispatch& dispatch: dispatchThreads) {
+    dispatch.listen(port);
+  }
+
+  if (config.prespawnWorkers) {
+    for (int i = 0; i < config.minWorkerThreads; ++i) workerThreads[i].start();
+  }
 
   servers.push_back(this);
 
@@ -48,11 +151,27 @@ void Server::go(int port) {
   sa.sa_flags = 0;
   sa.sa_handler = sigint;
   insist(sigaction(SIGINT, &sa, NULL), "Couldn't registed SIGINT handler");
+  insist(sigaction(SIGTERM, &sa, NULL), "Couldn't register SIGTERM handler");
+  sa.sa_handler = resizeSignal;
+  insist(sigaction(SIGUSR1, &sa, NULL), "Couldn't register SIGUSR1 handler");
+  insist(sigaction(SIGUSR2, &sa, NULL), "Couldn't register SIGUSR2 handler");
+  //a client hanging up mid-writev should be an EPIPE for that client, not the end of the server
+  sa.sa_handler = SIG_IGN;
+  insist(sigaction(SIGPIPE, &sa, NULL), "Couldn't ignore SIGPIPE");
 
   Logger::log<Logger::LogLevel::INFO>("Server listening on port " + std::to_string(port));
+  if (config.acceptMode == ServerConfig::AcceptMode::HANDOVER) acceptLoop();
+  else waitForExit();
+
+  Logger::log<Logger::LogLevel::INFO>("Exiting server");
+  shutdown();
+}
+
+void Server::acceptLoop() {
   int client;
   while (!exiting) {
-    client = accept(serverfd, addressbp, reinterpret_cast<socklen_t*>(&addrlen));
+    // clients are made nonblocking here, so the dispatch threads don't need to fcntl them
+    client = accept4(serverfd, nullptr, nullptr, SOCK_NONBLOCK);
     if (client < 0) {
       if (exiting) {
         Logger::log<Logger::LogLevel::DEBUG>("Server accept interrupted by exit");
@@ -62,6 +181,8 @@ void Server::go(int port) {
         Logger::log<Logger::LogLevel::ERROR>("Client aborted connection during except");
         continue;
       }
+      //SIGUSR1/SIGUSR2 resizing the worker pool
+      else if (errno == EINTR) continue;
       else {
         Logger::log<Logger::LogLevel::ERROR>("Received unhandled error during accept");
         return;
@@ -69,8 +190,27 @@ void Server::go(int port) {
     }
     handover(client);
   }
-  Logger::log<Logger::LogLevel::INFO>("Exiting server");
-  shutdown();
+}
+
+// in REUSEPORT mode the dispatch threads do all of the accepting, so the main thread just sleeps until SIGINT/SIGTERM
+void Server::waitForExit() {
+  sigset_t signals = exitSignals(), oldMask;
+  //block them between checking the flag and sleeping, so we can't miss one
+  sigprocmask(SIG_BLOCK, &signals, &oldMask);
+  //and let them in while we sleep, even if whoever called us had them blocked
+  sigset_t sleeping = oldMask;
+  sigdelset(&sleeping, SIGINT);
+  sigdelset(&sleeping, SIGTERM);
+  while (!exiting) sigsuspend(&sleeping);
+  sigprocmask(SIG_SETMASK, &oldMask, nullptr);
+}
+
+sigset_t Server::exitSignals() {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  return signals;
 }
 
 // Interestingly, we don't need to bother with SA_RESTART, the default (non-restarting) behaviour is what we wanted anyway.
@@ -82,7 +222,7 @@ void Server::go(int port) {
 // Our other syscalls are not interruptible, or at least, man -wK EINTR makes me think so
 
 // Anyway, the way shutdown works is:
-// - First, we request stop frop the dispatch threads. We wake up any blocked dispatch threads by writing as many -1s to the client queue
+// - First, we request stop frop the dispatch threads. We write as many -1s to the client queue, and wake any blocked dispatch threads through their eventfds
 // - Then we wait for them to set a flag that acknowleding that they are closing
 //    - The point being that from now on they will spin up no more worker threads
 // - Then we go through the worker threads and request stop
@@ -94,8 +234,9 @@ void Server::shutdown() {
   Logger::log<Logger::LogLevel::INFO>("Requesting stop from dispatchers");
   for (Dispatch& dispatch: dispatchThreads) dispatch.requestStop();
 
-  std::vector dummyClients(numDispatchThreads, -1);
+  std::vector dummyClients(dispatchThreads.size(), -1);
   incomingClientQueue.swap(dummyClients);
+  for (Dispatch& dispatch: dispatchThreads) dispatch.wake();
 
   Logger::log<Logger::LogLevel::INFO>("Waiting for dispatch shutdown acknowledgement");
   for (Dispatch& dispatch: dispatchThreads) dispatch.acknowledgeShutdown();
@@ -116,9 +257,18 @@ void Server::sigint(int) {
   }
   exiting = true;
   for (Server* server: servers) {
+    if (server->serverfd < 0) continue;
     ::shutdown(server->serverfd, SHUT_RDWR);
     close(server->serverfd);
   }
 }
 
+// SIGUSR1 grows the worker pool by one, SIGUSR2 shrinks it
+void Server::resizeSignal(int signal) {
+  int change = signal == SIGUSR1 ? 1 : -1;
+  for (Server* server: servers) {
+    server->resizeWorkerPool(server->activeWorkers.load(std::memory_order_relaxed) + change);
+  }
+}
+
 }
@@ -0,0 +1,216 @@
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "server/uring.h"
+#include "utils/logger.h"
+
+namespace MyServer {
+
+Uring::Uring(unsigned entries, unsigned buffers, unsigned bufferSize): bufferCount{buffers}, bufferSize{bufferSize} {
+  //multishot receives can produce a lot of completions per submission
+  io_uring_params params { .cq_entries = entries * 4, .flags = IORING_SETUP_CQSIZE };
+  ringfd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ringfd < 0) {
+    Logger::log<Logger::LogLevel::ERROR>("Couldn't set up io_uring");
+    return;
+  }
+  if (!(params.features & IORING_FEAT_EXT_ARG)) {
+    Logger::log<Logger::LogLevel::ERROR>("Kernel io_uring is too old to wait with a timeout");
+    close(ringfd);
+    ringfd = -1;
+    return;
+  }
+
+  sqEntries = params.sq_entries;
+  sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+  sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) cqRing = sqRing;
+  else cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+  sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+  sqes = static_cast<io_uring_sqe*>(
+    mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES)
+  );
+  //the dispatch thread falls back to epoll if we aren't ok(), and the destructor unmaps whatever we did get
+  if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+    Logger::log<Logger::LogLevel::ERROR>("Couldn't map the io_uring");
+    close(ringfd);
+    ringfd = -1;
+    return;
+  }
+
+  char* sq = static_cast<char*>(sqRing);
+  sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  localTail = *sqTail;
+
+  char* cq = static_cast<char*>(cqRing);
+  cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+  //the provided buffer ring has to be page aligned, so it gets its own mapping
+  bufferRingSize = bufferCount * sizeof(io_uring_buf);
+  void* ringMemory = mmap(nullptr, bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ringMemory == MAP_FAILED) {
+    Logger::log<Logger::LogLevel::ERROR>("Couldn't map the provided buffer ring");
+    close(ringfd);
+    ringfd = -1;
+    return;
+  }
+  bufferRing = static_cast<io_uring_buf_ring*>(ringMemory);
+  bufferMemory.resize(static_cast<size_t>(bufferCount) * bufferSize);
+
+  io_uring_buf_reg registration {
+    .ring_addr = reinterpret_cast<uint64_t>(bufferRing),
+    .ring_entries = bufferCount,
+    .bgid = bufferGroup
+  };
+  if (syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+    Logger::log<Logger::LogLevel::ERROR>("Couldn't register provided buffers (kernel older than 5.19?)");
+    close(ringfd);
+    ringfd = -1;
+    return;
+  }
+  bufferRing->tail = 0;
+  for (unsigned i = 0; i < bufferCount; ++i) recycleBuffer(i);
+}
+
+bool Uring::ok() const {
+  return ringfd >= 0;
+}
+
+int Uring::enter(unsigned toSubmit, unsigned minComplete, int timeoutMs) {
+  unsigned flags = 0;
+  io_uring_getevents_arg arg {};
+  __kernel_timespec timeout {};
+  if (minComplete > 0) {
+    flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    if (timeoutMs >= 0) {
+      timeout.tv_sec = timeoutMs / 1000;
+      timeout.tv_nsec = (timeoutMs % 1000) * 1'000'000L;
+      arg.ts = reinterpret_cast<uint64_t>(&timeout);
+    }
+  }
+  return syscall(__NR_io_uring_enter, ringfd, toSubmit, minComplete, flags, minComplete > 0 ? &arg : nullptr, sizeof(arg));
+}
+
+io_uring_sqe* Uring::getSqe() {
+  if (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) submitAndWait(0);
+  unsigned index = localTail & *sqMask;
+  io_uring_sqe* sqe = &sqes[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sqArray[index] = index;
+  ++localTail;
+  ++unsubmitted;
+  return sqe;
+}
+
+void Uring::submitAndWait(int timeoutMs) {
+  __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+  bool wait = timeoutMs != 0 && !hasCompletions();
+  //nothing to submit and nothing to wait for, so no need to bother the kernel
+  if (unsubmitted == 0 && !wait) return;
+
+  int submitted = enter(unsubmitted, wait ? 1 : 0, timeoutMs);
+  if (submitted < 0) {
+    if (errno != ETIME && errno != EINTR && errno != EBUSY) {
+      Logger::log<Logger::LogLevel::ERROR>("Couldn't io_uring_enter - may miss completions!");
+    }
+    return;
+  }
+  unsubmitted -= std::min<unsigned>(submitted, unsubmitted);
+}
+
+bool Uring::hasCompletions() const {
+  return *cqHead != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+}
+
+std::span<const char> Uring::buffer(uint16_t bufferId, size_t length) const {
+  return { bufferMemory.data() + static_cast<size_t>(bufferId) * bufferSize, length };
+}
+
+void Uring::recycleBuffer(uint16_t bufferId) {
+  unsigned short tail = bufferRing->tail;
+  //the ring is an array of io_uring_buf, with the tail overlaid on the first one - indexing bufferRing->bufs
+  //doesn't give the right offset from C++, as the header's flexible array member is wrapped in a struct there
+  io_uring_buf& slot = reinterpret_cast<io_uring_buf*>(bufferRing)[tail & (bufferCount - 1)];
+  slot.addr = reinterpret_cast<uint64_t>(bufferMemory.data() + static_cast<size_t>(bufferId) * bufferSize);
+  slot.len = bufferSize;
+  slot.bid = bufferId;
+  __atomic_store_n(&bufferRing->tail, static_cast<unsigned short>(tail + 1), __ATOMIC_RELEASE);
+}
+
+void Uring::prepAccept(int listenfd) {
+  io_uring_sqe* sqe = getSqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listenfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK;
+  sqe->user_data = userData(Op::ACCEPT, listenfd);
+}
+
+void Uring::prepRecv(int fd) {
+  io_uring_sqe* sqe = getSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = bufferGroup;
+  sqe->user_data = userData(Op::RECV, fd);
+}
+
+void Uring::prepSendmsg(int fd, const msghdr* message) {
+  io_uring_sqe* sqe = getSqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(message);
+  sqe->len = 1;
+  //MSG_WAITALL has the kernel retry short sends itself, so we only come up short on a real error
+  sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+  sqe->user_data = userData(Op::SEND, fd);
+}
+
+void Uring::prepRead(int fd, void* into, size_t length, uint64_t data) {
+  io_uring_sqe* sqe = getSqe();
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(into);
+  sqe->len = length;
+  sqe->user_data = data;
+}
+
+void Uring::prepCancel(uint64_t target) {
+  io_uring_sqe* sqe = getSqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = userData(Op::CANCEL, 0);
+}
+
+void Uring::prepPoll(int fd, unsigned events) {
+  io_uring_sqe* sqe = getSqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->user_data = userData(Op::POLL, fd);
+}
+
+Uring::~Uring() {
+  if (ringfd >= 0) close(ringfd);
+  if (sqes && sqes != MAP_FAILED) munmap(sqes, sqesSize);
+  if (cqRing && cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+  if (sqRing && sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+  if (bufferRing) munmap(bufferRing, bufferRingSize);
+}
+
+}
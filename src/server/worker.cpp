@@ -1,82 +1,248 @@
+#include <climits>
+#include <csignal>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "server/coalescer.h"
+#include "server/responseCache.h"
+#include "server/server.h"
 #include "server/worker.h"
 #include "utils/httpException.h"
 
 namespace MyServer {
 
-void Worker::work(std::stop_token token, Task&& task) {
+namespace {
+
+long futex(std::atomic<uint32_t>& word, int op, uint32_t value, const timespec* timeout = nullptr) {
+  return syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), op, value, timeout, nullptr, 0);
+}
+
+}
+
+void Worker::work(std::stop_token token) {
   Logger::log<Logger::LogLevel::DEBUG>("Starting up a worker thread");
+  //for those the main thread started, which has them unblocked
+  sigset_t exitSignals = Server::exitSignals();
+  pthread_sigmask(SIG_BLOCK, &exitSignals, nullptr);
 
   while (!token.stop_requested()) {
-    Response result;
-
-    try {
-      result = task.handler(task.request);
-    }
-    catch (Utils::HTTPException e) {
-      result = {
-        .statusCode = e.statusCode(),
-        .body = e.what()
-      };
-    }
-    catch (std::exception e) {
-      Logger::log<Logger::LogLevel::ERROR>(std::string{"Uncaught exception: "} + e.what());
-      result = {
-        .statusCode = Response::StatusCode::INTERNAL_SERVER_ERROR,
-        .body = "Sorry, something went wrong - we are working extremely hard to find the problem"
-      };
+    if (std::optional<Task> task = findTask()) run(*task);
+    else if (!park(token)) {
+      Logger::log<Logger::LogLevel::DEBUG>("Scaling down the thread pool");
+      --stats.threads;
+      return;
     }
+  }
 
-    bool reactivated = task.destination->addOutgoing(task.sequence, result.toHTTPResponse());
-    if (reactivated) {
-      task.owner->notifyForClient(task.destination->getfd());
-    }
+  Logger::log<Logger::LogLevel::DEBUG>("Exiting a worker thread");
+  --stats.threads;
+  state = DEAD;
+  state.notify_all();
+}
+
+// we only come back once there's (probably) work, or if it's time to stop
+bool Worker::park(std::stop_token token) {
+  //pairs with start(): either we see the task that was just pushed, or the pusher sees that we're parked and wakes us
+  state = PARKED;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!taskQueue.empty() || token.stop_requested()) {
+    uint32_t expected = PARKED;
+    state.compare_exchange_strong(expected, RUNNING);
+    return true;
+  }
 
-    std::lock_guard<std::mutex> lock {queueMutex};
-    if (!(taskQueue.empty() || token.stop_requested())) {
-      task = std::move(taskQueue.front());
-      taskQueue.pop();
+  ++stats.parks;
+  using namespace std::chrono;
+  auto timeout = duration_cast<nanoseconds>(config.workerIdleTimeout);
+  for (;;) {
+    timespec wait {
+      .tv_sec = static_cast<time_t>(duration_cast<seconds>(timeout).count()),
+      .tv_nsec = static_cast<long>((timeout % seconds{1}).count())
+    };
+    futex(state, FUTEX_WAIT_PRIVATE, PARKED, &wait);
+    if (state.load() != PARKED) return true;
+    //spurious wakeups come back around here too, but we'd rather wait a bit too long than work out how long is left
+    uint32_t expected = PARKED;
+    if (mayRetire() && state.compare_exchange_strong(expected, DEAD)) {
+      ++stats.retirements;
+      state.notify_all();
+      return false;
     }
-    else {
-      deadOrDying = true;
-      break;
-    } 
+    if (state.load() != PARKED) return true;
   }
+}
 
-  if (token.stop_requested()) {
-    Logger::log<Logger::LogLevel::DEBUG>("Exiting a worker thread");
+// we retire if there's more than the minimum of us around, and nobody else has retired in the last idle timeout
+bool Worker::mayRetire() {
+  if (stats.threads.load() <= config.minWorkerThreads) return false;
+  auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+  auto last = stats.lastRetirement.load();
+  if (now - last < std::chrono::steady_clock::duration{config.workerIdleTimeout}.count()) return false;
+  return stats.lastRetirement.compare_exchange_strong(last, now);
+}
+
+// our own queue first, then everyone else's, starting from a random worker so thieves don't all pile onto the same one
+std::optional<Task> Worker::findTask() {
+  if (std::optional<Task> task = taskQueue.take()) return task;
+  if (!config.workStealing) return {};
+
+  size_t start = std::uniform_int_distribution<size_t>{0, pool.size() - 1}(eng);
+  for (size_t i = 0; i < pool.size(); ++i) {
+    Worker& victim = pool[(start + i) % pool.size()];
+    if (&victim == this || victim.taskQueue.empty()) continue;
+    if (std::optional<Task> task = victim.taskQueue.take()) return task;
   }
-  else {
-    Logger::log<Logger::LogLevel::DEBUG>("Scaling down the thread pool");
+  return {};
+}
+
+void Worker::run(Task& task) {
+  if (task.job) {
+    task.job();
+    return;
+  }
+  //once we've handed over our response the dispatch thread may close the client, so we can't ask it for its fd after
+  int fd = task.destination->getfd();
+  //nobody is going to read it, but we still have to let the client know we are done with it - unless identical
+  //requests are waiting on this one, in which case it has to run for them
+  bool gone = task.request.cancellation.clientGone.stop_requested();
+  if (gone && (!task.route->coalescer || task.route->coalescer->abandon(task.request))) {
+    ++stats.skipped;
+    if (task.request.bodyStream) task.request.bodyStream->discard();
+    if (task.destination->addOutgoing(task.sequence, std::string{})) task.owner->notifyForClient(fd);
+    return;
+  }
+  Response result = execute(*task.route, task.request, config.inlineThreshold);
+  //whatever of a streamed body the handler left unread is dropped as it comes in, so the requests behind it still get
+  //through - and the dispatch thread, if it stopped reading for it, picks back up when it handles our response
+  if (task.request.bodyStream) task.request.bodyStream->discard();
+  bool reactivated = config.writeThrough && config.ioBackend == ServerConfig::IOBackend::EPOLL
+    ? task.destination->writeThrough(task.sequence, std::move(result))
+    : task.destination->addOutgoing(task.sequence, std::move(result));
+  if (reactivated) {
+    task.owner->notifyForClient(fd);
   }
 }
 
-void Worker::add(Task&& task) {
-  std::lock_guard<std::mutex> lock {queueMutex};
-  if (deadOrDying) {
-    deadOrDying = false;
-    thread = std::jthread {
-      std::bind_front(&Worker::work, this),
-      std::move(task)
+Response Worker::execute(const Route& route, Request& request, std::chrono::nanoseconds inlineThreshold) {
+  Response result = handle(route, request, inlineThreshold);
+  if (route.coalescer) return route.coalescer->finish(route, request, std::move(result), inlineThreshold);
+  return result;
+}
+
+Response Worker::handle(const Route& route, Request& request, std::chrono::nanoseconds inlineThreshold) {
+  if (request.cancellation.expired()) return unavailable();
+  bool timed = route.policy == ExecutionPolicy::AUTO;
+  auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+  unsigned long generation = route.cache ? route.cache->generation() : 0;
+  Response result;
+
+  try {
+    result = route.handler(request);
+  }
+  catch (...) {
+    result = fromException(std::current_exception());
+  }
+
+  if (timed) route.record(std::chrono::steady_clock::now() - start, inlineThreshold);
+  if (request.cancellation.expired()) return timedOut();
+  if (route.cache) return route.cache->store(request, route.cacheTTL, std::move(result), generation);
+  return result;
+}
+
+Response Worker::fromException(std::exception_ptr exception) {
+  try {
+    std::rethrow_exception(exception);
+  }
+  catch (Utils::HTTPException e) {
+    return {
+      .statusCode = e.statusCode(),
+      .body = e.what()
     };
   }
-  else taskQueue.push(std::move(task));
+  catch (std::exception e) {
+    Logger::log<Logger::LogLevel::ERROR>(std::string{"Uncaught exception: "} + e.what());
+  }
+  catch (...) {
+    Logger::log<Logger::LogLevel::ERROR>("Uncaught exception that wasn't a std::exception");
+  }
+  static const CannedResponse internalError {Response {
+    .statusCode = Response::StatusCode::INTERNAL_SERVER_ERROR,
+    .body = "Sorry, something went wrong - we are working extremely hard to find the problem"
+  }};
+  return { .canned = internalError };
+}
+
+// these come thick and fast when we're overloaded, so they're only made once
+Response Worker::unavailable() {
+  static const CannedResponse canned {Response {
+    .statusCode = Response::StatusCode::SERVICE_UNAVAILABLE,
+    .body = "Timed out waiting for a worker"
+  }};
+  return { .canned = canned };
+}
+
+Response Worker::timedOut() {
+  static const CannedResponse canned {Response {
+    .statusCode = Response::StatusCode::GATEWAY_TIMEOUT,
+    .body = "Timed out waiting for the handler"
+  }};
+  return { .canned = canned };
+}
+
+bool Worker::add(Task& task) {
+  if (!taskQueue.push(task)) return false;
+  start();
+  return true;
+}
+
+void Worker::start() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  uint32_t current = state.load();
+  do {
+    if (current == RUNNING) return;
+  } while (!state.compare_exchange_weak(current, RUNNING));
+
+  if (current == PARKED) {
+    ++stats.wakeups;
+    futex(state, FUTEX_WAKE_PRIVATE, INT_MAX);
+    return;
+  }
+
+  //we won the race to restart, but the old thread may still be on its way out - assigning joins it
+  std::lock_guard<std::mutex> lock {lifecycleMutex};
+  ++stats.creations;
+  ++stats.threads;
+  thread = std::jthread { std::bind_front(&Worker::work, this) };
+  if (affinity && pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &*affinity) != 0) {
+    Logger::log<Logger::LogLevel::WARN>("Couldn't pin a worker thread");
+  }
+}
+
+bool Worker::busy() const {
+  return state.load(std::memory_order_relaxed) == RUNNING;
 }
 
 size_t Worker::tasks() const {
-  std::lock_guard<std::mutex> lock {queueMutex};
   return taskQueue.size();
 }
 
 void Worker::requestStop() {
+  std::lock_guard<std::mutex> lock {lifecycleMutex};
   thread.request_stop();
+  //a parked thread has to come out to notice
+  uint32_t expected = PARKED;
+  if (state.compare_exchange_strong(expected, RUNNING)) futex(state, FUTEX_WAKE_PRIVATE, INT_MAX);
+}
+
+Worker::~Worker() {
+  //the jthread would join a parked thread forever otherwise
+  requestStop();
 }
 
 void Worker::waitForExit() const {
-  // could probably be improved - it's the only (explicit) busy wait in the application - but it's just during the shutdown
-  // and I didn't want to introduce an atomic flag or cv to do this
-  while (!deadOrDying) {
-    std::this_thread::yield();
-  }
+  for (uint32_t current = state.load(); current != DEAD; current = state.load()) state.wait(current);
 }
 
 }
@@ -0,0 +1,128 @@
+// An async handler's response is made on the dispatch thread whenever it wakes up, while the workers finish the
+// responses to the requests either side of it - it still has to go out in the order its request came in
+#include <cassert>
+#include <chrono>
+#include <fcntl.h>
+#include <format>
+#include <optional>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include "benchmark/common.h"
+#include "server/async.h"
+
+using namespace MyServer;
+
+//read by /blocked, which has nothing to read until we write to it - so it's stuck on a worker until then
+const std::string fifo = std::format("/tmp/asyncTest.{}", getpid());
+
+std::string parameter(Request& req, std::string_view name) {
+  std::optional<std::string_view> value = req.query(name);
+  return value ? std::string{*value} : std::string{};
+}
+
+void setup(Server& server) {
+  server.registerHandler(
+    "/slow", Request::Method::GET,
+    [](Request& req) -> Async<Response> {
+      std::string n = parameter(req, "n");
+      co_await sleepFor(std::chrono::milliseconds{std::stoi(parameter(req, "ms"))});
+      co_return Response { .statusCode = Response::StatusCode::OK, .body = "slow " + n };
+    }
+  );
+  server.registerHandler(
+    "/fast", Request::Method::GET,
+    [](Request& req) { return Response { .statusCode = Response::StatusCode::OK, .body = "fast " + parameter(req, "n") }; }
+  );
+  server.registerHandler(
+    "/blocked", Request::Method::GET,
+    [](Request&) -> Async<Response> {
+      std::optional<std::string> contents = co_await readFile(fifo);
+      co_return Response { .statusCode = Response::StatusCode::OK, .body = contents.value_or("") };
+    }
+  );
+  server.setDeadline("/slow", Request::Method::GET, std::chrono::milliseconds{500});
+  server.setDeadline("/blocked", Request::Method::GET, std::chrono::milliseconds{100});
+}
+
+// the bodies of the next `count` responses, in the order they arrive
+std::vector<std::string> readBodies(int fd, size_t count) {
+  std::vector<std::string> bodies;
+  std::string buffer;
+  char chunk[16384];
+  while (bodies.size() < count) {
+    size_t headerEnd = buffer.find("\r\n\r\n");
+    if (headerEnd != std::string::npos) {
+      size_t lengthAt = buffer.find("Content-Length: ");
+      size_t length = lengthAt < headerEnd ? std::stoul(buffer.substr(lengthAt + 16)) : 0;
+      if (buffer.size() >= headerEnd + 4 + length) {
+        bodies.push_back(buffer.substr(headerEnd + 4, length));
+        buffer.erase(0, headerEnd + 4 + length);
+        continue;
+      }
+    }
+    ssize_t got = read(fd, chunk, sizeof(chunk));
+    if (got <= 0) break;
+    buffer.append(chunk, got);
+  }
+  return bodies;
+}
+
+void check(int port, ServerConfig::IOBackend backend) {
+  ServerConfig config {};
+  config.ioBackend = backend;
+  config.dispatchThreads = 1;
+  config.workerThreads = 2;
+  pid_t server = Bench::forkServer(port, config, setup);
+  Bench::waitForServer(port);
+
+  //pipelined, with every third one async - and the earlier ones sleeping longer, so they finish last (but in time)
+  constexpr int requests = 30;
+  std::string pipeline;
+  std::vector<std::string> expected;
+  for (int i = 0; i < requests; ++i) {
+    if (i % 3 == 0) {
+      pipeline += std::format("GET /slow?n={}&ms={} HTTP/1.1\r\n\r\n", i, 5 * (requests - i));
+      expected.push_back(std::format("slow {}", i));
+    }
+    else {
+      pipeline += std::format("GET /fast?n={} HTTP/1.1\r\n\r\n", i);
+      expected.push_back(std::format("fast {}", i));
+    }
+  }
+  int fd = Bench::connectTo(port);
+  bool sent = fd >= 0 && Bench::sendAll(fd, pipeline);
+  assert(sent);
+  assert(readBodies(fd, requests) == expected);
+
+  //and an async response that's ready at once doesn't jump ahead of a worker's that isn't written yet
+  for (int round = 0; round < 100; ++round) {
+    Bench::sendAll(fd, std::format("GET /fast?n={} HTTP/1.1\r\n\r\nGET /slow?n={}&ms=0 HTTP/1.1\r\n\r\n", round, round));
+    assert(readBodies(fd, 2) == (std::vector<std::string>{std::format("fast {}", round), std::format("slow {}", round)}));
+  }
+
+  //past the deadline we answer for the handler - a sleep is cut short, and a handler stuck waiting on a worker is left
+  //to finish in its own time
+  std::string timedOut = "Timed out waiting for the handler";
+  auto start = std::chrono::steady_clock::now();
+  Bench::sendAll(fd, "GET /slow?ms=60000 HTTP/1.1\r\n\r\nGET /blocked HTTP/1.1\r\n\r\nGET /fast?n=0 HTTP/1.1\r\n\r\n");
+  assert(readBodies(fd, 3) == (std::vector<std::string>{timedOut, timedOut, "fast 0"}));
+  assert(std::chrono::steady_clock::now() - start < std::chrono::seconds{5});
+  //which it does once there's something to read, and its late answer goes nowhere
+  int writer = open(fifo.c_str(), O_WRONLY);
+  assert(writer >= 0);
+  close(writer);
+  Bench::sendAll(fd, "GET /fast?n=1 HTTP/1.1\r\n\r\n");
+  assert(readBodies(fd, 1) == std::vector<std::string>{"fast 1"});
+  close(fd);
+  Bench::stopServer(server);
+}
+
+int main() {
+  mkfifo(fifo.c_str(), 0600);
+  check(8750, ServerConfig::IOBackend::EPOLL);
+  check(8751, ServerConfig::IOBackend::IO_URING);
+  unlink(fifo.c_str());
+  return 0;
+}
@@ -0,0 +1,44 @@
+// Connection storm: every client connects, makes one request, and hangs up, as fast as it can.
+// Compares the main thread handover against per dispatch thread SO_REUSEPORT listeners.
+#include <format>
+#include <iostream>
+
+#include "common.h"
+
+using namespace MyServer;
+
+double acceptsPerSecond(ServerConfig::AcceptMode mode, int port, int clientThreads, std::chrono::seconds duration) {
+  pid_t server = Bench::forkServer(port, {.acceptMode = mode}, [](Server& server) {
+    server.registerHandler("/", Request::Method::GET, [](Request&) -> Response {
+      return { .statusCode = Response::StatusCode::OK, .body = "hello" };
+    });
+  });
+  Bench::waitForServer(port);
+
+  long connections = Bench::runFor(clientThreads, duration, [port](const std::atomic<bool>& stop) {
+    long done = 0;
+    while (!stop) {
+      int fd = Bench::connectTo(port);
+      if (fd < 0) continue;
+      if (Bench::sendAll(fd, "GET / HTTP/1.1\r\n\r\n") && Bench::readResponses(fd)) ++done;
+      close(fd);
+    }
+    return done;
+  });
+
+  Bench::stopServer(server);
+  return static_cast<double>(connections) / duration.count();
+}
+
+int main(int argc, char** argv) {
+  int clientThreads = argc > 1 ? std::stoi(argv[1]) : 16;
+  std::chrono::seconds duration { argc > 2 ? std::stoi(argv[2]) : 5 };
+
+  double handover = acceptsPerSecond(ServerConfig::AcceptMode::HANDOVER, 8676, clientThreads, duration);
+  double reuseport = acceptsPerSecond(ServerConfig::AcceptMode::REUSEPORT, 8677, clientThreads, duration);
+
+  std::cout << std::format("{} client threads, {}s each\n", clientThreads, duration.count());
+  std::cout << std::format("handover:  {:.0f} accepts/s\n", handover);
+  std::cout << std::format("reuseport: {:.0f} accepts/s\n", reuseport);
+  return 0;
+}
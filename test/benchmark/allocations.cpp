@@ -0,0 +1,106 @@
+// Heap allocations per request, from the bytes arriving to the handler being done with the request: parsing, then
+// a lookup of a header and a query parameter, like most of our handlers do. Then the same for writing the head of a
+// small JSON response, into a string that's reused like a response slot's.
+#include <atomic>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "server/parseHTTP.h"
+#include "server/serialize.h"
+
+using namespace MyServer;
+
+std::atomic<size_t> allocations {0};
+
+void* operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* memory = std::malloc(size == 0 ? 1 : size)) return memory;
+  throw std::bad_alloc {};
+}
+
+void operator delete(void* memory) noexcept {
+  std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+  std::free(memory);
+}
+
+const std::string browserGet =
+  "GET /todo?id=4f3b2c&lang=en HTTP/1.1\r\n"
+  "Host: www.example.com\r\n"
+  "Connection: keep-alive\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+  "Sec-Fetch-Site: same-origin\r\n"
+  "Sec-Fetch-Mode: navigate\r\n"
+  "Referer: https://www.example.com/account/settings\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+  "Cookie: session=9f8e7d6c5b4a39281706f5e4d3c2b1a0; theme=dark\r\n"
+  "\r\n";
+
+const std::string apiPost =
+  "POST /todo?id=4f3b2c HTTP/1.1\r\n"
+  "Host: api.example.com\r\n"
+  "Content-Type: application/json\r\n"
+  "Content-Length: 38\r\n"
+  "\r\n"
+  R"({"description":"write it","done":true})";
+
+const std::string tinyGet = "GET /ping HTTP/1.1\r\nHost: a\r\n\r\n";
+
+void measure(std::string_view name, const std::string& request) {
+  constexpr size_t perRead = 16;
+  constexpr size_t rounds = 4096;
+  std::string reads;
+  for (size_t i = 0; i < perRead; ++i) reads += request;
+
+  HTTP::RequestParser parser {};
+  size_t seen = 0, found = 0;
+  //once round first, so the pool and the parser's request list are warmed up
+  for (size_t round = 0; round <= rounds; ++round) {
+    if (round == 1) allocations = 0;
+    for (size_t head = 0; head < reads.size(); head += CHUNKSIZE) {
+      parser.process(std::string_view{reads}.substr(head, CHUNKSIZE));
+      for (Request& request: parser.takeRequests()) {
+        found += request.header("Host").has_value() + request.query("id").has_value();
+        if (round > 0) ++seen;
+      }
+    }
+  }
+  if (found == 0) std::cerr << "didn't find anything?\n";
+
+  std::cout << std::format("{:<8}: {:.2f} allocations per request\n", name, static_cast<double>(allocations) / seen);
+}
+
+void measureHeads() {
+  constexpr size_t rounds = 1 << 16;
+  Response response {
+    .statusCode = Response::StatusCode::OK,
+    .contentType = Response::ContentType::JSON,
+    .body = R"({"description":"write it","done":true,"due":null})"
+  };
+  std::string head;
+  size_t written = 0;
+  for (size_t round = 0; round <= rounds; ++round) {
+    if (round == 1) allocations = 0;
+    HTTP::writeHead(response, head);
+    written += head.size();
+  }
+  if (written == 0) std::cerr << "didn't write anything?\n";
+
+  std::cout << std::format("{:<8}: {:.2f} allocations per response head\n", "head", static_cast<double>(allocations) / rounds);
+}
+
+int main() {
+  measure("browser", browserGet);
+  measure("api", apiPost);
+  measure("tiny", tinyGet);
+  measureHeads();
+  return 0;
+}
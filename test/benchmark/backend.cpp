@@ -0,0 +1,53 @@
+// Keep-alive request throughput and server CPU per request, epoll vs io_uring.
+// Each client holds one connection and sends `depth` pipelined requests at a time.
+#include <format>
+#include <iostream>
+
+#include "common.h"
+
+using namespace MyServer;
+
+void measure(ServerConfig config, int port, int clients, int depth, std::chrono::seconds duration) {
+  pid_t server = Bench::forkServer(port, config, [](Server& server) {
+    server.registerHandler("/", Request::Method::GET, [](Request&) -> Response {
+      return { .statusCode = Response::StatusCode::OK, .body = "hello" };
+    });
+  });
+  Bench::waitForServer(port);
+
+  std::string batch;
+  for (int i = 0; i < depth; ++i) batch += "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+  double cpuBefore = Bench::cpuSeconds(server);
+  long requests = Bench::runFor(clients, duration, [&](const std::atomic<bool>& stop) {
+    int fd = Bench::connectTo(port);
+    long done = 0;
+    while (!stop && Bench::sendAll(fd, batch) && Bench::readResponses(fd, depth)) done += depth;
+    close(fd);
+    return done;
+  });
+  double cpu = Bench::cpuSeconds(server) - cpuBefore;
+  Bench::stopServer(server);
+
+  std::cout << std::format(
+    "{:<8} {:<9} depth {:>3}: {:>9.0f} requests/s  {:>7.2f} cpu-us/request\n",
+    config.ioBackend == ServerConfig::IOBackend::IO_URING ? "io_uring" : "epoll",
+    config.acceptMode == ServerConfig::AcceptMode::REUSEPORT ? "reuseport" : "handover",
+    depth, static_cast<double>(requests) / duration.count(), requests ? cpu * 1e6 / requests : 0.0
+  );
+}
+
+int main(int argc, char** argv) {
+  int clients = argc > 1 ? std::stoi(argv[1]) : 8;
+  std::chrono::seconds duration { argc > 2 ? std::stoi(argv[2]) : 5 };
+
+  int port = 8690;
+  for (auto acceptMode: {ServerConfig::AcceptMode::HANDOVER, ServerConfig::AcceptMode::REUSEPORT}) {
+    for (int depth: {1, 16}) {
+      for (auto backend: {ServerConfig::IOBackend::EPOLL, ServerConfig::IOBackend::IO_URING}) {
+        measure({.acceptMode = acceptMode, .ioBackend = backend}, port++, clients, depth, duration);
+      }
+    }
+  }
+  return 0;
+}
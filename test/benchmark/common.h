@@ -0,0 +1,143 @@
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+// Helpers shared by the benchmarks: each one forks a real server and drives it over loopback
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "server/server.h"
+
+namespace Bench {
+
+using Clock = std::chrono::steady_clock;
+
+inline pid_t forkServer(int port, MyServer::ServerConfig config, std::function<void(MyServer::Server&)> setup) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+
+  //the server logs a status update every few seconds, which we don't want mixed into the results
+  int devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDOUT_FILENO);
+  MyServer::Server server {config};
+  setup(server);
+  server.go(port);
+  _exit(0);
+}
+
+inline void stopServer(pid_t pid) {
+  kill(pid, SIGINT);
+  waitpid(pid, nullptr, 0);
+}
+
+inline int connectTo(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+    close(fd);
+    return -1;
+  }
+  int opt = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  return fd;
+}
+
+inline void waitForServer(int port) {
+  for (;;) {
+    int fd = connectTo(port);
+    if (fd >= 0) {
+      close(fd);
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+  }
+}
+
+// reads until `count` complete responses have arrived; only understands Content-Length framed responses
+inline bool readResponses(int fd, int count = 1) {
+  std::string buffer;
+  char chunk[16384];
+  while (count > 0) {
+    size_t headerEnd = buffer.find("\r\n\r\n");
+    if (headerEnd != std::string::npos) {
+      size_t lengthAt = buffer.find("Content-Length: ");
+      size_t length = lengthAt < headerEnd ? std::stoul(buffer.substr(lengthAt + 16)) : 0;
+      if (buffer.size() >= headerEnd + 4 + length) {
+        buffer.erase(0, headerEnd + 4 + length);
+        --count;
+        continue;
+      }
+    }
+    ssize_t got = read(fd, chunk, sizeof(chunk));
+    if (got <= 0) return false;
+    buffer.append(chunk, got);
+  }
+  return true;
+}
+
+inline bool sendAll(int fd, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t sent = write(fd, data.data(), data.size());
+    if (sent <= 0) return false;
+    data.remove_prefix(sent);
+  }
+  return true;
+}
+
+// user + system time the process has used so far
+inline double cpuSeconds(pid_t pid) {
+  std::ifstream stat {"/proc/" + std::to_string(pid) + "/stat"};
+  std::string field;
+  long ticks = 0;
+  //utime and stime are the 14th and 15th fields (the command name has no spaces for us)
+  for (int i = 1; i <= 15 && stat >> field; ++i) {
+    if (i >= 14) ticks += std::stol(field);
+  }
+  return static_cast<double>(ticks) / sysconf(_SC_CLK_TCK);
+}
+
+// write(2)-like syscalls the process has made so far - write, writev and friends, not send/sendmsg
+inline long writeSyscalls(pid_t pid) {
+  std::ifstream io {"/proc/" + std::to_string(pid) + "/io"};
+  std::string field;
+  long value = 0;
+  while (io >> field >> value) {
+    if (field == "syscw:") return value;
+  }
+  return 0;
+}
+
+// runs `job` on `threads` threads until `duration` has passed, and returns the summed counts the jobs report
+inline long runFor(int threads, Clock::duration duration, std::function<long(const std::atomic<bool>&)> job) {
+  std::atomic<bool> stop {false};
+  std::atomic<long> total {0};
+  std::vector<std::jthread> pool;
+  for (int i = 0; i < threads; ++i) {
+    pool.emplace_back([&]{ total += job(stop); });
+  }
+  std::this_thread::sleep_for(duration);
+  stop = true;
+  pool.clear();
+  return total;
+}
+
+}
+
+#endif
@@ -0,0 +1,68 @@
+// Server CPU time per request at a few request rates, spinning forever (the old event loop) vs spinning then blocking.
+// Each client thread holds one keep-alive connection and paces its requests to hit the target rate.
+#include <format>
+#include <iostream>
+
+#include "common.h"
+
+using namespace MyServer;
+
+struct Load {
+  std::string_view name;
+  int clients;
+  int requestsPerSecond; //per client, 0 means as fast as possible
+};
+
+void measure(std::string_view label, ServerConfig config, int port, const Load& load, std::chrono::seconds duration) {
+  pid_t server = Bench::forkServer(port, config, [](Server& server) {
+    server.registerHandler("/", Request::Method::GET, [](Request&) -> Response {
+      return { .statusCode = Response::StatusCode::OK, .body = "hello" };
+    });
+  });
+  Bench::waitForServer(port);
+
+  double cpuBefore = Bench::cpuSeconds(server);
+  long requests = Bench::runFor(load.clients, duration, [&](const std::atomic<bool>& stop) {
+    int fd = Bench::connectTo(port);
+    long done = 0;
+    auto next = Bench::Clock::now();
+    while (!stop) {
+      if (!Bench::sendAll(fd, "GET / HTTP/1.1\r\n\r\n") || !Bench::readResponses(fd)) break;
+      ++done;
+      if (load.requestsPerSecond > 0) {
+        next += std::chrono::microseconds{1'000'000 / load.requestsPerSecond};
+        std::this_thread::sleep_until(next);
+      }
+    }
+    close(fd);
+    return done;
+  });
+  double cpu = Bench::cpuSeconds(server) - cpuBefore;
+  Bench::stopServer(server);
+
+  std::cout << std::format(
+    "{:<10} {:<12} {:>8} requests  {:>7.3f} cpu-s  {:>9.2f} cpu-us/request  {:>5.2f} cores\n",
+    label, load.name, requests, cpu, requests ? cpu * 1e6 / requests : 0.0, cpu / duration.count()
+  );
+}
+
+int main(int argc, char** argv) {
+  std::chrono::seconds duration { argc > 1 ? std::stoi(argv[1]) : 5 };
+  constexpr Load loads[] {
+    {"idle", 1, 1},
+    {"100/s", 1, 100},
+    {"1000/s", 4, 250},
+    {"saturated", 8, 0},
+  };
+
+  //a day of spinning is as good as never blocking
+  ServerConfig alwaysSpin { .spinBudget = std::chrono::hours{24} };
+  ServerConfig adaptive {};
+
+  int port = 8680;
+  for (const Load& load: loads) {
+    measure("spin", alwaysSpin, port++, load, duration);
+    measure("adaptive", adaptive, port++, load, duration);
+  }
+  return 0;
+}
@@ -0,0 +1,47 @@
+// Throughput and server CPU per response under a workload that's nothing but 404s, from pipelined keep-alive clients.
+// "canned" asks for a path nobody registered, so gets the server's shared preserialized 404. "built" asks for a path
+// whose handler makes the same 404 from scratch every time, like the server used to, for comparison.
+#include <format>
+#include <iostream>
+
+#include "common.h"
+
+using namespace MyServer;
+
+void measure(int port, std::string_view name, std::string_view path, int clients, std::chrono::seconds duration) {
+  constexpr int depth = 16;
+  pid_t server = Bench::forkServer(port, {}, [](Server& server) {
+    server.registerHandler("/built", Request::Method::GET, [](Request&) -> Response {
+      return { .statusCode = Response::StatusCode::NOT_FOUND, .contentType = Response::ContentType::PLAINTEXT };
+    }, ExecutionPolicy::INLINE);
+  });
+  Bench::waitForServer(port);
+
+  std::string batch;
+  for (int i = 0; i < depth; ++i) batch += std::format("GET {} HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+
+  double cpuBefore = Bench::cpuSeconds(server);
+  long requests = Bench::runFor(clients, duration, [&](const std::atomic<bool>& stop) {
+    int fd = Bench::connectTo(port);
+    long done = 0;
+    while (!stop && Bench::sendAll(fd, batch) && Bench::readResponses(fd, depth)) done += depth;
+    close(fd);
+    return done;
+  });
+  double cpu = Bench::cpuSeconds(server) - cpuBefore;
+  Bench::stopServer(server);
+
+  std::cout << std::format(
+    "{:<7}: {:>9.0f} requests/s  {:>6.2f} us cpu/response\n",
+    name, static_cast<double>(requests) / duration.count(), requests ? cpu * 1e6 / requests : 0.0
+  );
+}
+
+int main(int argc, char** argv) {
+  int clients = argc > 1 ? std::stoi(argv[1]) : 8;
+  std::chrono::seconds duration { argc > 2 ? std::stoi(argv[2]) : 5 };
+
+  measure(8730, "canned", "/missing", clients, duration);
+  measure(8731, "built", "/built", clients, duration);
+  return 0;
+}
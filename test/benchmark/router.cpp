@@ -0,0 +1,109 @@
+// Route lookup cost, in ns per lookup, with a few hundred routes: the router against the exact-match hash map it
+// replaced, on the same literal endpoints and on ones neither has, then the router on endpoints that only match its
+// patterns with {name}s, which the map can't do at all. The router has the patterns too, so a miss has to walk its trie.
+// Nothing is served - it's the lookup the dispatch thread does for every request, on its own.
+#include <algorithm>
+#include <format>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "server/router.h"
+
+using namespace MyServer;
+
+const std::vector<std::string> resources {
+  "users", "orders", "products", "invoices", "payments", "carts", "reviews", "categories", "shipments", "coupons",
+  "accounts", "sessions", "tokens", "webhooks", "events", "reports", "exports", "imports", "teams", "projects"
+};
+const std::vector<std::string> actions {"", "/archive", "/history", "/settings", "/summary"};
+
+struct EndpointHash {
+  using is_transparent = void;
+  size_t operator()(std::string_view endpoint) const { return std::hash<std::string_view>{}(endpoint); }
+};
+
+template <typename Lookup>
+void measure(std::string_view name, const std::vector<std::string>& endpoints, std::chrono::seconds duration,
+  Lookup lookup) {
+  size_t lookups = 0, found = 0;
+  auto start = Bench::Clock::now();
+  while (Bench::Clock::now() - start < duration) {
+    for (const std::string& endpoint: endpoints) found += lookup(endpoint);
+    lookups += endpoints.size();
+  }
+  double seconds = std::chrono::duration<double>(Bench::Clock::now() - start).count();
+  std::cout << std::format("{:<28}: {:>7.1f} ns/lookup  ({:.0f}% found)\n",
+    name, seconds * 1e9 / lookups, 100.0 * found / lookups);
+}
+
+int main(int argc, char** argv) {
+  std::chrono::seconds duration { argc > 1 ? std::stoi(argv[1]) : 2 };
+  Handler handler = [](Request&) { return Response {}; };
+
+  //300 static routes, /api/v1/users/archive and the like
+  std::vector<std::string> statics;
+  for (int version = 1; version <= 3; ++version) {
+    for (const std::string& resource: resources) {
+      for (const std::string& action: actions) statics.push_back(std::format("/api/v{}/{}{}", version, resource, action));
+    }
+  }
+  std::unordered_map<std::string, Route, EndpointHash, std::equal_to<>> map;
+  Router router;
+  for (const std::string& endpoint: statics) {
+    map.try_emplace(endpoint, handler, ExecutionPolicy::WORKER);
+    router.add(endpoint, handler, ExecutionPolicy::WORKER);
+  }
+
+  //the same again with an id in the middle: /api/v1/users/{id}/archive
+  std::vector<std::string> withIds;
+  for (int version = 1; version <= 3; ++version) {
+    for (const std::string& resource: resources) {
+      for (const std::string& action: actions) {
+        std::string pattern = std::format("/api/v{}/{}/", version, resource) + "{id}" + action;
+        router.add(pattern, handler, ExecutionPolicy::WORKER);
+        withIds.push_back(std::format("/api/v{}/{}/{}{}", version, resource, 100000 + withIds.size() * 37, action));
+      }
+    }
+  }
+  router.add("/static/{path...}", handler, ExecutionPolicy::WORKER);
+
+  //in a random order, so neither gets to walk the same path over and over
+  std::mt19937 mt {42};
+  std::shuffle(statics.begin(), statics.end(), mt);
+  std::shuffle(withIds.begin(), withIds.end(), mt);
+  std::vector<std::string> misses;
+  //deep ones, that only fail once they've tried an {id}
+  for (const std::string& endpoint: statics) misses.push_back(endpoint + "/x/y");
+  std::vector<std::string> files;
+  for (size_t i = 0; i < statics.size(); ++i) files.push_back(std::format("/static/js/chunk.{}.js", i));
+
+  std::cout << std::format("{} routes in the map, {} in the router\n", map.size(), router.size());
+  measure("map, literal", statics, duration, [&](const std::string& endpoint) {
+    return map.find(std::string_view{endpoint}) != map.end();
+  });
+  measure("router, literal", statics, duration, [&](const std::string& endpoint) {
+    return router.match(endpoint) != nullptr;
+  });
+  measure("map, misses", misses, duration, [&](const std::string& endpoint) {
+    return map.find(std::string_view{endpoint}) != map.end();
+  });
+  measure("router, misses", misses, duration, [&](const std::string& endpoint) {
+    return router.match(endpoint) != nullptr;
+  });
+  //into the same captures each time, like a request's
+  Router::Captures found;
+  measure("router, {id}", withIds, duration, [&](const std::string& endpoint) {
+    found.truncate(0);
+    return router.match(endpoint, found) != nullptr && found.size() == 1;
+  });
+  measure("router, {path...}", files, duration, [&](const std::string& endpoint) {
+    found.truncate(0);
+    return router.match(endpoint, found) != nullptr;
+  });
+  return 0;
+}
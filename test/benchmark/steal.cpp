@@ -0,0 +1,71 @@
+// Tail latency of cheap requests when a few requests are expensive, with and without work stealing.
+// Without stealing a fast request waits for whatever slow handler is ahead of it in its worker's queue.
+#include <algorithm>
+#include <format>
+#include <iostream>
+#include <mutex>
+#include <random>
+
+#include "common.h"
+
+using namespace MyServer;
+
+constexpr auto slowHandlerTime = std::chrono::milliseconds{20};
+constexpr double slowFraction = 0.05;
+
+void measure(std::string_view label, ServerConfig config, int port, int clients, std::chrono::seconds duration) {
+  pid_t server = Bench::forkServer(port, config, [](Server& server) {
+    server.registerHandler("/fast", Request::Method::GET, [](Request&) -> Response {
+      return { .statusCode = Response::StatusCode::OK, .body = "fast" };
+    });
+    server.registerHandler("/slow", Request::Method::GET, [](Request&) -> Response {
+      std::this_thread::sleep_for(slowHandlerTime);
+      return { .statusCode = Response::StatusCode::OK, .body = "slow" };
+    });
+  });
+  Bench::waitForServer(port);
+
+  std::mutex latenciesMutex;
+  std::vector<double> fastLatencies;
+  long requests = Bench::runFor(clients, duration, [&](const std::atomic<bool>& stop) {
+    int fd = Bench::connectTo(port);
+    std::minstd_rand eng {std::random_device{}()};
+    std::bernoulli_distribution slow {slowFraction};
+    std::vector<double> ours;
+    long done = 0;
+    while (!stop) {
+      bool isSlow = slow(eng);
+      auto start = Bench::Clock::now();
+      if (!Bench::sendAll(fd, isSlow ? "GET /slow HTTP/1.1\r\n\r\n" : "GET /fast HTTP/1.1\r\n\r\n")) break;
+      if (!Bench::readResponses(fd)) break;
+      if (!isSlow) ours.push_back(std::chrono::duration<double, std::micro>(Bench::Clock::now() - start).count());
+      ++done;
+    }
+    close(fd);
+    std::lock_guard<std::mutex> lock {latenciesMutex};
+    fastLatencies.insert(fastLatencies.end(), ours.begin(), ours.end());
+    return done;
+  });
+  Bench::stopServer(server);
+
+  std::ranges::sort(fastLatencies);
+  auto percentile = [&](double p) {
+    return fastLatencies.empty() ? 0.0 : fastLatencies[static_cast<size_t>(p * (fastLatencies.size() - 1))];
+  };
+  std::cout << std::format(
+    "{:<12} {:>8} requests  fast requests: p50 {:>8.0f}us  p99 {:>8.0f}us  p99.9 {:>8.0f}us\n",
+    label, requests, percentile(0.5), percentile(0.99), percentile(0.999)
+  );
+}
+
+int main(int argc, char** argv) {
+  std::chrono::seconds duration { argc > 1 ? std::stoi(argv[1]) : 5 };
+  constexpr int clients = 16;
+
+  ServerConfig noStealing { .workerThreads = 8, .workStealing = false };
+  ServerConfig stealing { .workerThreads = 8, .workStealing = true };
+
+  measure("no stealing", noStealing, 8700, clients, duration);
+  measure("stealing", stealing, 8701, clients, duration);
+  return 0;
+}
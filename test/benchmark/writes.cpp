@@ -0,0 +1,46 @@
+// Write syscalls per response with pipelined keep-alive clients, on the epoll backend.
+// Each client sends `depth` requests at a time; everything that's ready for a client should go out in one writev.
+// The handler runs inline, so the only writes the server makes are to its clients (and the odd status update).
+#include <format>
+#include <iostream>
+
+#include "common.h"
+
+using namespace MyServer;
+
+void measure(int port, int clients, int depth, std::chrono::seconds duration) {
+  pid_t server = Bench::forkServer(port, {}, [](Server& server) {
+    server.registerHandler("/", Request::Method::GET, [](Request&) -> Response {
+      return { .statusCode = Response::StatusCode::OK, .body = "hello" };
+    }, ExecutionPolicy::INLINE);
+  });
+  Bench::waitForServer(port);
+
+  std::string batch;
+  for (int i = 0; i < depth; ++i) batch += "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+  long writesBefore = Bench::writeSyscalls(server);
+  long requests = Bench::runFor(clients, duration, [&](const std::atomic<bool>& stop) {
+    int fd = Bench::connectTo(port);
+    long done = 0;
+    while (!stop && Bench::sendAll(fd, batch) && Bench::readResponses(fd, depth)) done += depth;
+    close(fd);
+    return done;
+  });
+  long writes = Bench::writeSyscalls(server) - writesBefore;
+  Bench::stopServer(server);
+
+  std::cout << std::format(
+    "depth {:>3}: {:>9.0f} requests/s  {:>6.3f} writes/response\n",
+    depth, static_cast<double>(requests) / duration.count(), requests ? static_cast<double>(writes) / requests : 0.0
+  );
+}
+
+int main(int argc, char** argv) {
+  int clients = argc > 1 ? std::stoi(argv[1]) : 8;
+  std::chrono::seconds duration { argc > 2 ? std::stoi(argv[2]) : 5 };
+
+  int port = 8710;
+  for (int depth: {1, 4, 16, 64}) measure(port++, clients, depth, duration);
+  return 0;
+}
@@ -0,0 +1,159 @@
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include "server/client.h"
+#include "server/coalescer.h"
+#include "server/dispatch.h"
+#include "server/server.h"
+#include "server/worker.h"
+
+using namespace MyServer;
+
+// a client on one end of a socketpair, with us reading what it writes from the other
+struct Connection {
+  int peer;
+  std::unique_ptr<Client> client;
+
+  Connection(const HTTP::ParserOptions& options) {
+    int fds[2];
+    int made = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+    assert(made == 0);
+    peer = fds[1];
+    client = std::make_unique<Client>(fds[0], 8, options);
+  }
+  ~Connection() { close(peer); }
+
+  //the requests the dispatch thread would take from the client, in order
+  std::vector<Request> send(std::string_view bytes) {
+    client->consume(bytes);
+    std::vector<Request> requests = client->takeRequests();
+    for (Request& request: requests) request.cancellation.clientGone = client->hangupToken();
+    return requests;
+  }
+
+  //everything the client has ready to go out, in order
+  std::string received() {
+    while (client->handleWrite() == Client::IOState::CONTINUE);
+    std::string out;
+    char buffer[4096];
+    for (ssize_t got; (got = read(peer, buffer, sizeof(buffer))) > 0;) out.append(buffer, got);
+    return out;
+  }
+};
+
+//responses made a second apart differ in their Date
+std::string undated(std::string response) {
+  size_t date = response.find("Date: ");
+  if (date != std::string::npos) response.erase(date, response.find("\r\n", date) + 2 - date);
+  return response;
+}
+
+Response ok(std::string body) {
+  return { .statusCode = Response::StatusCode::OK, .contentType = Response::ContentType::JSON, .body = std::move(body) };
+}
+
+int main() {
+  //the followers need a dispatch thread to notify, which needs a server for its config - neither ever sees a
+  //connection, so the notifications are about clients the owner hasn't heard of, which it just logs
+  ServerConfig config {};
+  config.dispatchThreads = 1;
+  config.workerThreads = 1;
+  Server server {config};
+  HTTP::ParserOptions options {};
+  auto owner = std::make_unique<Dispatch>(&server, 0);
+
+  Coalescer coalescer;
+  std::atomic<int> runs {0};
+  Route shared {[&](Request&) { ++runs; return ok(R"({"id":1})"); }, ExecutionPolicy::WORKER};
+  shared.coalescer = &coalescer;
+
+  {
+    //followers get the leader's bytes, each in their own slot
+    Connection a {options}, b {options}, c {options};
+    std::vector<Request> leader = a.send("GET /todo?id=1 HTTP/1.1\r\n\r\n");
+    assert(!coalescer.follow(leader[0], *a.client, *owner));
+    unsigned long leaderSequence = a.client->incrementSequence();
+
+    //b has something else in flight ahead of its follower, which has to wait for it
+    std::vector<Request> pipelined = b.send("GET /todo?id=2 HTTP/1.1\r\n\r\nGET /todo?id=1 HTTP/1.1\r\n\r\n");
+    assert(!coalescer.follow(pipelined[0], *b.client, *owner));
+    unsigned long before = b.client->incrementSequence();
+    assert(coalescer.follow(pipelined[1], *b.client, *owner));
+    assert(coalescer.follow(c.send("GET /todo?id=1 HTTP/1.1\r\n\r\n")[0], *c.client, *owner));
+
+    Response response = Worker::execute(shared, leader[0], std::chrono::nanoseconds{0});
+    assert(runs == 1);
+    a.client->addOutgoing(leaderSequence, std::move(response));
+    std::string sent = a.received();
+    assert(sent.starts_with("HTTP/1.1 200 OK\r\n") && sent.ends_with(R"({"id":1})"));
+    assert(undated(c.received()) == undated(sent));
+
+    assert(b.received().empty());
+    b.client->addOutgoing(before, Worker::execute(shared, pipelined[0], std::chrono::nanoseconds{0}));
+    std::string both = b.received();
+    assert(both.size() == 2 * sent.size() && undated(both.substr(sent.size())) == undated(sent));
+    assert(coalescer.led == 2 && coalescer.followed == 2);
+  }
+  {
+    //once the leader is done, the next identical request leads a run of its own
+    Connection a {options};
+    std::vector<Request> requests = a.send("GET /todo?id=1 HTTP/1.1\r\n\r\nGET /todo?id=1 HTTP/1.1\r\n\r\n");
+    assert(!coalescer.follow(requests[0], *a.client, *owner));
+    a.client->addOutgoing(a.client->incrementSequence(), Worker::execute(shared, requests[0], {}));
+    assert(!coalescer.follow(requests[1], *a.client, *owner));
+    //and nobody joined it, so it can be dropped
+    assert(coalescer.abandon(requests[1]));
+    a.client->addOutgoing(a.client->incrementSequence(), std::string{});
+  }
+  {
+    //a leader someone has joined has to run after all
+    Connection a {options}, b {options};
+    std::vector<Request> leader = a.send("GET /todo?id=3 HTTP/1.1\r\n\r\n");
+    assert(!coalescer.follow(leader[0], *a.client, *owner));
+    assert(coalescer.follow(b.send("GET /todo?id=3 HTTP/1.1\r\n\r\n")[0], *b.client, *owner));
+    assert(!coalescer.abandon(leader[0]));
+    int before = runs;
+    a.client->addOutgoing(a.client->incrementSequence(), Worker::execute(shared, leader[0], {}));
+    assert(runs == before + 1);
+    assert(undated(b.received()) == undated(a.received()));
+  }
+  {
+    //a streamed response can't be shared, so each follower runs the handler for its own
+    Route streamed {[&](Request&) {
+      ++runs;
+      Response response = ok("[");
+      response.stream = [done = false]() mutable -> std::optional<std::string> {
+        if (done) return {};
+        done = true;
+        return "]";
+      };
+      return response;
+    }, ExecutionPolicy::WORKER};
+    streamed.coalescer = &coalescer;
+
+    Connection a {options}, b {options}, c {options};
+    std::vector<Request> leader = a.send("GET /list HTTP/1.1\r\n\r\n");
+    assert(!coalescer.follow(leader[0], *a.client, *owner));
+    assert(coalescer.follow(b.send("GET /list HTTP/1.1\r\n\r\n")[0], *b.client, *owner));
+    assert(coalescer.follow(c.send("GET /list HTTP/1.1\r\n\r\n")[0], *c.client, *owner));
+    int before = runs;
+    a.client->addOutgoing(a.client->incrementSequence(), Worker::execute(streamed, leader[0], {}));
+    assert(runs == before + 3);
+    std::string sent = a.received();
+    assert(sent.contains("Transfer-Encoding: chunked\r\n") && sent.ends_with("0\r\n\r\n"));
+    assert(undated(b.received()) == undated(sent) && undated(c.received()) == undated(sent));
+  }
+
+  owner->requestStop();
+  owner->wake();
+  owner->join();
+  owner.reset();
+  server.shutdown();
+  return 0;
+}
@@ -1,37 +1,37 @@
 #include "server/parseHTTP.h"
+#include "server/scan.h"
+#include <algorithm>
 #include <random>
 #include <string_view>
 #include <cassert>
+#include <cstring>
+#include <format>
 #include <iostream>
+#include <sys/mman.h>
+#include <unistd.h>
 
 using namespace MyServer;
 
 std::vector<std::string> requestDiff(const Request& a, const Request& b) {
   std::vector<std::string> diffs {};
+  auto differ = [&](std::string_view what, std::string_view l, std::string_view r) {
+    if (l != r) diffs.push_back(std::format("Different {}:\n\n{}\n\n{}", what, l, r));
+  };
   if (a.method != b.method) diffs.push_back("Different methods");
-  if (a.body != b.body) diffs.push_back("Different bodies:\n\n" + a.body + "\n\n" + b.body);
-  if (a.endpoint != b.endpoint) diffs.push_back("Different endpoints:\n\n" + a.endpoint + "\n\n" + b.endpoint);
-
-  if (a.query.size() != b.query.size()) diffs.push_back("Different number of queries");
-  for (const auto& [k, v]: a.query) {
-    auto it = b.query.find(k);
-    if (it == b.query.end()) diffs.push_back("Query key " + k + " not found in RHS");
-    else if (it->second != v) diffs.push_back("Query key " + k + " has different values: " + v + " vs " + it->second);
-  }
-  for (const auto& [k, v]: b.query) {
-    auto it = a.query.find(k);
-    if (it == a.query.end()) diffs.push_back("Query key " + k + " not found in LHS");
-  }
+  differ("bodies", a.body, b.body);
+  differ("endpoints", a.endpoint, b.endpoint);
+  differ("queries", a.rawQuery, b.rawQuery);
+  differ("headers", a.rawHeaders, b.rawHeaders);
 
-  if (a.headers.size() != b.headers.size()) diffs.push_back("Different number of headers");
-  for (const auto& [k, v]: a.headers) {
-    auto it = b.headers.find(k);
-    if (it == b.headers.end()) diffs.push_back("Key " + k + " not found in RHS");
-    else if (it->second != v) diffs.push_back("Key " + k + " has different values: " + v + " vs " + it->second);
+  if (a.queries().size() != b.queries().size()) diffs.push_back("Different number of queries");
+  for (size_t i = 0; i < a.queries().size(); ++i) {
+    auto [k, v] = a.queries()[i];
+    differ(std::format("values for query key {}", k), v, b.query(k).value_or("(missing)"));
   }
-  for (const auto& [k, v]: b.headers) {
-    auto it = a.headers.find(k);
-    if (it == a.headers.end()) diffs.push_back("Header key " + k + " not found in LHS");
+  if (a.headers().size() != b.headers().size()) diffs.push_back("Different number of headers");
+  for (size_t i = 0; i < a.headers().size(); ++i) {
+    auto [k, v] = a.headers()[i];
+    differ(std::format("values for header {}", k), v, b.header(k).value_or("(missing)"));
   }
   return diffs;
 }
@@ -58,19 +58,20 @@ int main()
 
   Request parsed = requests.front();
   assert(parsed.method == Request::Method::GET);
-  assert(parsed.query.size() == 2);
+  assert(parsed.queries().size() == 2);
   assert(parsed.endpoint == "/");
-  assert(parsed.query.find("key1") != parsed.query.end());
-  assert(parsed.query.at("key1") == "valueA");
-  assert(parsed.query.find("key2") != parsed.query.end());
-  assert(parsed.query.at("key2") == "valueB");
-  assert(parsed.headers.size() == 3);
-  assert(parsed.headers.find("Host") != parsed.headers.end());
-  assert(parsed.headers.at("Host") == "example.com");
-  assert(parsed.headers.find("Connection") != parsed.headers.end());
-  assert(parsed.headers.at("Connection") == "close");
-  assert(parsed.headers.find("Content-Length") != parsed.headers.end());
-  assert(parsed.headers.at("Content-Length") == "0");
+  assert(parsed.query("key1") == "valueA");
+  assert(parsed.query("key2") == "valueB");
+  assert(!parsed.query("key3"));
+  //all known headers, so nothing left for the flat list
+  assert(parsed.headers().size() == 0);
+  assert(parsed.header("Host") == "example.com");
+  assert(parsed.header("host") == "example.com");
+  assert(parsed.header(KnownHeader::CONNECTION) == "close");
+  assert(parsed.closesConnection());
+  assert(parsed.header("Content-Length") == "0");
+  assert(parsed.contentLength == 0);
+  assert(!parsed.header(KnownHeader::EXPECT));
   assert(parsed.body == "");
 
   //tests are random but repeatable
@@ -91,36 +92,298 @@ int main()
   constexpr std::string_view twoRequests
     = "POST /submit?user_id=12345 HTTP/1.1\r\nHost: api.example.com\r\nContent-Length: 50\r\n\r\nabdul@laptop:~$ fortune\r\nYou are as I am with You.GET /?key1=valueA&key2=valueB HTTP/1.1\r\nHost: example.com    \r\nConnection: close\t\r\nContent-Length: 0\r\n\r\nPOST /submit?user_id=12345 HTTP/1.1\r\nHost: api.example.com\r\nContent-Length: 50\r\n\r\nabdul@laptop:~$ fortune\r\nYou are as I am with You.";
 
-  //generate a bunch of splits
-  for (int i = 0; i < 2048; ++i) {
-    head = 0;
+  //generate a bunch of splits, with each way of scanning the cpu has
+  for (HTTP::ScanLevel level: {HTTP::ScanLevel::SCALAR, HTTP::ScanLevel::SSE42, HTTP::ScanLevel::AVX2}) {
+    if (!HTTP::useScanLevel(level)) continue;
+    for (int i = 0; i < 2048; ++i) {
+      head = 0;
 
-    while (head < twoRequests.size()) {
-      int length = std::min(twoRequests.size() - head, flips(gen));
-      requestParser.process(twoRequests.substr(head, length));
-      head += length;
+      while (head < twoRequests.size()) {
+        int length = std::min(twoRequests.size() - head, flips(gen));
+        requestParser.process(twoRequests.substr(head, length));
+        head += length;
+      }
+
+      requests = requestParser.takeRequests();
+      assert(requests.size() == 3);
+      Request& postRequest = requests.front();
+      assert(postRequest.method == Request::Method::POST);
+      assert(postRequest.endpoint == "/submit");
+      assert(postRequest.queries().size() == 1);
+      assert(postRequest.query("user_id") == "12345");
+      assert(postRequest.headers().size() == 0);
+      assert(postRequest.header("Host") == "api.example.com");
+      assert(postRequest.contentLength == 50);
+      assert(!postRequest.closesConnection());
+      assert(postRequest.body == "abdul@laptop:~$ fortune\r\nYou are as I am with You.");
+
+      assertRequestEquality(requests[1], parsed);
+      assertRequestEquality(requests.front(), requests.back());
     }
+  }
+  HTTP::useScanLevel(HTTP::bestScanLevel());
 
-    requests = requestParser.takeRequests();
+  //the scanners against the standard library, for every length and offset either side of the block sizes
+  std::uniform_int_distribution<int> bytes('0', '9');
+  std::string haystack (256, ' ');
+  for (char& c: haystack) c = static_cast<char>(bytes(gen));
+  for (HTTP::ScanLevel level: {HTTP::ScanLevel::SCALAR, HTTP::ScanLevel::SSE42, HTTP::ScanLevel::AVX2}) {
+    if (!HTTP::useScanLevel(level)) continue;
+    for (size_t start = 0; start < 40; ++start) {
+      for (size_t length = 0; start + length <= haystack.size(); ++length) {
+        std::string_view view = std::string_view{haystack}.substr(start, length);
+        for (std::string_view delimiters: {"9", "78", "\r", "5:"}) {
+          assert(HTTP::findFirstOf(view, delimiters) == view.find_first_of(delimiters));
+        }
+      }
+    }
+  }
+  HTTP::useScanLevel(HTTP::bestScanLevel());
+
+  //and with the input right up against an unmapped page, so a scanner that loads a byte past the end faults
+  const size_t pageSize = sysconf(_SC_PAGESIZE);
+  void* pages = mmap(nullptr, 2 * pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(pages != MAP_FAILED);
+  int guarded = mprotect(static_cast<char*>(pages) + pageSize, pageSize, PROT_NONE);
+  assert(guarded == 0);
+  char* pageEnd = static_cast<char*>(pages) + pageSize;
+  std::fill(static_cast<char*>(pages), pageEnd, ' ');
+  for (HTTP::ScanLevel level: {HTTP::ScanLevel::SCALAR, HTTP::ScanLevel::SSE42, HTTP::ScanLevel::AVX2}) {
+    if (!HTTP::useScanLevel(level)) continue;
+    for (size_t length = 0; length <= 80; ++length) {
+      std::string_view view {pageEnd - length, length};
+      assert(HTTP::findFirstOf(view, "\r") == std::string_view::npos);
+      if (length == 0) continue;
+      pageEnd[-1] = '\r';
+      assert(HTTP::findFirstOf(view, "\r") == length - 1);
+      assert(HTTP::findFirstOf(view, ":\r") == length - 1);
+      pageEnd[-1] = ' ';
+    }
+  }
+  munmap(pages, 2 * pageSize);
+  HTTP::useScanLevel(HTTP::bestScanLevel());
+
+  //reading straight into the parser's buffer, with a body that doesn't fit in a pooled block
+  std::string bigBody (3 * Utils::BufferPool::blockSize + 7, 'x');
+  std::string bigRequest = "POST /upload HTTP/1.1\r\nContent-Length: " + std::to_string(bigBody.size()) + "\r\n\r\n" + bigBody;
+  bigRequest += getRequest;
+  head = 0;
+  while (head < bigRequest.size()) {
+    std::span<char> space = requestParser.receiveSpace();
+    size_t length = std::min({space.size(), bigRequest.size() - head, flips(gen) * 64 + 1});
+    std::memcpy(space.data(), bigRequest.data() + head, length);
+    requestParser.received(length);
+    head += length;
+  }
+  requests = requestParser.takeRequests();
+  assert(requests.size() == 2);
+  assert(requests.front().endpoint == "/upload");
+  assert(requests.front().body == bigBody);
+  assertRequestEquality(requests.back(), parsed);
+
+  //a deep pipeline in one go shouldn't grow the stack
+  constexpr size_t pipelined = 100000;
+  std::string tinyRequests;
+  for (size_t i = 0; i < pipelined; ++i) tinyRequests += "GET /a HTTP/1.1\r\n\r\n";
+  requestParser.process(tinyRequests);
+  requests = requestParser.takeRequests();
+  assert(requests.size() == pipelined);
+  assert(std::all_of(requests.begin(), requests.end(), [](const Request& r) { return r.endpoint == "/a"; }));
+
+  //requests keep the block they were read into, even after the parser has moved on and given its own back
+  requestParser.process("GET /kept?a=1&flag&b=2 HTTP/1.1\r\nX-Kept:  yes \r\n\r\nGET /pa");
+  std::vector<Request> kept = requestParser.takeRequests();
+  requestParser.process("rtial HTTP/1.1\r\n\r\n");
+  for (int i = 0; i < 64; ++i) requestParser.process(getRequest);
+  requests = requestParser.takeRequests();
+  assert(kept.size() == 1 && requests.size() == 65);
+  assert(requests.front().endpoint == "/partial");
+  assert(kept.front().endpoint == "/kept");
+  assert(kept.front().query("flag") == "" && kept.front().query("b") == "2");
+  assert(kept.front().header("X-Kept") == "yes");
+
+  //header names in any case, with the body found from a lowercase content-length
+  requestParser.process("POST /lower HTTP/1.1\r\ncontent-LENGTH: 5\r\nX-Custom: a\r\nx-custom: b\r\n"
+    "CONNECTION: Keep-Alive, Close\r\n\r\nhelloGET / HTTP/1.1\r\n\r\n");
+  requests = requestParser.takeRequests();
+  assert(requests.size() == 2);
+  assert(requests.front().body == "hello" && requests.front().contentLength == 5);
+  assert(requests.front().headers().size() == 2);
+  assert(requests.front().header("X-CUSTOM") == "b");
+  assert(requests.front().closesConnection());
+  assert(requests.back().endpoint == "/");
+
+  //headers over the limit get a 431 even if they never end, and nothing after them is parsed
+  HTTP::ParserOptions limits { .maxHeaderBytes = 64, .maxBodyBytes = 16, .spoolThreshold = 0 };
+  HTTP::RequestParser limited {limits};
+  limited.process("GET /ok HTTP/1.1\r\n\r\nGET / HTTP/1.1\r\nX-Long: ");
+  limited.process(std::string(100, 'a'));
+  assert(limited.rejected() == Response::StatusCode::REQUEST_HEADER_FIELDS_TOO_LARGE);
+  limited.process("\r\n\r\nGET /after HTTP/1.1\r\n\r\n");
+  requests = limited.takeRequests();
+  assert(requests.size() == 1 && requests.front().endpoint == "/ok");
+
+  //a body over the limit gets a 413 from its Content-Length alone
+  limited.clear();
+  assert(!limited.rejected());
+  limited.process("POST / HTTP/1.1\r\nContent-Length: 17\r\n\r\n");
+  assert(limited.rejected() == Response::StatusCode::PAYLOAD_TOO_LARGE);
+  assert(!limited.hasRequests());
+
+  //big bodies go to a file and come back mapped in, whichever way they were split up
+  HTTP::ParserOptions spooling { .spoolThreshold = 1000 };
+  HTTP::RequestParser spooler {spooling};
+  std::string spooledRequest = bigRequest + "POST /small HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc";
+  for (size_t split: {size_t{1}, size_t{777}, spooledRequest.size()}) {
+    for (head = 0; head < spooledRequest.size(); head += split) {
+      spooler.process(std::string_view{spooledRequest}.substr(head, split));
+    }
+    requests = spooler.takeRequests();
     assert(requests.size() == 3);
-    Request& postRequest = requests.front();
-    assert(postRequest.method == Request::Method::POST);
-    assert(postRequest.query.size() == 1);
-    assert(postRequest.endpoint == "/submit");
-    assert(postRequest.query.size() == 1);
-    assert(postRequest.query.find("user_id") != postRequest.query.end());
-    assert(postRequest.query.at("user_id") == "12345");
-    assert(postRequest.headers.size() == 2);
-    assert(postRequest.headers.find("Host") != postRequest.headers.end());
-    assert(postRequest.headers.at("Host") == "api.example.com");
-    assert(postRequest.headers.find("Content-Length") != postRequest.headers.end());
-    assert(postRequest.headers.at("Content-Length") == "50");
-    assert(postRequest.body == "abdul@laptop:~$ fortune\r\nYou are as I am with You.");
+    assert(requests[0].endpoint == "/upload" && requests[0].body == bigBody);
+    assertRequestEquality(requests[1], parsed);
+    assert(requests[2].body == "abc");
+  }
+
+  //a streamed body comes out a chunk at a time, starting before the rest of it has arrived
+  HTTP::ParserOptions streaming {
+    .streamWindow = 10,
+    .streamsBody = [](Request::Method, std::string_view endpoint) { return endpoint == "/upload"; }
+  };
+  HTTP::RequestParser streamer {streaming};
+  streamer.process(bigRequest.substr(0, bigRequest.size() - bigBody.size() - getRequest.size() + 5));
+  requests = streamer.takeRequests();
+  assert(requests.size() == 1 && requests.front().bodyStream && requests.front().body.empty());
+  std::shared_ptr<BodyStream> stream = requests.front().bodyStream;
+  assert(streamer.streamingBody() && streamer.streamBacklog() == 5);
+  std::string streamed {stream->next()->data};
+  assert(streamer.streamBacklog() == 0);
+  streamer.process(std::string_view{bigRequest}.substr(bigRequest.size() - bigBody.size() - getRequest.size() + 5));
+  assert(!streamer.streamingBody());
+  while (std::optional<BodyChunk> chunk = stream->next()) streamed += chunk->data;
+  assert(stream->complete() && streamed == bigBody);
+  requests = streamer.takeRequests();
+  assert(requests.size() == 1);
+  assertRequestEquality(requests.front(), parsed);
 
+  //and a handler still waiting on a body hears that it isn't coming
+  streamer.process("POST /upload HTTP/1.1\r\nContent-Length: 10\r\n\r\nabc");
+  stream = streamer.takeRequests().front().bodyStream;
+  streamer.clear();
+  assert(stream->next()->data == "abc" && !stream->next() && !stream->complete());
+
+  //a small chunk is copied out, rather than keeping the block it came in for its few bytes
+  streamer.process("POST /upload HTTP/1.1\r\nContent-Length: 10\r\n\r\nabc");
+  stream = streamer.takeRequests().front().bodyStream;
+  streamer.process("defg");
+  std::optional<BodyChunk> small = stream->next();
+  assert(small->data == "abc" && small->pinned.capacity() == 3);
+  assert(stream->next()->pinned.capacity() == 4);
+  streamer.clear();
+
+  //a handler that returns without reading the whole body doesn't hold up the requests behind it
+  streamer.process("POST /upload HTTP/1.1\r\nContent-Length: 30\r\n\r\n0123456789abcdef");
+  stream = streamer.takeRequests().front().bodyStream;
+  stream->discard();
+  assert(streamer.streamBacklog() == 0);
+  streamer.process(std::string{"ghijklmnopqrst"} + std::string{getRequest});
+  assert(!streamer.streamingBody() && streamer.streamBacklog() == 0);
+  requests = streamer.takeRequests();
+  assert(requests.size() == 1);
+  assertRequestEquality(requests.front(), parsed);
+  assert(!stream->next());
+
+  //chunked bodies are pieced back together in the buffer, whichever way they were split up
+  constexpr std::string_view chunkedRequest = "POST /chunked HTTP/1.1\r\nTransfer-Encoding: Chunked\r\n\r\n"
+    "5\r\nhello\r\n1;ext=1\r\n \r\n1A\r\nabcdefghijklmnopqrstuvwxyz\r\n0\r\nX-Trailer: t\r\n\r\n";
+  std::string twoChunked = std::string{chunkedRequest} + std::string{getRequest} + std::string{chunkedRequest};
+  for (int i = 0; i < 512; ++i) {
+    for (head = 0; head < twoChunked.size();) {
+      int length = std::min(twoChunked.size() - head, flips(gen));
+      requestParser.process(std::string_view{twoChunked}.substr(head, length));
+      head += length;
+    }
+    requests = requestParser.takeRequests();
+    assert(requests.size() == 3);
+    assert(requests.front().body == "hello abcdefghijklmnopqrstuvwxyz");
     assertRequestEquality(requests[1], parsed);
     assertRequestEquality(requests.front(), requests.back());
   }
 
+  //and go to a file, or straight to the handler, just like the others
+  HTTP::ParserOptions chunkSpooling { .spoolThreshold = 8 };
+  HTTP::RequestParser chunkSpooler {chunkSpooling};
+  chunkSpooler.process(twoChunked);
+  requests = chunkSpooler.takeRequests();
+  assert(requests.size() == 3 && requests.back().body == "hello abcdefghijklmnopqrstuvwxyz");
+  assertRequestEquality(requests[1], parsed);
+
+  streamer.process(std::string{chunkedRequest}.replace(5, 8, "/upload") + std::string{getRequest});
+  requests = streamer.takeRequests();
+  assert(requests.size() == 2 && requests.front().bodyStream && !streamer.streamingBody());
+  streamed.clear();
+  while (std::optional<BodyChunk> chunk = requests.front().bodyStream->next()) streamed += chunk->data;
+  assert(streamed == "hello abcdefghijklmnopqrstuvwxyz" && requests.front().bodyStream->complete());
+  assertRequestEquality(requests.back(), parsed);
+
+  //framing we can't trust is refused
+  for (std::string_view bad: {
+    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n",
+    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n2\r\nabc\r\n",
+    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 3\r\n\r\n",
+  }) {
+    HTTP::RequestParser strict {};
+    strict.process(bad);
+    assert(strict.rejected() == Response::StatusCode::BAD_REQUEST && !strict.hasRequests());
+  }
+  HTTP::RequestParser strict {};
+  strict.process("POST / HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n");
+  assert(strict.rejected() == Response::StatusCode::NOT_IMPLEMENTED);
+  limited.clear();
+  limited.process("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n10\r\n0123456789abcdef\r\n1\r\n");
+  assert(limited.rejected() == Response::StatusCode::PAYLOAD_TOO_LARGE);
+  //a chunk size big enough to wrap the body's length around is over any limit, or none
+  for (size_t maxBodyBytes: {size_t{0}, size_t{64}}) {
+    HTTP::ParserOptions bounded { .maxBodyBytes = maxBodyBytes };
+    for (std::string_view size: {"ffffffffffffffff", "fffffffffffffffc"}) {
+      HTTP::RequestParser wrapped {bounded};
+      wrapped.process(std::format(
+        "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n{}\r\nGET /smuggled HTTP/1.1\r\n\r\n", size
+      ));
+      assert(wrapped.rejected() == Response::StatusCode::PAYLOAD_TOO_LARGE && !wrapped.hasRequests());
+    }
+    HTTP::RequestParser tooWide {bounded};
+    tooWide.process("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n10000000000000000\r\n");
+    assert(tooWide.rejected() == Response::StatusCode::BAD_REQUEST);
+  }
+
+  //as is a Content-Length we can't read exactly, before it gets to say where the next request starts - with a limit on
+  //bodies or without
+  using Refusal = std::pair<std::string_view, Response::StatusCode>;
+  for (const auto& [length, status]: {
+    Refusal {"99999999999999999999999", Response::StatusCode::PAYLOAD_TOO_LARGE},
+    Refusal {"18446744073709551616", Response::StatusCode::PAYLOAD_TOO_LARGE},
+    Refusal {"-1", Response::StatusCode::BAD_REQUEST},
+    Refusal {"+4", Response::StatusCode::BAD_REQUEST},
+    Refusal {"4x", Response::StatusCode::BAD_REQUEST},
+    Refusal {"", Response::StatusCode::BAD_REQUEST},
+    Refusal {"4\r\nContent-Length: 5", Response::StatusCode::BAD_REQUEST},
+  }) {
+    for (size_t maxBodyBytes: {size_t{0}, size_t{64}}) {
+      HTTP::ParserOptions bounded { .maxBodyBytes = maxBodyBytes };
+      HTTP::RequestParser smuggled {bounded};
+      smuggled.process(std::format("POST / HTTP/1.1\r\nContent-Length: {}\r\n\r\nGET /smuggled HTTP/1.1\r\n\r\n", length));
+      assert(smuggled.rejected() == status && !smuggled.hasRequests());
+    }
+  }
+  limited.clear();
+  limited.process("POST / HTTP/1.1\r\nContent-Length: 18446744073709551615\r\n\r\n");
+  assert(limited.rejected() == Response::StatusCode::PAYLOAD_TOO_LARGE);
+  //the same length twice is fine
+  HTTP::RequestParser repeated {};
+  repeated.process("POST / HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: 3\r\n\r\nabc");
+  assert(!repeated.rejected() && repeated.takeRequests().front().body == "abc");
+
   //todo error handling checks
   return 0;
 }
@@ -0,0 +1,116 @@
+#include <cassert>
+#include <chrono>
+#include <format>
+#include <string>
+
+#include "server/responseCache.h"
+
+using namespace MyServer;
+using namespace std::chrono_literals;
+
+Request get(std::string_view endpoint, std::string_view query, std::string_view headers = {}) {
+  Request request {};
+  request.endpoint = endpoint;
+  request.rawQuery = query;
+  request.rawHeaders = headers;
+  return request;
+}
+
+Response ok(std::string body) {
+  return { .statusCode = Response::StatusCode::OK, .contentType = Response::ContentType::JSON, .body = std::move(body) };
+}
+
+std::string sent(const Response& response) {
+  assert(response.canned);
+  return std::string{response.canned.statusLine()} + std::string{response.canned.rest()};
+}
+
+int main() {
+  {
+    ResponseCache cache {0};
+    Request request = get("/todo", "id=1&lang=en");
+    assert(!cache.lookup(request));
+    Response stored = cache.store(request, 1min, ok(R"({"done":true})"), cache.generation());
+    std::string etag = ResponseCache::etagFor(R"({"done":true})");
+    assert(sent(stored).starts_with("HTTP/1.1 200 OK\r\n"));
+    assert(sent(stored).contains("ETag: " + etag + "\r\n"));
+    assert(sent(stored).ends_with("\r\n\r\n{\"done\":true}"));
+
+    //the order of the parameters doesn't matter
+    std::optional<Response> hit = cache.lookup(get("/todo", "lang=en&id=1"));
+    assert(hit && sent(*hit) == sent(stored));
+    assert(!cache.lookup(get("/todo", "id=1")));
+    assert(!cache.lookup(get("/todos", "id=1&lang=en")));
+
+    //a client that has it already gets a 304, with the validator but no body
+    std::string headers = std::format("Accept: */*\r\nIf-None-Match: \"nope\", W/{}\r\n", etag);
+    std::optional<Response> unchanged = cache.lookup(get("/todo", "id=1&lang=en", headers));
+    assert(unchanged && sent(*unchanged).starts_with("HTTP/1.1 304 Not Modified\r\n"));
+    assert(sent(*unchanged).ends_with("ETag: " + etag + "\r\n\r\n"));
+    assert(!sent(*unchanged).contains("Content-Length"));
+
+    const CacheStats& stats = cache.statistics();
+    assert(stats.hits == 2 && stats.notModified == 1 && stats.misses == 3 && stats.stores == 1);
+  }
+  {
+    //but the order of a repeated parameter's values does
+    ResponseCache cache {0};
+    cache.store(get("/todo", "id=1&id=2&lang=en"), 1min, ok("[1,2]"), cache.generation());
+    assert(!cache.lookup(get("/todo", "id=2&id=1&lang=en")));
+    std::optional<Response> hit = cache.lookup(get("/todo", "lang=en&id=1&id=2"));
+    assert(hit && sent(*hit).ends_with("[1,2]"));
+  }
+  {
+    //only whole 200s are kept
+    ResponseCache cache {0};
+    Request request = get("/todo", "id=2");
+    Response missing = cache.store(request, 1min, { .statusCode = Response::StatusCode::NOT_FOUND }, cache.generation());
+    assert(!missing.canned && missing.statusCode == Response::StatusCode::NOT_FOUND);
+    Response streamed = ok("{");
+    streamed.stream = []() -> std::optional<std::string> { return {}; };
+    cache.store(request, 1min, std::move(streamed), cache.generation());
+    assert(!cache.lookup(request));
+  }
+  {
+    ResponseCache cache {0};
+    Request request = get("/todo", "id=3");
+    cache.store(request, 0ms, ok("{}"), cache.generation());
+    assert(!cache.lookup(request));
+    assert(cache.statistics().expirations == 1 && cache.statistics().bytes == 0);
+  }
+  {
+    ResponseCache cache {0};
+    cache.store(get("/todo", "id=4"), 1min, ok("{}"), cache.generation());
+    cache.store(get("/todo", "id=5"), 1min, ok("{}"), cache.generation());
+    cache.store(get("/other", "id=4"), 1min, ok("{}"), cache.generation());
+    cache.invalidate("/todo", "id=5");
+    assert(cache.lookup(get("/todo", "id=4")) && !cache.lookup(get("/todo", "id=5")));
+    cache.invalidate("/todo");
+    assert(!cache.lookup(get("/todo", "id=4")) && cache.lookup(get("/other", "id=4")));
+    assert(cache.statistics().invalidations == 2);
+
+    //a response made while an invalidation happened might be from before it, so it isn't kept
+    unsigned long generation = cache.generation();
+    cache.invalidate("/todo");
+    Response reply = cache.store(get("/todo", "id=4"), 1min, ok("{}"), generation);
+    assert(reply.canned && !cache.lookup(get("/todo", "id=4")));
+  }
+  {
+    //room for about one response per shard, so most of these push an older one out
+    constexpr size_t limit = 16 * 1024;
+    ResponseCache cache {limit};
+    for (int i = 0; i < 200; ++i) {
+      cache.store(get("/todo", std::format("id={}", i)), 1min, ok(std::string(300, 'x')), cache.generation());
+    }
+    const CacheStats& stats = cache.statistics();
+    assert(stats.stores == 200 && stats.evictions > 100);
+    assert(stats.bytes <= limit);
+    //the last one in is the most recently used in its shard
+    assert(cache.lookup(get("/todo", "id=199")));
+  }
+
+  assert(ResponseCache::matches("*", "\"a\""));
+  assert(ResponseCache::matches(" \"b\" ,\"a\"", "\"a\""));
+  assert(!ResponseCache::matches("\"b\"", "\"a\""));
+  assert(!ResponseCache::matches("", "\"a\""));
+}
@@ -0,0 +1,111 @@
+#include <cassert>
+#include <string>
+
+#include "server/router.h"
+
+using namespace MyServer;
+
+// each route's handler answers with the pattern it was registered with, so we can tell which one matched
+Router routes(std::initializer_list<std::string> patterns) {
+  Router router;
+  for (const std::string& pattern: patterns) {
+    Handler handler = [pattern](Request&) { return Response { .body = pattern }; };
+    Route* route = router.add(pattern, std::move(handler), ExecutionPolicy::WORKER);
+    assert(route);
+  }
+  return router;
+}
+
+std::string matched(const Router& router, std::string_view endpoint, Router::Captures& captures) {
+  const Route* route = router.match(endpoint, captures);
+  if (!route) return "";
+  Request request {};
+  return route->handler(request).body;
+}
+
+std::string matched(const Router& router, std::string_view endpoint) {
+  Router::Captures captures;
+  return matched(router, endpoint, captures);
+}
+
+int main() {
+  {
+    Router router = routes({"/", "/todo", "/todos", "/todo/new", "/team", "/te"});
+    assert(router.size() == 6);
+    assert(matched(router, "/") == "/");
+    assert(matched(router, "/todo") == "/todo");
+    assert(matched(router, "/todos") == "/todos");
+    assert(matched(router, "/todo/new") == "/todo/new");
+    assert(matched(router, "/team") == "/team");
+    assert(matched(router, "/te") == "/te");
+    assert(matched(router, "/t").empty());
+    assert(matched(router, "/todo/").empty());
+    assert(matched(router, "/teams").empty());
+    assert(matched(router, "").empty());
+  }
+  {
+    Router router = routes({
+      "/todo/new", "/todo/{id}", "/todo/{id}/tags/{tag}", "/todo/{id}/tags/new", "/static/{path...}", "/static/index"
+    });
+    Router::Captures captures;
+    assert(matched(router, "/todo/42", captures) == "/todo/{id}");
+    assert(captures.size() == 1 && captures.find("id", std::equal_to<>{}) == "42");
+
+    //literal text wins, but a capture is tried when it leads nowhere
+    assert(matched(router, "/todo/new") == "/todo/new");
+    captures = {};
+    assert(matched(router, "/todo/newer", captures) == "/todo/{id}");
+    assert(captures.find("id", std::equal_to<>{}) == "newer");
+    assert(matched(router, "/todo/new/tags/new") == "/todo/{id}/tags/new");
+
+    captures = {};
+    assert(matched(router, "/todo/7/tags/urgent", captures) == "/todo/{id}/tags/{tag}");
+    assert(captures.size() == 2);
+    assert(captures.find("id", std::equal_to<>{}) == "7" && captures.find("tag", std::equal_to<>{}) == "urgent");
+
+    //a capture is never empty, and never more than a segment
+    assert(matched(router, "/todo/").empty());
+    assert(matched(router, "/todo/7/tags/").empty());
+    assert(matched(router, "/todo/7/tags/a/b").empty());
+
+    //a tail takes the rest, slashes and all, or nothing
+    captures = {};
+    assert(matched(router, "/static/js/app.js", captures) == "/static/{path...}");
+    assert(captures.size() == 1 && captures.find("path", std::equal_to<>{}) == "js/app.js");
+    captures = {};
+    assert(matched(router, "/static/", captures) == "/static/{path...}");
+    assert(captures.find("path", std::equal_to<>{}) == "");
+    assert(matched(router, "/static/index") == "/static/index");
+    assert(matched(router, "/static").empty());
+  }
+  {
+    //a capture that led nowhere leaves nothing behind
+    Router router = routes({"/a/{x}/b", "/a/{x...}"});
+    Router::Captures captures;
+    assert(matched(router, "/a/1/c", captures) == "/a/{x...}");
+    assert(captures.size() == 1 && captures.find("x", std::equal_to<>{}) == "1/c");
+  }
+  {
+    Router router = routes({"/todo"});
+    //registering a pattern again replaces its route
+    Route* replaced = router.add("/todo", [](Request&) { return Response { .body = "again" }; }, ExecutionPolicy::WORKER);
+    assert(replaced && router.find("/todo") == replaced && router.size() == 1);
+    assert(matched(router, "/todo") == "again");
+    assert(!router.find("/todos"));
+
+    auto add = [&](const std::string& pattern) { return router.add(pattern, Handler{}, ExecutionPolicy::WORKER); };
+    assert(!add("todo"));
+    assert(!add("/todo/{}"));
+    assert(!add("/todo/{id"));
+    assert(!add("/todo/x{id}"));
+    assert(!add("/todo/{id}x"));
+    assert(!add("/todo/{rest...}/more"));
+    //the same place can't capture under two names
+    assert(add("/user/{id}"));
+    assert(!add("/user/{name}/posts"));
+    assert(add("/user/{id}/posts"));
+    assert(router.size() == 3);
+    assert(matched(router, "/todo") == "again");
+  }
+  return 0;
+}